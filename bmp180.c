@@ -24,9 +24,11 @@
 /* For maple-unwired */
 #include <unwired.h>
 #include <i2c.h>
+#include <regmap.h>
 
-static int bmp_temp ( struct i2c * );
-static int bmp_pressure ( struct i2c * );
+static int bmp_temp ( void );
+static int bmp_pressure ( void );
+static void bmp_bus ( struct i2c * );
 
 /* ------------------------------------------------------------- */
 /* ------------------------------------------------------------- */
@@ -197,7 +199,8 @@ bmp_tf ( struct i2c *ip )
 	int tc;
 	int tf;
 
-	traw = bmp_temp ( ip );
+	bmp_bus ( ip );
+	traw = bmp_temp ();
 
 	// printf ( "Raw T = %d (%h)\n", traw, traw );
 
@@ -221,7 +224,8 @@ bmp_press ( struct i2c *ip )
 	int praw;
 	int p;
 
-	praw = bmp_pressure ( ip );
+	bmp_bus ( ip );
+	praw = bmp_pressure ();
 	p = conv_pressure ( praw );
 
 	// return p + MB_TUCSON;
@@ -292,71 +296,37 @@ show_cals ( void *cals )
 /* -------------------------------------------------------------------- */
 /* -------------------------------------------------------------------- */
 
-/* Glue routines (sort of) to emulate Kyu interface.
- * Mostly taken directly from kyu/bbb/i2c.c
+/* All the registers we use, from the first calibration
+ *  value to the last byte of the result, are in one shadow,
+ *  see regmap.c
  */
+#define REG_FIRST	REG_CALS
+#define REG_LAST	0xF8		/* result XLSB */
+#define NREGS		(REG_LAST - REG_FIRST + 1)
 
-void
-i2c_read_reg_n ( struct i2c *ip, int addr, int reg, unsigned char *buf, int n )
-{
-        buf[0] = reg;
-
-        if ( i2c_send ( ip, addr, buf, 1 ) )
-            printf ( "send Trouble\n" );
-
-        if ( i2c_recv ( ip, addr, buf, n ) )
-            printf ( "recv Trouble\n" );
-}
-
-void
-i2c_write_8 ( struct i2c *ip, int addr, int reg, int val )
-{
-        char buf[2];
-
-        buf[0] = reg;
-        buf[1] = val;
-
-        if ( i2c_send ( ip, addr, buf, 2 ) )
-            printf ( "i2c_write, send trouble\n" );
-}
-
-int
-i2c_read_8 ( struct i2c *ip, int addr, int reg )
-{
-        char buf[1];
+static unsigned char bmp_shadow[NREGS];
 
-        i2c_read_reg_n ( ip, addr, reg, buf, 1 );
+static struct regmap bmp_map = {
+	.addr = BMP_ADDR,
+	.width = 1,
+	.flags = 0,		/* MSB first */
+	.base = REG_FIRST,
+	.nregs = NREGS,
+	.shadow = bmp_shadow
+};
 
-        return buf[0] & 0xff;
-}
-
-int
-i2c_read_16 ( struct i2c *ip, int addr, int reg )
+static void
+bmp_read ( int reg, int n )
 {
-        int rv;
-        unsigned char buf[2];
-
-        i2c_read_reg_n ( ip, addr, reg, buf, 2 );
-
-        rv = buf[0] << 8;
-        rv |= buf[1];
-
-        return rv;
+        if ( regmap_read ( &bmp_map, reg, n ) )
+            printf ( "xfer Trouble\n" );
 }
 
-int
-i2c_read_24 ( struct i2c *ip, int addr, int reg )
+static void
+bmp_write ( int reg, int val )
 {
-        int rv;
-        unsigned char buf[3];
-
-        i2c_read_reg_n ( ip, addr, reg, buf, 3 );
-
-        rv =  buf[0] << 16;
-        rv |= buf[1] << 8;
-        rv |= buf[2];
-
-        return rv;
+        if ( regmap_write ( &bmp_map, reg, val ) )
+            printf ( "i2c_write, send trouble\n" );
 }
 
 /* -------------------------------------------------------------------- */
@@ -366,65 +336,67 @@ i2c_read_24 ( struct i2c *ip, int addr, int reg )
 /* ID register -- should always yield 0x55
  */
 static int
-bmp_id ( struct i2c *ip )
+bmp_id ( void )
 {
-	return i2c_read_8 ( ip, BMP_ADDR, REG_ID );
+	bmp_read ( REG_ID, 1 );
+	return regmap_u8 ( &bmp_map, REG_ID );
 }
 
 static int
-bmp_temp ( struct i2c *ip )
+bmp_temp ( void )
 {
-	int rv;
-
 	// (void) iic_write ( BMP_ADDR, REG_CONTROL, CMD_TEMP );
-	i2c_write_8 ( ip, BMP_ADDR, REG_CONTROL, CMD_TEMP );
+	bmp_write ( REG_CONTROL, CMD_TEMP );
 
 	delay_us ( TDELAY );
 
-	// rv = iic_read_16 ( BMP_ADDR, REG_RESULT );
-	rv = i2c_read_16 ( ip, BMP_ADDR, REG_RESULT );
-
-	return rv;
+	bmp_read ( REG_RESULT, 2 );
+	return regmap_u16 ( &bmp_map, REG_RESULT );
 }
 
 /* Pressure reads 3 bytes
  */
 
 static int
-bmp_pressure ( struct i2c *ip )
+bmp_pressure ( void )
 {
-	int rv;
-
 	// (void) iic_write ( BMP_ADDR, REG_CONTROL, CMD_PRESS );
-	i2c_write_8 ( ip, BMP_ADDR, REG_CONTROL, CMD_PRESS );
+	bmp_write ( REG_CONTROL, CMD_PRESS );
 
 	delay_us ( PDELAY );
 
-	// rv = iic_read_24 ( BMP_ADDR, REG_RESULT );
-	rv = i2c_read_24 ( ip, BMP_ADDR, REG_RESULT );
-
-	return rv >> PSHIFT;
+	bmp_read ( REG_RESULT, 3 );
+	return regmap_u24 ( &bmp_map, REG_RESULT ) >> PSHIFT;
 }
 
+/* The calibration block never changes, so it is read
+ *  just once (in one transaction) and kept in the shadow.
+ */
 static void
-bmp_cals ( struct i2c *ip, unsigned short *buf )
+bmp_cals ( unsigned short *buf )
 {
-	char bbuf[2*NCALS];
-	int i, j;
+	int i;
 
 	/* Note that on the ESP8266 (or any little endian machine)
 	 * just placing the bytes into memory in the order read out
 	 * does not yield an array of shorts.
 	 * This is because the BMP180 gives the MSB first, but the
-	 * ESP8266 is little endian.
+	 * ESP8266 is little endian.  regmap_u16 sorts that out.
 	 */
 
-	i2c_read_reg_n ( ip, BMP_ADDR, REG_CALS, bbuf, 2*NCALS );
+	if ( regmap_cache ( &bmp_map, REG_CALS, 2*NCALS ) )
+	    printf ( "xfer Trouble\n" );
 
-	for ( i=0; i<NCALS; i++ ) {
-	    j = i + i;
-	    buf[i] = bbuf[j]<<8 | bbuf[j+1];
-	}
+	for ( i=0; i<NCALS; i++ )
+	    buf[i] = regmap_u16 ( &bmp_map, REG_CALS + 2*i );
+}
+
+/* Use the chip on this bus, calibration and all */
+static void
+bmp_bus ( struct i2c *ip )
+{
+	if ( regmap_bus ( &bmp_map, ip ) )
+	    bmp_cals ( (unsigned short *) &bmp_cal );
 }
 
 void
@@ -432,8 +404,9 @@ bmp_once ( struct i2c *ip )
 {
 	int t, p;
 
-	t = bmp_temp ( ip );
-	p = bmp_pressure ( ip );
+	bmp_bus ( ip );
+	t = bmp_temp ();
+	p = bmp_pressure ();
 
 	printf ( "Raw T, P = %d (%h)  %d (%h)\n", t, t, p, p );
 
@@ -452,27 +425,29 @@ bmp_diag1 ( struct i2c *ip )
 	unsigned short cals[11];
 	int i;
 
+	regmap_init ( &bmp_map, ip );
+
 	for ( i=0; i<8; i++ ) {
-	    id = bmp_id ( ip );
-	    printf ( "BMP ID = %x\n", id );
+	    id = bmp_id ();
+	    printf ( "BMP ID = %02X\n", id );
 	}
 
 	for ( i=0; i<8; i++ ) {
-	    tt = bmp_temp ( ip );
+	    tt = bmp_temp ();
 	    printf ( "BMP temp = %d (%h)\n", tt, tt );
 	}
 
 	for ( i=0; i<8; i++ ) {
-	    id = bmp_id ( ip );
-	    printf ( "BMP ID = %x\n", id );
-	    tt = bmp_temp ( ip );
+	    id = bmp_id ();
+	    printf ( "BMP ID = %02X\n", id );
+	    tt = bmp_temp ();
 	    printf ( "BMP temp = %d (%h)\n", tt, tt );
 	}
 
-	pp = bmp_pressure ( ip );
+	pp = bmp_pressure ();
 	printf ( "BMP pressure = %d (%h)\n", pp, pp );
 
-	bmp_cals ( ip, (unsigned short *) &bmp_cal );
+	bmp_cals ( (unsigned short *) &bmp_cal );
 	show_cals ( (void *) &bmp_cal );
 
 	// for ( i=0; i<8; i++ ) {
@@ -487,8 +462,9 @@ bmp_diag ( struct i2c *ip )
 {
 	int id, tf, pp;
 
-	id = bmp_id ( ip );
-	printf ( "BMP ID = %x\n", id );
+	bmp_bus ( ip );
+	id = bmp_id ();
+	printf ( "BMP ID = %02X\n", id );
 
 	tf = bmp_tf ( ip );
 	printf ( "BMP Tf = %d\n", tf );
@@ -497,10 +473,12 @@ bmp_diag ( struct i2c *ip )
 	printf ( "BMP pressure = %d\n", pp );
 }
 
+/* Everything after this talks to the chip on this bus */
 void
 bmp_init ( struct i2c *ip )
 {
-	bmp_cals ( ip, (unsigned short *) &bmp_cal );
+	regmap_init ( &bmp_map, ip );
+	bmp_cals ( (unsigned short *) &bmp_cal );
 	// bmp_diag1 ( ip );
 	bmp_diag ( ip );
 }
@@ -28,142 +28,7 @@
 /* For maple-unwired */
 #include <unwired.h>
 #include <i2c.h>
-
-/* -------------------------------------------------------------------- */
-/* -------------------------------------------------------------------- */
-/* -------------------------------------------------------------------- */
-
-/* Glue routines (sort of) to emulate Kyu interface.
- * Mostly taken directly from kyu/bbb/i2c.c
- */
-
-static void
-i2c_read_reg_n ( struct i2c *ip, int addr, int reg, unsigned char *buf, int n )
-{
-        buf[0] = reg;
-
-        if ( i2c_send ( ip, addr, buf, 1 ) )
-            printf ( "send Trouble\n" );
-
-        if ( i2c_recv ( ip, addr, buf, n ) )
-            printf ( "recv Trouble\n" );
-}
-
-static void
-i2c_write_8 ( struct i2c *ip, int addr, int reg, int val )
-{
-        char buf[2];
-
-        buf[0] = reg;
-        buf[1] = val;
-
-        if ( i2c_send ( ip, addr, buf, 2 ) )
-            printf ( "i2c_write, send trouble\n" );
-}
-
-static int
-i2c_read_8 ( struct i2c *ip, int addr, int reg )
-{
-        unsigned char buf[1];
-
-        i2c_read_reg_n ( ip, addr, reg, buf, 1 );
-
-        return buf[0] & 0xff;
-}
-
-/* We want a signed 8 bit value */
-static int
-i2c_read_8s ( struct i2c *ip, int addr, int reg )
-{
-        signed char buf[1];
-
-        i2c_read_reg_n ( ip, addr, reg, buf, 1 );
-
-        return (int) buf[0];
-}
-
-static int
-i2c_read_16 ( struct i2c *ip, int addr, int reg )
-{
-        int rv;
-        unsigned char buf[2];
-
-        i2c_read_reg_n ( ip, addr, reg, buf, 2 );
-
-        rv = buf[0] << 8;
-        rv |= buf[1];
-
-        return rv;
-}
-
-/* little endian version of the above.
- * returns unsigned short
- */
-static int
-i2c_read_16_le ( struct i2c *ip, int addr, int reg )
-{
-        int rv;
-        unsigned char buf[2];
-
-        i2c_read_reg_n ( ip, addr, reg, buf, 2 );
-
-        rv = buf[1] << 8;
-        rv |= buf[0];
-
-        return rv;
-}
-
-/* little endian, returns signed short */
-static int
-i2c_read_16_les ( struct i2c *ip, int addr, int reg )
-{
-        int rv;
-        unsigned char buf[2];
-	short val;
-
-        i2c_read_reg_n ( ip, addr, reg, buf, 2 );
-
-        val = buf[1] << 8;
-        val |= buf[0];
-	rv = val;
-
-        return rv;
-}
-
-
-static int
-i2c_read_24 ( struct i2c *ip, int addr, int reg )
-{
-        int rv;
-        unsigned char buf[3];
-
-        i2c_read_reg_n ( ip, addr, reg, buf, 3 );
-
-        rv =  buf[0] << 16;
-        rv |= buf[1] << 8;
-        rv |= buf[2];
-
-        return rv;
-}
-
-static int
-i2c_read_24_le ( struct i2c *ip, int addr, int reg )
-{
-        int rv;
-        unsigned char buf[3];
-
-        i2c_read_reg_n ( ip, addr, reg, buf, 3 );
-
-        rv =  buf[2] << 16;
-        rv |= buf[1] << 8;
-        rv |= buf[0];
-
-        return rv;
-}
-
-/* -------------------------------------------------------------------- */
-/* -------------------------------------------------------------------- */
-/* -------------------------------------------------------------------- */
+#include <regmap.h>
 
 #define BMPX_ADDR	0x76
 #define REG_ID		0
@@ -190,6 +55,8 @@ i2c_read_24_le ( struct i2c *ip, int addr, int reg )
 #define REG_CAL_P10	0x44
 #define REG_CAL_P11	0x45
 
+#define CAL_SIZE	21
+
 #define CMD_CMD		0x10	/* ready for command */
 #define CMD_P		0x20	/* P ready for readout */
 #define CMD_T		0x40	/* T ready for readout */
@@ -203,27 +70,28 @@ i2c_read_24_le ( struct i2c *ip, int addr, int reg )
 
 #define FORCE		( PWR_P_ENA | PWR_T_ENA | PWR_FORCE )
 
-/* Note that with the single lone char for t3, we must
- * give gcc the "packed" attribute or we get an evil pad byte.
+/* Everything from the ID register to the last calibration
+ *  value is in one shadow, see regmap.c
  */
+#define NREGS		(REG_CAL_P11 + 1)
 
-struct bmp_cal_raw {
-	unsigned short t1;
-	unsigned short t2;
-	signed char t3;
-
-	short p1;
-	short p2;
-	signed char p3;
-	signed char p4;
-	unsigned short p5;
-	unsigned short p6;
-	signed char p7;
-	signed char p8;
-	short p9;
-	signed char p10;
-	signed char p11;
-} __attribute__((packed));
+static unsigned char bmpx_shadow[NREGS];
+
+static struct regmap bmpx_map = {
+	.addr = BMPX_ADDR,
+	.width = 1,
+	.flags = REGMAP_LE,
+	.base = 0,
+	.nregs = NREGS,
+	.shadow = bmpx_shadow
+};
+
+static void
+bmpx_read ( int reg, int n )
+{
+        if ( regmap_read ( &bmpx_map, reg, n ) )
+            printf ( "xfer Trouble\n" );
+}
 
 struct bmp_cal {
 	int t1;
@@ -246,99 +114,98 @@ struct bmp_cal {
 static struct bmp_cal cals;
 
 /* Returns 0x60 (the bmp180 gave 0x55)
+ * ID and REV never change, bmpx_init caches them.
  */
 static int
-bmpx_id ( struct i2c *ip )
+bmpx_id ( void )
 {
-	return i2c_read_8 ( ip, BMPX_ADDR, REG_ID );
+	bmpx_read ( REG_ID, 1 );
+	return regmap_u8 ( &bmpx_map, REG_ID );
 }
 
 static int
-bmpx_rev ( struct i2c *ip )
+bmpx_rev ( void )
 {
-	return i2c_read_8 ( ip, BMPX_ADDR, REG_REV );
+	bmpx_read ( REG_REV, 1 );
+	return regmap_u8 ( &bmpx_map, REG_REV );
 }
 
-static int
-bmpx_err ( struct i2c *ip )
-{
-	return i2c_read_8 ( ip, BMPX_ADDR, REG_ERR );
-}
-
-static int
-bmpx_stat ( struct i2c *ip )
+static void
+bmpx_force ( void )
 {
-	return i2c_read_8 ( ip, BMPX_ADDR, REG_STAT );
+	if ( regmap_write ( &bmpx_map, REG_PWR, FORCE ) )
+	    printf ( "i2c_write, send trouble\n" );
 }
 
+/* Pressure and temperature are 6 registers in a row,
+ *  so get both in one go, then pick them out.
+ */
 static void
-bmpx_force ( struct i2c *ip )
+bmpx_data ( void )
 {
-	i2c_write_8 ( ip, BMPX_ADDR, REG_PWR, FORCE );
+	bmpx_read ( REG_PRESS, 6 );
 }
 
 static int
-bmpx_temp ( struct i2c *ip )
+bmpx_temp ( void )
 {
-	return i2c_read_24_le ( ip, BMPX_ADDR, REG_TEMP );
+	return regmap_u24 ( &bmpx_map, REG_TEMP );
 }
 
 static int
-bmpx_press ( struct i2c *ip )
+bmpx_press ( void )
 {
-	return i2c_read_24_le ( ip, BMPX_ADDR, REG_PRESS );
+	return regmap_u24 ( &bmpx_map, REG_PRESS );
 }
 
 static void
-bmpx_show ( struct i2c *ip )
+bmpx_show ( void )
 {
 	int err, stat;
 
-	err = bmpx_err ( ip );
-	stat = bmpx_stat ( ip );
+	bmpx_read ( REG_ERR, 2 );
+	err = regmap_u8 ( &bmpx_map, REG_ERR );
+	stat = regmap_u8 ( &bmpx_map, REG_STAT );
 	printf ( " err, stat = %h %h\n", err, stat );
 }
 
-#define CAL_SIZE	21
-
 /* Amazingly enough, the device handles this just fine,
  * reading out all the calibration registers in a single
- * transaction.
+ * transaction.  This used to be 14 of them, one per value.
  */
 static void
-bmpx_read_cal_data ( struct i2c *ip )
+bmpx_read_cals ( void )
 {
-	unsigned char cal_buf[32];
-	struct bmp_cal_raw raw;
-
-        i2c_read_reg_n ( ip, BMPX_ADDR, REG_CAL_T1, cal_buf, CAL_SIZE );
-
-	printf ( "Raw cal struct is %d\n", sizeof(struct bmp_cal_raw) );
-	if ( sizeof(struct bmp_cal_raw) != 21 )
-	    printf ( "Bad compiler jive, dude!\n" );
-	printf ( "T1 is at - %h\n", &raw.t1 );
-	printf ( "P11 is at - %h\n", &raw.p11 );
-
+	struct regmap *rp = &bmpx_map;
+
+	if ( regmap_cache ( rp, REG_CAL_T1, CAL_SIZE ) )
+	    printf ( "xfer Trouble\n" );
+
+	cals.t1 = regmap_u16 ( rp, REG_CAL_T1 );
+	cals.t2 = regmap_u16 ( rp, REG_CAL_T2 );
+	cals.t3 = regmap_s8 ( rp, REG_CAL_T3 );
+
+	cals.p1 = regmap_s16 ( rp, REG_CAL_P1 );
+	cals.p2 = regmap_s16 ( rp, REG_CAL_P2 );
+	cals.p3 = regmap_s8 ( rp, REG_CAL_P3 );
+	cals.p4 = regmap_s8 ( rp, REG_CAL_P4 );
+	cals.p5 = regmap_u16 ( rp, REG_CAL_P5 );
+	cals.p6 = regmap_u16 ( rp, REG_CAL_P6 );
+	cals.p7 = regmap_s8 ( rp, REG_CAL_P7 );
+	cals.p8 = regmap_s8 ( rp, REG_CAL_P8 );
+	cals.p9 = regmap_s16 ( rp, REG_CAL_P9 );
+	cals.p10 = regmap_s8 ( rp, REG_CAL_P10 );
+	cals.p11 = regmap_s8 ( rp, REG_CAL_P11 );
 }
 
+/* Use the chip on this bus, calibration and all */
 static void
-bmpx_read_cals ( struct i2c *ip )
+bmpx_bus ( struct i2c *ip )
 {
-	cals.t1 = i2c_read_16_le ( ip, BMPX_ADDR, REG_CAL_T1 );
-	cals.t2 = i2c_read_16_le ( ip, BMPX_ADDR, REG_CAL_T2 );
-	cals.t3 = i2c_read_8s ( ip, BMPX_ADDR, REG_CAL_T3 );
-
-	cals.p1 = i2c_read_16_les ( ip, BMPX_ADDR, REG_CAL_P1 );
-	cals.p2 = i2c_read_16_les ( ip, BMPX_ADDR, REG_CAL_P2 );
-	cals.p3 = i2c_read_8s ( ip, BMPX_ADDR, REG_CAL_P3 );
-	cals.p4 = i2c_read_8s ( ip, BMPX_ADDR, REG_CAL_P4 );
-	cals.p5 = i2c_read_16_le ( ip, BMPX_ADDR, REG_CAL_P5 );
-	cals.p6 = i2c_read_16_le ( ip, BMPX_ADDR, REG_CAL_P6 );
-	cals.p7 = i2c_read_8s ( ip, BMPX_ADDR, REG_CAL_P7 );
-	cals.p8 = i2c_read_8s ( ip, BMPX_ADDR, REG_CAL_P8 );
-	cals.p9 = i2c_read_16_les ( ip, BMPX_ADDR, REG_CAL_P9 );
-	cals.p10 = i2c_read_8s ( ip, BMPX_ADDR, REG_CAL_P10 );
-	cals.p11 = i2c_read_8s ( ip, BMPX_ADDR, REG_CAL_P11 );
+	if ( regmap_bus ( &bmpx_map, ip ) ) {
+	    (void) regmap_cache ( &bmpx_map, REG_ID, 2 );
+	    bmpx_read_cals ();
+	}
 }
 
 static void
@@ -550,10 +417,12 @@ bmpx_tf ( struct i2c *ip )
 {
 	int tt, tc, tf;
 
-	bmpx_force ( ip );
+	bmpx_bus ( ip );
+	bmpx_force ();
 	delay ( 200 );
 
-	tt = bmpx_temp ( ip );
+	bmpx_data ();
+	tt = bmpx_temp ();
 	tc = convert_temp ( tt );
 	tf = tc * 18;
 	tf = 3200 + tf / 10;
@@ -570,27 +439,28 @@ bmpx_diag ( struct i2c *ip )
 	int p;
 	int i;
 
+	bmpx_bus ( ip );
+
 #ifdef notdef
 	for ( i=0; i<2; i++ ) {
-	    id = bmpx_id ( ip );
-	    printf ( "BMPX ID = %x\n", id );
-	    id = bmpx_rev ( ip );
-	    printf ( "BMPX REV = %x\n", id );
+	    id = bmpx_id ();
+	    printf ( "BMPX ID = %02X\n", id );
+	    id = bmpx_rev ();
+	    printf ( "BMPX REV = %02X\n", id );
 	}
 
-	bmpx_read_cals ( ip );
+	bmpx_read_cals ();
 	bmpx_show_cals ();
 #endif
 
 	for ( i=0; i<1; i++ ) {
-	    bmpx_force ( ip );
-	    // bmpx_show ( ip );
+	    bmpx_force ();
+	    // bmpx_show ();
 	    delay ( 200 );
-	    // bmpx_show ( ip );
+	    // bmpx_show ();
 
-	    // pp = bmpx_press ( ip );
-	    // printf ( "BMPX pressure = %d (%h)\n", pp, pp );
-	    tt = bmpx_temp ( ip );
+	    bmpx_data ();
+	    tt = bmpx_temp ();
 	    printf ( "BMPX raw temp = %d (%h)\n", tt, tt );
 	    tc = convert_temp ( tt );
 	    printf ( "BMPX temp (C*100) = %d\n", tc );
@@ -598,7 +468,7 @@ bmpx_diag ( struct i2c *ip )
 	    tf = 3200 + tf / 10;
 	    printf ( "BMPX temp (F*100) = %d\n", tf );
 
-	    pp = bmpx_press ( ip );
+	    pp = bmpx_press ();
 	    printf ( "BMPX raw pressure = %d (%h)\n", pp, pp );
 	    p = convert_pressure ( pp );
 	    printf ( "BMPX pressure () = %d\n", p );
@@ -616,22 +486,22 @@ bmpx_diag ( struct i2c *ip )
 #endif
 }
 
+/* Everything after this talks to the chip on this bus */
 void
 bmpx_init ( struct i2c *ip )
 {
 	int id;
 
-	id = bmpx_id ( ip );
-	printf ( "BMPX ID = %x\n", id );
-	id = bmpx_rev ( ip );
-	printf ( "BMPX REV = %x\n", id );
+	regmap_init ( &bmpx_map, ip );
+	(void) regmap_cache ( &bmpx_map, REG_ID, 2 );
 
-	/* old way */
-	bmpx_read_cals ( ip );
-	bmpx_show_cals ();
+	id = bmpx_id ();
+	printf ( "BMPX ID = %02X\n", id );
+	id = bmpx_rev ();
+	printf ( "BMPX REV = %02X\n", id );
 
-	/* new way */
-	bmpx_read_cal_data ( ip );
+	bmpx_read_cals ();
+	bmpx_show_cals ();
 
 	bmpx_diag ( ip );
 }
@@ -513,7 +513,7 @@ bmp_diag1 ( struct i2c *ip )
 
 	for ( i=0; i<8; i++ ) {
 	    id = bmp_id ( ip );
-	    printf ( "BMP ID = %x\n", id );
+	    printf ( "BMP ID = %02X\n", id );
 	}
 
 	for ( i=0; i<8; i++ ) {
@@ -523,7 +523,7 @@ bmp_diag1 ( struct i2c *ip )
 
 	for ( i=0; i<8; i++ ) {
 	    id = bmp_id ( ip );
-	    printf ( "BMP ID = %x\n", id );
+	    printf ( "BMP ID = %02X\n", id );
 	    tt = bmp_temp ( ip );
 	    printf ( "BMP temp = %d\n", tt );
 	}
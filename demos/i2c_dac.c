@@ -53,9 +53,6 @@
 
 #ifdef USE_IIC
 #include <libmaple/i2c.h>
-void iic_init ( int, int );
-void iic_recv ( int, char *, int );
-void iic_send ( int, char *, int );
 #else
 #include <libmaple/i2c.h>
 #endif
@@ -328,7 +325,7 @@ mcp_test ( void )
 static void
 dac_read ( struct i2c *ip, unsigned char *buf, int n )
 {
-        iic_recv ( MCP_ADDR, buf, n );
+        i2c_recv ( ip, MCP_ADDR, (char *) buf, n );
 }
 
 static void
@@ -339,9 +336,9 @@ dac_show ( struct i2c *ip )
 	memset ( io, 0, 5 );
         dac_read ( ip, io, 5 );
 
-        printf ( "DAC status = %x\n", io[0] );
-        printf ( "DAC val = %x %x\n", io[1], io[2] );
-        printf ( "DAC ee = %x %x\n", io[3], io[4] );
+        printf ( "DAC status = %02X\n", io[0] );
+        printf ( "DAC val = %02X %02X\n", io[1], io[2] );
+        printf ( "DAC ee = %02X %02X\n", io[3], io[4] );
 }
 #endif
 
@@ -47,6 +47,15 @@
 #include <serial.h>
 #include <delay.h>
 #include <time.h>
+#include <tlog.h>
+
+/* With i2c debug on, the i2c code logs with TLOG, and we send the
+ * records out this port in binary.  Watch them with:
+ *  support/scripts/tlog.py build/blue_pill.elf /dev/ttyUSB1
+ */
+#define TLOG_SERIAL	SERIAL_2
+
+static int tlog_fd;
 
 /* Notes on the libmaple i2c API.
  * It is all about calls to i2c_master_xfer(dev,msgs,num,timeout)
@@ -81,6 +90,7 @@ hdc_test ( void )
 	    // printf ( "************************* ***** ********************\n" );
 	    // printf ( "************************* WRITE ********************\n" );
 	    hdc_once ( ip, ++count );
+	    tlog_drain ( tlog_fd );
 	    // delay ( 200 );
 	    // delay ( 20 );
 	    // spin ();
@@ -105,6 +115,8 @@ main(void)
     set_std_serial ( fd );
 
     i2c_master_enable ( I2C2, 0, 100000 );
+    tlog_fd = serial_begin ( TLOG_SERIAL, 115200 );
+    tlog_init ();
     i2c_set_debug ( 99 );
 
     printf ( "-- BOOTED -- \n" );
@@ -138,6 +150,7 @@ i2c_trouble ( char *msg, int status )
 	else
 	    printf ( "Unknown error\n" );
 	printf ( "Trouble with i2c, spinning\n" );
+	tlog_drain ( tlog_fd );
 	spin ();
 }
 
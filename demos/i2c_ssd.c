@@ -473,6 +473,8 @@ main ( void )
 
 	/* For blue pill */
         xip = i2c_gpio_new ( PB11, PB10 );
+        /* or let timer 4 and DMA clock the bits out */
+        // xip = i2c_dma_new ( PB11, PB10 );
 
         if ( ! xip ) {
             printf ( "Cannot set up GPIO iic\n" );
@@ -200,6 +200,30 @@ show_val_rj ( int val, int y, int size )
 
 int starting_pressure;
 
+static int console_fd;
+static struct i2c *console_ip;
+
+/* One letter commands from the console, checked
+ *  between readings.
+ *  t - show the i2c event trace.  This only has
+ *      anything in it when we use the hardware i2c
+ *      (i2c_hw_new or i2c_auto_new), see i2c_trace_show()
+ *  s - show the i2c error and speed counts
+ */
+static void
+console_check ( void )
+{
+	int c;
+
+	while ( serial_available ( console_fd ) ) {
+	    c = serial_getc ( console_fd );
+	    if ( c == 't' )
+		i2c_trace_show ( console_fd );
+	    if ( c == 's' )
+		i2c_show_stats ( console_ip, console_fd );
+	}
+}
+
 /* The BMP180 datasheet tells us that a change in pressure of
  * 1 Pa is an 0.0843 meter change
  * .0843 * 3.28084 = .2766 feet change
@@ -258,6 +282,8 @@ depth ( struct i2c *ip )
 	p1 = bmp_press ( ip );
 	printf ( "Starting pressure: %d\n", p1 );
 
+	console_ip = ip;
+
 	/* Save this as reference for depth measurements */
 	starting_pressure = p1;
 
@@ -269,6 +295,7 @@ depth ( struct i2c *ip )
 	for ( ;; ) {
 	    delay ( 2000 );
 	    one_deep ( ip );
+	    console_check ();
 	}
 }
 
@@ -287,6 +314,7 @@ main(void)
 
     fd = serial_begin ( SERIAL_1, 115200 );
     set_std_serial ( fd );
+    console_fd = fd;
 
     printf ( "\n" );
     printf ( "-- BOOTED -- off we go\n" );
@@ -299,6 +327,17 @@ main(void)
     /* For blue pill */
     ip = i2c_gpio_new ( PB11, PB10 );
 
+    /* With this instead, the display refresh goes out in the
+     *  background a page at a time (see ssd_display) and the
+     *  sensor reads get in between pages.
+     */
+    // ip = i2c_dma_new ( PB11, PB10 );
+
+    /* Or this, the hardware on the same pins, which
+     *  drops back to bit banging if it gets in trouble.
+     */
+    // ip = i2c_auto_new ( 2 );
+
     if ( ! ip ) {
 	printf ( "Cannot set up GPIO iic\n" );
 	spin ();
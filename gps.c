@@ -80,6 +80,10 @@ $GNGGA,014126.00,3215.76919,N,11102.91426,W,1,05,1.59,740.6,M,-28.4,M,,*70
 /* NMEA must be no longer than 80 visible bytes, plus cr-lf terminator */
 #define NMEA_MAX	82
 
+/* The serial interrupt puts sentences together in here */
+#define NMEA_LINES	4
+static char nmea_pool[NMEA_LINES * NMEA_MAX];
+
 /* copy from src up to but not including comma */
 void
 copy_to_comma ( char *dest, char *src )
@@ -342,23 +346,18 @@ gps_line ( char *line )
 	toggleLED();
 }
 
+/* The serial port is in line mode, so the interrupt
+ * routine does all the work of putting lines together
+ * and we just pick them up.
+ */
 void
 gps ( int fd )
 {
-    int c;
-    char buf[NMEA_MAX];
-    char *p;
+    char *line;
 
-    p = buf;
     for ( ;; ) {
-	c = serial_getc ( fd );
-	if ( c == '\n' ) {
-	    *p = '\0';
-	    if ( p != buf )
-		gps_line ( buf );
-	    p = buf;
-	} else
-	    *p++ = c;
+	if ( serial_readline ( fd, &line ) )
+	    gps_line ( line );
     }
 }
 
@@ -377,7 +376,14 @@ main(void)
     fd = serial_begin ( SERIAL_1, 115200 );
     set_std_serial ( fd );
 
-    fd_gps = serial_begin ( SERIAL_2, 9600 );
+    /* Line mode leaves the RX ring idle, so don't waste
+     * arena on it.
+     */
+    fd_gps = serial_begin_sized ( SERIAL_2, 9600, 16, 0 );
+    if ( fd_gps < 0 || serial_lines ( fd_gps, nmea_pool, NMEA_LINES, NMEA_MAX, "\r\n" ) < 0 ) {
+	printf ( "Cannot set up the GPS serial port\n" );
+	spin ();
+    }
 
     /* D30 is sda, D29 is sclk */
     // ip = i2c_gpio_new ( D30, D29 );
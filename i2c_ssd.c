@@ -58,6 +58,10 @@ Note that these are pixel coordinates, so if you want to think in
 Note that nothing happens until you call ssd_display(), up to then
 all the action is going on in a local buffer.
 The call to ssd_display() actually writes to the device.
+It copies the buffer and queues it up a page at a time on the bus
+ (see i2c_submit), then returns, so you can start on the next frame
+ right away, and other drivers on the same bus can get a word in
+ between pages.
 
 One way to use my split color displays is to use the top 16 yellow
  pixels for a single line of text in size 2 (only 10 chars wide).
@@ -549,6 +553,10 @@ main ( void )
             spin ();
         }
 
+	/* The SSD1306 is good for 400 kHz */
+	i2c_set_speed ( xip, I2C_SPEED_FAST );
+	printf ( "SCL at %d Hz\n", i2c_scl_hz ( xip, SSD1306_I2C_ADDRESS ) );
+
 	printf ( "Initalize SSD\n" );
 	ssd_init ( xip );
 
@@ -596,47 +604,72 @@ ssd1306_command ( int c )
     // I2C_Stop(SSD1306_STREAM);
 }
 
-/* We always send to the display 16 bytes at a time.
- * 16 * 8 = 128 bits
+/* A refresh goes out as one transaction to set up the addressing,
+ *  then one per page (8 rows of pixels, 128 bytes), all at low
+ *  priority, so a sensor read waits for at most one page.
+ * The display keeps its place between our writes, so it doesn't
+ *  matter who else talks on the bus in between.
+ * Each piece needs its own copy of the data (with the 0x40 "data
+ *  follows" byte in front) that stays put until it has gone out.
  */
+#define NUM_PAGES	(HEIGHT / 8)
+#define PAGE_SIZE	(BUF_SIZE / NUM_PAGES)
+
+static unsigned char ssd_cmd_buf[7];
+static unsigned char ssd_page_buf[NUM_PAGES][PAGE_SIZE+1];
+static struct i2c_msg ssd_msgs[NUM_PAGES+1];
+static struct i2c_txn ssd_txns[NUM_PAGES+1];
+
+/* Wait for the last refresh to finish going out */
 static void
-ssd_sendbuf ( unsigned char *buf )
+ssd_display_wait ( void )
 {
-    unsigned char io_buf[LINE_SIZE+1];
     int i;
 
-    io_buf[0] = 0x40;
-    for ( i=0; i < LINE_SIZE; i++ )
-	io_buf[i+1] = buf[i];
-    i2c_send ( ip, SSD1306_I2C_ADDRESS, io_buf, LINE_SIZE+1 );
+    for ( i = 0; i < NUM_PAGES+1; i++ )
+	(void) i2c_wait ( &ssd_txns[i] );
+}
+
+static void
+ssd_queue ( int n, unsigned char *buf, int count )
+{
+    ssd_msgs[n].addr = SSD1306_I2C_ADDRESS;
+    ssd_msgs[n].flags = 0;
+    ssd_msgs[n].length = count;
+    ssd_msgs[n].data = buf;
+
+    ssd_txns[n].msgs = &ssd_msgs[n];
+    ssd_txns[n].nmsgs = 1;
+    ssd_txns[n].prio = I2C_PRIO_LOW;
+    ssd_txns[n].done = NULL;
+    (void) i2c_submit ( ip, &ssd_txns[n] );
 }
 
 // void SSD1306_Display(void)
 void
 ssd_display ( void )
 {
+  int p;
   int i;
 
-  ssd1306_command(SSD1306_COLUMNADDR);
-  ssd1306_command(0);			// Column start address (0 = reset)
-  ssd1306_command(WIDTH-1);	// Column end address (127 = reset)
-
-  ssd1306_command(SSD1306_PAGEADDR);
-  ssd1306_command(0);			// Page start address (0 = reset)
-
-  #if HEIGHT == 64
-    ssd1306_command(7);			// Page end address
-  #endif
-  #if HEIGHT == 32
-    ssd1306_command(3);			// Page end address
-  #endif
-  #if HEIGHT == 16
-    ssd1306_command(1);			// Page end address
-  #endif
-
-  /* On my 128x64 unit, this loop grinds out 64 lines one by one */
-  for ( i = 0; i < BUF_SIZE; i += LINE_SIZE )
-      ssd_sendbuf ( &ssd1306_buffer[i] );
+  ssd_display_wait ();
+
+  /* With Co = 0 in the control byte, everything after it is commands */
+  ssd_cmd_buf[0] = 0x00;
+  ssd_cmd_buf[1] = SSD1306_COLUMNADDR;
+  ssd_cmd_buf[2] = 0;			// Column start address (0 = reset)
+  ssd_cmd_buf[3] = WIDTH-1;		// Column end address (127 = reset)
+  ssd_cmd_buf[4] = SSD1306_PAGEADDR;
+  ssd_cmd_buf[5] = 0;			// Page start address (0 = reset)
+  ssd_cmd_buf[6] = NUM_PAGES-1;		// Page end address
+  ssd_queue ( 0, ssd_cmd_buf, sizeof(ssd_cmd_buf) );
+
+  for ( p = 0; p < NUM_PAGES; p++ ) {
+      ssd_page_buf[p][0] = 0x40;
+      for ( i = 0; i < PAGE_SIZE; i++ )
+	  ssd_page_buf[p][i+1] = ssd1306_buffer[p*PAGE_SIZE + i];
+      ssd_queue ( p+1, ssd_page_buf[p], PAGE_SIZE+1 );
+  }
 }
 
 static void
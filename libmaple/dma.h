@@ -332,6 +332,38 @@ extern void dma_attach_interrupt(dma_dev *dev, dma_tube tube,
  */
 extern void dma_detach_interrupt(dma_dev *dev, dma_tube tube);
 
+/* Tube ownership */
+
+/**
+ * @brief Claim a DMA tube for a driver.
+ *
+ * Several peripherals share each tube (on F1, USART1 TX and I2C2 TX
+ * are both DMA1 channel 4), and a driver that configures a tube
+ * another driver is counting on breaks it.  Drivers claim a tube
+ * before they configure it and keep it until they release it.
+ * Claiming a tube you already own succeeds.
+ *
+ * Call this from thread context, not from interrupt handlers.
+ *
+ * @param dev DMA device
+ * @param tube Tube to claim
+ * @param owner Anything unique to the caller, e.g. its device struct
+ * @return 0 if the tube is now owner's, -1 if someone else has it.
+ * @see dma_release()
+ */
+extern int dma_claim(dma_dev *dev, dma_tube tube, const void *owner);
+
+/**
+ * @brief Give back a tube claimed with dma_claim().
+ *
+ * Does nothing unless owner holds the tube.
+ *
+ * @param dev DMA device
+ * @param tube Tube to release
+ * @param owner As passed to dma_claim()
+ */
+extern void dma_release(dma_dev *dev, dma_tube tube, const void *owner);
+
 /* Tube enable/disable */
 
 /**
@@ -64,6 +64,7 @@ struct dma_reg_map;
 typedef struct dma_handler_config {
     void (*handler)(void);     /* User handler */
     nvic_irq_num irq_line;     /* IRQ line for interrupt */
+    const void *owner;         /* Who claimed the tube, see dma_claim() */
 } dma_handler_config;
 
 /** DMA device type */
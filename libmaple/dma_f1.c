@@ -249,6 +249,24 @@ void dma_detach_interrupt(dma_dev *dev, dma_channel channel) {
     DMA_GET_HANDLER(dev, channel) = NULL;
 }
 
+int dma_claim(dma_dev *dev, dma_channel channel, const void *owner) {
+    dma_handler_config *h = &dev->handlers[channel - 1];
+
+    if (h->owner != NULL && h->owner != owner) {
+        return -1;
+    }
+    h->owner = owner;
+    return 0;
+}
+
+void dma_release(dma_dev *dev, dma_channel channel, const void *owner) {
+    dma_handler_config *h = &dev->handlers[channel - 1];
+
+    if (h->owner == owner) {
+        h->owner = NULL;
+    }
+}
+
 void dma_enable(dma_dev *dev, dma_channel channel) {
     dma_channel_reg_map *chan_regs = dma_channel_regs(dev, channel);
     bb_peri_set_bit(&chan_regs->CCR, DMA_CCR_EN_BIT, 1);
@@ -0,0 +1,61 @@
+/* dwt.h
+ *
+ * The cycle counter in the Cortex-M3 DWT (data watchpoint and trace) unit.
+ *
+ * Once started, CYCCNT just counts CPU clocks (72 per microsecond for us)
+ *  and wraps around every minute or so.  Reading it takes one load,
+ *  which makes it the cheapest timestamp there is, and good for
+ *  measuring short things down to the cycle.
+ *
+ * It lives in the debug block and is off after reset, so call
+ *  dwt_init() before trusting it.  It keeps working with no debugger
+ *  attached.
+ */
+
+#ifndef _DWT_H_
+#define _DWT_H_
+
+#include <libmaple/libmaple_types.h>
+
+struct dwt_reg_map {
+	__io uint32 CTRL;
+	__io uint32 CYCCNT;
+	__io uint32 CPICNT;
+	__io uint32 EXCCNT;
+	__io uint32 SLEEPCNT;
+	__io uint32 LSUCNT;
+	__io uint32 FOLDCNT;
+	__io uint32 PCSR;
+};
+
+#define DWT_BASE		((struct dwt_reg_map *) 0xE0001000)
+
+#define DWT_CTRL_CYCCNTENA	0x01
+
+/* In the core debug block, just past the SCB */
+#define DWT_DEMCR		(*(__io uint32 *) 0xE000EDFC)
+#define DWT_DEMCR_TRCENA	(1U << 24)
+
+/* Several drivers (and the trace) want the counter, so whoever
+ * comes first starts it.  If it is already going we leave it be;
+ * zeroing it would throw off anybody waiting on a deadline.
+ */
+static inline void
+dwt_init ( void )
+{
+	if ( DWT_BASE->CTRL & DWT_CTRL_CYCCNTENA )
+	    return;
+	DWT_DEMCR |= DWT_DEMCR_TRCENA;
+	DWT_BASE->CYCCNT = 0;
+	DWT_BASE->CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
+static inline uint32
+dwt_cycles ( void )
+{
+	return DWT_BASE->CYCCNT;
+}
+
+#endif
+
+/* THE END */
@@ -0,0 +1,586 @@
+/* fmt.c
+ *
+ * The formatted output engine behind printf, sprintf and friends.
+ *
+ * This replaces the little asnprintf that used to live in serial.c,
+ *  which only knew %d, %x (2 digits), %h, %c and %s.
+ * It handles the usual:
+ *
+ *  flags	- + space 0
+ *  width	number or *
+ *  precision	.number or .*
+ *  length	h hh l ll z (h and hh are accepted and ignored)
+ *  conversions	d i u x X o c s p f %
+ *
+ * plus my old %h, which is a 32 bit value as 8 hex digits.
+ *
+ * Output either goes into a buffer (fmt_vsnprintf) or is handed
+ *  to a sink function in chunks as it is made (fmt_vformat).
+ *  The sink never sees more than FMT_CHUNK bytes of formatted text
+ *  at a time, and literal text from the format (and %s strings)
+ *  goes to it directly without being copied at all.
+ *  So there is no limit on length and the stack use is fixed.
+ *
+ * The Cortex-M3 does have a divide instruction, but it takes up to
+ *  12 cycles and gcc goes off to libgcc for 64 bit division, which
+ *  is far worse.  So decimal digits come from multiplying by a
+ *  reciprocal (32 bit values) or a shift and add sequence (64 bit).
+ *
+ * %f does not use floating point at all.  We pull the double apart
+ *  and do fixed point arithmetic on the mantissa.
+ *  It is good for values up to 2^63 and up to 30 digits after the
+ *  point.
+ *  The default precision is 6, as usual.
+ */
+
+#include <stdarg.h>
+
+#include <libmaple/libmaple_types.h>
+#include "fmt.h"
+
+#define FL_LEFT		0x01
+#define FL_PLUS		0x02
+#define FL_SPACE	0x04
+#define FL_ZERO		0x08
+#define FL_UPPER	0x10
+
+#define FMT_MAX_FRAC	30
+
+#define FMT_CHUNK	32
+
+static const char hex_lower[] = "0123456789abcdef";
+static const char hex_upper[] = "0123456789ABCDEF";
+
+/* Where output goes.
+ * We always count, even past the end of the buffer,
+ *  so we can return what snprintf should.
+ * With a sink, buf and end walk through chunk, and a full chunk
+ *  gets handed to the sink.
+ */
+struct fmt_out {
+	char *buf;
+	char *end;	/* last usable byte (saved for the null) */
+	int count;
+	fmt_sink sink;
+	void *arg;
+	char chunk[FMT_CHUNK];
+};
+
+static void
+out_flush ( struct fmt_out *op )
+{
+	if ( op->buf > op->chunk )
+	    op->sink ( op->arg, op->chunk, op->buf - op->chunk );
+	op->buf = op->chunk;
+}
+
+static inline void
+out_c ( struct fmt_out *op, int c )
+{
+	if ( op->buf >= op->end && op->sink )
+	    out_flush ( op );
+	if ( op->buf < op->end )
+	    *op->buf++ = c;
+	op->count++;
+}
+
+/* A run of text that is already sitting in memory somewhere.
+ * A sink gets it straight from there.
+ */
+static void
+out_str ( struct fmt_out *op, const char *s, int n )
+{
+	if ( n <= 0 )
+	    return;
+
+	if ( op->sink ) {
+	    out_flush ( op );
+	    op->sink ( op->arg, s, n );
+	    op->count += n;
+	    return;
+	}
+
+	while ( n-- )
+	    out_c ( op, *s++ );
+}
+
+static void
+out_pad ( struct fmt_out *op, int c, int n )
+{
+	while ( n-- > 0 )
+	    out_c ( op, c );
+}
+
+/* Divide by 10, multiplying by the reciprocal.
+ * 0xCCCCCCCD is 2^35 / 10, rounded up, and is exact
+ *  for every 32 bit value.  This is a single umull.
+ */
+static inline uint32
+divu10_32 ( uint32 n, uint32 *rem )
+{
+	uint32 q = (uint32) (((uint64) n * 0xCCCCCCCDu) >> 35);
+
+	*rem = n - q * 10;
+	return q;
+}
+
+/* The 64 bit case, from Hacker's Delight (divu10).
+ * q is an estimate that may be one too small,
+ *  which the remainder tells us about.
+ */
+static inline uint64
+divu10_64 ( uint64 n, uint32 *rem )
+{
+	uint64 q, r;
+
+	q = (n >> 1) + (n >> 2);
+	q += q >> 4;
+	q += q >> 8;
+	q += q >> 16;
+	q += q >> 32;
+	q >>= 3;
+	r = n - ((q << 3) + (q << 1));
+	if ( r > 9 ) {
+	    q++;
+	    r -= 10;
+	}
+	*rem = r;
+	return q;
+}
+
+/* Generate digits, least significant first, return how many */
+static int
+fmt_digits ( char *dp, uint64 val, int base, int flags )
+{
+	const char *hex = (flags & FL_UPPER) ? hex_upper : hex_lower;
+	char *start = dp;
+	uint32 r;
+	uint32 v32;
+
+	if ( base == 16 ) {
+	    do {
+		*dp++ = hex[val & 0xf];
+		val >>= 4;
+	    } while ( val );
+	} else if ( base == 8 ) {
+	    do {
+		*dp++ = '0' + (val & 7);
+		val >>= 3;
+	    } while ( val );
+	} else {
+	    /* Use the 64 bit divide only as long as we must */
+	    while ( val >> 32 ) {
+		val = divu10_64 ( val, &r );
+		*dp++ = '0' + r;
+	    }
+	    v32 = val;
+	    do {
+		v32 = divu10_32 ( v32, &r );
+		*dp++ = '0' + r;
+	    } while ( v32 );
+	}
+	return dp - start;
+}
+
+/* Put out a number, given its digits (backwards),
+ *  with all the sign, precision, padding and width business.
+ * prec is the minimum number of digits, -1 if not given.
+ * tail is extra text that follows the digits (the fraction for %f)
+ *  and counts against the width.
+ */
+static void
+fmt_number ( struct fmt_out *op, char *digits, int nd, int sign,
+	const char *prefix, const char *tail, int ntail,
+	int flags, int width, int prec )
+{
+	int nzero = 0;
+	int npre = 0;
+	int len;
+
+	while ( prefix && prefix[npre] )
+	    npre++;
+
+	if ( prec >= 0 ) {
+	    if ( prec > nd )
+		nzero = prec - nd;
+	    /* no zero padding when a precision is given */
+	    flags &= ~FL_ZERO;
+	}
+
+	len = (sign ? 1 : 0) + npre + nzero + nd + ntail;
+
+	if ( (flags & FL_ZERO) && ! (flags & FL_LEFT) && width > len ) {
+	    nzero += width - len;
+	    len = width;
+	}
+
+	if ( ! (flags & FL_LEFT) )
+	    out_pad ( op, ' ', width - len );
+	if ( sign )
+	    out_c ( op, sign );
+	while ( npre-- )
+	    out_c ( op, *prefix++ );
+	out_pad ( op, '0', nzero );
+	while ( nd-- )
+	    out_c ( op, digits[nd] );
+	while ( ntail-- )
+	    out_c ( op, *tail++ );
+	if ( flags & FL_LEFT )
+	    out_pad ( op, ' ', width - len );
+}
+
+static int
+sign_char ( int neg, int flags )
+{
+	if ( neg )
+	    return '-';
+	if ( flags & FL_PLUS )
+	    return '+';
+	if ( flags & FL_SPACE )
+	    return ' ';
+	return 0;
+}
+
+static void
+fmt_string ( struct fmt_out *op, const char *s, int flags, int width, int prec )
+{
+	int len;
+
+	if ( ! s )
+	    s = "(null)";
+	for ( len = 0; s[len] && (prec < 0 || len < prec); len++ )
+	    ;
+
+	if ( ! (flags & FL_LEFT) )
+	    out_pad ( op, ' ', width - len );
+	out_str ( op, s, len );
+	if ( flags & FL_LEFT )
+	    out_pad ( op, ' ', width - len );
+}
+
+/* %f without floating point.
+ * A double is mant / 2^shift, with a 53 bit mant (hidden bit included).
+ * The integer part is just a shift, and the fraction digits come
+ *  from multiplying what is left by 10 (a shift and add) and taking
+ *  the bits that spill over the point.  The fraction is kept under
+ *  2^60, which leaves room for the multiply; for small values that
+ *  means dropping low bits as we go, but only once we are past 17
+ *  or so significant digits.  Otherwise the digits are exact.
+ * We round to even on an exact tie, like glibc.
+ */
+static void
+fmt_fixed ( struct fmt_out *op, double d, int flags, int width, int prec )
+{
+	union { double d; uint64 u; } bits;
+	char digits[24];
+	char frac[FMT_MAX_FRAC+1];
+	uint64 mant, ipart, fpart, mask, half;
+	int exp, shift, sticky;
+	int neg, nd, i, odd;
+
+	bits.d = d;
+	neg = bits.u >> 63;
+	exp = (bits.u >> 52) & 0x7ff;
+	mant = bits.u & 0xfffffffffffffULL;
+
+	if ( prec < 0 )
+	    prec = 6;
+	if ( prec > FMT_MAX_FRAC )
+	    prec = FMT_MAX_FRAC;
+
+	if ( exp == 0x7ff ) {
+	    fmt_string ( op, mant ? "nan" : "inf", flags, width, -1 );
+	    return;
+	}
+
+	if ( exp == 0 )
+	    exp = 1;		/* denormal */
+	else
+	    mant |= 1ULL << 52;
+	shift = 1075 - exp;
+
+	sticky = 0;
+	if ( shift <= 0 ) {
+	    if ( shift < -10 ) {
+		/* 2^63 and up, more than we can do */
+		fmt_string ( op, "ovf", flags, width, -1 );
+		return;
+	    }
+	    ipart = mant << -shift;
+	    fpart = 0;
+	    shift = 0;
+	} else if ( shift < 64 ) {
+	    ipart = mant >> shift;
+	    fpart = mant & ((1ULL << shift) - 1);
+	} else {
+	    ipart = 0;
+	    fpart = mant;
+	}
+
+	frac[0] = '.';
+	for ( i = 1; i <= prec; i++ ) {
+	    fpart = (fpart << 3) + (fpart << 1);
+	    if ( shift < 64 ) {
+		mask = (1ULL << shift) - 1;
+		frac[i] = '0' + (fpart >> shift);
+		fpart &= mask;
+	    } else
+		frac[i] = '0';
+	    while ( fpart >> 60 ) {
+		sticky |= fpart & 1;
+		fpart >>= 1;
+		shift--;
+	    }
+	}
+
+	/* Round on what is left over */
+	if ( shift && shift < 64 ) {
+	    half = 1ULL << (shift - 1);
+	    odd = prec ? (frac[prec] & 1) : (ipart & 1);
+	    if ( fpart > half || (fpart == half && (sticky || odd)) ) {
+		for ( i = prec; i > 0; i-- ) {
+		    if ( frac[i] != '9' ) {
+			frac[i]++;
+			break;
+		    }
+		    frac[i] = '0';
+		}
+		if ( i == 0 )
+		    ipart++;
+	    }
+	}
+
+	nd = fmt_digits ( digits, ipart, 10, 0 );
+	fmt_number ( op, digits, nd, sign_char ( neg, flags ), NULL,
+	    frac, prec ? prec + 1 : 0, flags, width, -1 );
+}
+
+static int
+is_int_conv ( int c )
+{
+	return c == 'd' || c == 'i' || c == 'u' || c == 'o' ||
+	    c == 'x' || c == 'X' || c == 'h';
+}
+
+/* The guts of it, for either kind of output */
+static void
+fmt_core ( struct fmt_out *op, const char *fmt, va_list args )
+{
+	char digits[24];
+	const char *p;
+	uint64 val;
+	int c, flags, width, prec, lng;
+	int neg, nd, base;
+
+	for ( ;; ) {
+	    for ( p = fmt; *p && *p != '%'; p++ )
+		;
+	    out_str ( op, fmt, p - fmt );
+	    if ( ! *p )
+		break;
+	    fmt = p + 1;
+
+	    flags = 0;
+	    for ( ;; ) {
+		c = *fmt++;
+		if ( c == '-' )
+		    flags |= FL_LEFT;
+		else if ( c == '+' )
+		    flags |= FL_PLUS;
+		else if ( c == ' ' )
+		    flags |= FL_SPACE;
+		else if ( c == '0' )
+		    flags |= FL_ZERO;
+		else
+		    break;
+	    }
+
+	    width = 0;
+	    if ( c == '*' ) {
+		width = va_arg ( args, int );
+		if ( width < 0 ) {
+		    flags |= FL_LEFT;
+		    width = -width;
+		}
+		c = *fmt++;
+	    } else {
+		while ( c >= '0' && c <= '9' ) {
+		    width = width * 10 + c - '0';
+		    c = *fmt++;
+		}
+	    }
+
+	    prec = -1;
+	    if ( c == '.' ) {
+		prec = 0;
+		c = *fmt++;
+		if ( c == '*' ) {
+		    prec = va_arg ( args, int );
+		    c = *fmt++;
+		} else {
+		    while ( c >= '0' && c <= '9' ) {
+			prec = prec * 10 + c - '0';
+			c = *fmt++;
+		    }
+		}
+	    }
+
+	    /* An h is a length only if a conversion follows,
+	     * otherwise it is my %h.
+	     */
+	    lng = 0;
+	    while ( c == 'l' || c == 'z' || (c == 'h' && is_int_conv ( *fmt )) ) {
+		/* size_t is as long as a long, 32 or 64 bits alike */
+		if ( c == 'l' || c == 'z' )
+		    lng++;
+		c = *fmt++;
+	    }
+
+	    neg = 0;
+	    base = 10;
+
+	    switch ( c ) {
+	    case 'd':
+	    case 'i':
+		if ( lng >= 2 ) {
+		    long long v = va_arg ( args, long long );
+		    neg = v < 0;
+		    val = neg ? -(uint64) v : (uint64) v;
+		} else {
+		    long v = lng ? va_arg ( args, long ) : va_arg ( args, int );
+		    neg = v < 0;
+		    val = neg ? -(unsigned long) v : (unsigned long) v;
+		}
+		nd = fmt_digits ( digits, val, 10, flags );
+		if ( prec == 0 && val == 0 )
+		    nd = 0;
+		fmt_number ( op, digits, nd, sign_char ( neg, flags ),
+		    NULL, NULL, 0, flags, width, prec );
+		break;
+
+	    case 'X':
+		flags |= FL_UPPER;
+		/* fall through */
+	    case 'x':
+		base = 16;
+		/* fall through */
+	    case 'o':
+		if ( c == 'o' )
+		    base = 8;
+		/* fall through */
+	    case 'u':
+		if ( lng >= 2 )
+		    val = va_arg ( args, unsigned long long );
+		else if ( lng )
+		    val = va_arg ( args, unsigned long );
+		else
+		    val = va_arg ( args, unsigned int );
+		nd = fmt_digits ( digits, val, base, flags );
+		if ( prec == 0 && val == 0 )
+		    nd = 0;
+		fmt_number ( op, digits, nd, 0,
+		    NULL, NULL, 0, flags, width, prec );
+		break;
+
+	    case 'p':
+		val = (unsigned long) va_arg ( args, void * );
+		nd = fmt_digits ( digits, val, 16, 0 );
+		fmt_number ( op, digits, nd, 0,
+		    "0x", NULL, 0, flags, width, prec );
+		break;
+
+	    case 'h':
+		/* My old favorite, always 8 digits */
+		val = va_arg ( args, unsigned int );
+		nd = fmt_digits ( digits, val, 16, FL_UPPER );
+		fmt_number ( op, digits, nd, 0,
+		    NULL, NULL, 0, 0, 0, 8 );
+		break;
+
+	    case 'f':
+	    case 'F':
+		fmt_fixed ( op, va_arg ( args, double ), flags, width, prec );
+		break;
+
+	    case 'c':
+		digits[0] = va_arg ( args, int );
+		fmt_number ( op, digits, 1, 0,
+		    NULL, NULL, 0, flags & FL_LEFT, width, -1 );
+		break;
+
+	    case 's':
+		fmt_string ( op, va_arg ( args, char * ), flags, width, prec );
+		break;
+
+	    case '%':
+		out_c ( op, '%' );
+		break;
+
+	    case '\0':
+		/* Format ended in the middle of a conversion */
+		fmt--;
+		break;
+
+	    default:
+		/* Unknown, show it as is */
+		out_c ( op, '%' );
+		out_c ( op, c );
+		break;
+	    }
+	}
+}
+
+/* Returns the length the whole thing would have been,
+ *  as snprintf does, even if it did not fit.
+ * The result is always null terminated if size > 0.
+ */
+int
+fmt_vsnprintf ( char *buf, unsigned int size, const char *fmt, va_list args )
+{
+	struct fmt_out out;
+
+	out.buf = buf;
+	out.end = size ? buf + size - 1 : buf;
+	out.count = 0;
+	out.sink = NULL;
+
+	fmt_core ( &out, fmt, args );
+
+	if ( size )
+	    *out.buf = '\0';
+	return out.count;
+}
+
+/* Hand the output to sink as it is made, returns the length.
+ * Nothing is null terminated, the sink gets lengths.
+ */
+int
+fmt_vformat ( fmt_sink sink, void *arg, const char *fmt, va_list args )
+{
+	struct fmt_out out;
+
+	out.buf = out.chunk;
+	out.end = out.chunk + FMT_CHUNK;
+	out.count = 0;
+	out.sink = sink;
+	out.arg = arg;
+
+	fmt_core ( &out, fmt, args );
+
+	out_flush ( &out );
+	return out.count;
+}
+
+int
+fmt_snprintf ( char *buf, unsigned int size, const char *fmt, ... )
+{
+	va_list args;
+	int rv;
+
+	va_start ( args, fmt );
+	rv = fmt_vsnprintf ( buf, size, fmt, args );
+	va_end ( args );
+	return rv;
+}
+
+/* THE END */
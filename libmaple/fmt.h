@@ -0,0 +1,20 @@
+/* fmt.h
+ *
+ * Formatted output, see fmt.c
+ */
+
+#ifndef _FMT_H_
+#define _FMT_H_
+
+#include <stdarg.h>
+
+/* Gets the output in pieces, buf is not null terminated */
+typedef void (*fmt_sink) ( void *, const char *, int );
+
+int fmt_vsnprintf ( char *, unsigned int, const char *, va_list );
+int fmt_snprintf ( char *, unsigned int, const char *, ... );
+int fmt_vformat ( fmt_sink, void *, const char *, va_list );
+
+#endif
+
+/* THE END */
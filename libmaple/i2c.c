@@ -32,23 +32,54 @@
  * so far.  This file is a top level "switch" routine that presents the
  * public API and allows a caller to pick between i2c and iic with the
  * intial "new" call and the rest of the code stays the same.
+ * Or the caller can have both at once, see i2c_auto_new.
  */
 
-#include "i2c.h"
+#include <libmaple/systick.h>
+#include <libmaple/nvic.h>
 
-/* In iic.c */
-void iic_init ( int, int );
-int iic_send ( int, unsigned char *, int );
-int iic_recv ( int, unsigned char *, int );
+#include "boards.h"
+#include "dwt.h"
+#include "serial.h"
+#include "i2c.h"
+#include "iic.h"
 
 /* In i2c_hw.c */
-void i2c_master_enable ( i2c_dev *, uint32, uint32 );
+int32 i2c_master_enable ( i2c_dev *, uint32, uint32 );
+void i2c_master_clear_nack ( i2c_dev * );
+
+/* For i2c_master_xfer, in milliseconds */
+#define HW_TIMEOUT	10
+
+/* How long i2c_poll keeps trying to start a transaction on a
+ *  hardware bus that says it is busy, before it calls it hung.
+ */
+#define BUSY_WAIT_US	25000
+
+/* Not a status anybody sees: ip->stalled when the start found
+ *  the bus busy, and i2c_poll should just try again.
+ */
+#define STALL_BUSY	(-1)
 
-#define MAX_I2C		4
+/* For I2C_AUTO, how long to stay on GPIO before the hardware
+ *  gets another chance.  If it lets us down again before it has
+ *  done AUTO_PROVEN good transfers, we wait twice as long (up to
+ *  AUTO_RETRY_MAX) the next time.
+ */
+#define AUTO_RETRY_MS	5000
+#define AUTO_RETRY_MAX	(5 * 60 * 1000)
+#define AUTO_PROVEN	100
+
+/* Both hardware buses and all of the GPIO ones */
+#define MAX_I2C		(2 + MAX_IIC)
 
 static struct i2c i2c_softc[MAX_I2C];
 static int8	cur_i2c = 0;
-static int8	num_iic = 0;
+
+static struct iic iic_softc[MAX_IIC];
+static int8	cur_iic = 0;
+
+static void i2c_dma_done ( void *, int );
 
 static struct i2c *
 i2c_alloc ( void )
@@ -78,7 +109,10 @@ i2c_hw_new ( int num )
 	else
 	    dev = &i2c2;
 
-	i2c_master_enable ( dev, 0, 100000 );
+	/* Do the erratum dance right away, the BUSY flag
+	 *  can be stuck from power up.
+	 */
+	i2c_master_enable ( dev, I2C_PUP_RESET, 100000 );
 
 #ifdef KYU
         void *hwp;
@@ -96,55 +130,715 @@ i2c_hw_new ( int num )
         return ip;
 }
 
-/* If you want the reliable 100 kHz big bang driver, use this */
-/*  At present we only allow one of these.
- *   someday if I need more than one, it won't be hard to manage.
+/* If you want the reliable big bang driver, use this.
+ * It starts out at 100 kHz, see i2c_set_speed.
+ * Each call gives a separate bus on its own pair of pins,
+ *  up to MAX_IIC of them, and they don't know about each other.
  */
 struct i2c *
 i2c_gpio_new ( int sda_pin, int scl_pin )
 {
         struct i2c *ip;
+	struct iic *bp;
 
-	/* Enforce "only one of these" */
-	if ( num_iic ) return NULL;
-	num_iic++;
-
-        iic_init ( sda_pin, scl_pin );
+	if ( cur_iic >= MAX_IIC )
+	    return NULL;
 
         ip = i2c_alloc ();
 	if ( ! ip ) return NULL;
 
+	bp = &iic_softc[cur_iic++];
+        iic_init ( bp, sda_pin, scl_pin );
+
         ip->type = I2C_GPIO;
+        ip->hw = bp;
         return ip;
 }
 
-/* Send and Receive are the fundamental i2c primitives
- * that everything else gets routed through.
- * Return 0 if OK, 1 if trouble (usually a NACK).
+/* Still GPIO, but with timer 4 and DMA doing the bit banging
+ *  (see iic_dma.c), so the CPU is free while a transfer runs.
+ * There can only be one of these, and SDA and SCL must be
+ *  on the same GPIO port.
+ */
+struct i2c *
+i2c_dma_new ( int sda_pin, int scl_pin )
+{
+        struct i2c *ip;
+	struct iic *bp;
+
+	if ( cur_iic >= MAX_IIC )
+	    return NULL;
+
+	bp = &iic_softc[cur_iic];
+        iic_init ( bp, sda_pin, scl_pin );
+	if ( iic_dma_init ( bp ) )
+	    return NULL;
+
+        ip = i2c_alloc ();
+	if ( ! ip ) return NULL;
+	cur_iic++;
+
+        ip->type = I2C_DMA;
+        ip->hw = bp;
+	iic_dma_callback ( bp, i2c_dma_done, ip );
+        return ip;
+}
+
+/* The hardware for speed, with the GPIO driver standing by on
+ *  the same pins for when the hardware acts up.
+ * When the hardware has a bus error, or gets stuck BUSY, we
+ *  reset it, clock out the bus, and go on with the GPIO driver,
+ *  starting with the transaction that failed, so the caller
+ *  never knows.  Every so often the hardware gets another try.
+ * All of that happens in i2c_poll, never in the interrupt, since
+ *  a GPIO transfer is the CPU wiggling pins for the whole time.
+ * i2c_show_stats tells how each of them has been doing.
+ * Valid arguments are 1 (PB7 sda, PB6 scl) or 2 (PB11, PB10).
+ */
+struct i2c *
+i2c_auto_new ( int num )
+{
+        struct i2c *ip;
+	struct iic *bp;
+
+	if ( num < 1 || num > 2 )
+	    return NULL;
+	if ( cur_iic >= MAX_IIC )
+	    return NULL;
+
+	/* The hardware takes the pins back from this */
+	bp = &iic_softc[cur_iic];
+	if ( num == 1 )
+	    iic_init ( bp, PB7, PB6 );
+	else
+	    iic_init ( bp, PB11, PB10 );
+
+	ip = i2c_hw_new ( num );
+	if ( ! ip ) return NULL;
+	cur_iic++;
+
+        ip->type = I2C_AUTO;
+        ip->sw = bp;
+        return ip;
+}
+
+/* Is this bus using the hardware just now */
+static inline int
+i2c_on_hw ( struct i2c *ip )
+{
+	return ip->type == I2C_HW || (ip->type == I2C_AUTO && ! ip->fallback);
+}
+
+/* The GPIO driver for this bus */
+static inline struct iic *
+i2c_iic ( struct i2c *ip )
+{
+	return ip->type == I2C_AUTO ? ip->sw : ip->hw;
+}
+
+/* ---------------------------------------------------------------- */
+/* The bus queue.
+ *
+ * Every transfer, blocking or not, goes through here, so several
+ *  drivers can share a bus without tripping over each other.
+ * Transactions wait on ip->queue, most urgent first, and the one
+ *  on the bus is ip->cur.  When it is done the next one is started
+ *  right there, which for the hardware and DMA buses means from the
+ *  interrupt, so the bus keeps going while the CPU does other work.
+ * A long job (say a display refresh) submitted as several low
+ *  priority pieces lets a sensor read in between the pieces.
  *
- * XXX - HW support is not yet done.
+ * The plain GPIO bus has no interrupt, so there a transaction runs
+ *  as soon as it is submitted (or as soon as the one in front of
+ *  it is done), in whatever context did the submit.
+ *
+ * When the hardware gets in trouble, putting it right (clocking out
+ *  the bus, the errata dance) can take a long time, much too long
+ *  for an interrupt.  So the interrupt just marks the bus stalled and
+ *  leaves the transaction as ip->cur, and the next i2c_poll (from
+ *  i2c_wait, i2c_submit, or your main loop) does the rest.
  */
 
-int
-i2c_send ( struct i2c *ip, int addr, char *buf, int count )
+static void i2c_next ( struct i2c * );
+static int i2c_txn_start ( struct i2c *, struct i2c_txn * );
+
+/* Keep score for whichever backend just had a go at the
+ *  transaction on the bus, and start the clock for the next try.
+ */
+static void
+i2c_account ( struct i2c *ip, int status )
+{
+	struct i2c_txn *tp = ip->cur;
+	struct i2c_stats *sp;
+	uint32 now = dwt_cycles ();
+	int i;
+
+	sp = &ip->stats[i2c_on_hw ( ip ) ? I2C_STATS_HW : I2C_STATS_SW];
+	sp->xfers++;
+	sp->usecs += (now - ip->start) / CYCLES_PER_MICROSECOND;
+	ip->start = now;
+
+	if ( status == I2C_ERR_NACK )
+	    sp->nacks++;
+	else if ( status )
+	    sp->errors++;
+	else {
+	    for ( i = 0; i < tp->nmsgs; i++ )
+		sp->bytes += tp->msgs[i].length;
+	    if ( ip->type == I2C_AUTO && ! ip->fallback )
+		ip->hw_good++;
+	}
+}
+
+/* The transaction on the bus is over, tell its owner, when
+ *  the last go has been counted already.
+ * We are done with it once busy is cleared, so get what
+ *  we need out of it first.
+ */
+static void
+i2c_txn_finish ( struct i2c *ip, int status )
+{
+	struct i2c_txn *tp = ip->cur;
+	void (*done) ( struct i2c_txn *, int ) = tp->done;
+
+	tp->status = status;
+	ip->cur = NULL;
+	tp->busy = 0;
+
+	if ( done )
+	    done ( tp, status );
+}
+
+/* The transaction on the bus is over, count it and tell its owner */
+static void
+i2c_txn_done ( struct i2c *ip, int status )
+{
+	i2c_account ( ip, status );
+	i2c_txn_finish ( ip, status );
+}
+
+/* Put the hardware back in order after a failed transfer.
+ * i2c_master_xfer leaves the device in I2C_STATE_ERROR (and won't
+ *  start another transfer until it is IDLE), and the F1 silicon
+ *  can be left with BUSY stuck on, which only the 15 step fix from
+ *  the errata sheet (I2C_PUP_RESET) clears.  We clock out any
+ *  slave that is hung on the bus while we are at it.
+ * The speed is kept, i2c_master_enable remembers FAST_MODE.
+ * This can take a while, never call it from an interrupt.
+ * Returns 0 if OK, or a line stayed low and the bus is no good.
+ */
+static int
+i2c_hw_reset ( i2c_dev *dev )
+{
+	uint32 flags = dev->config_flags & I2C_FAST_MODE;
+
+	return i2c_master_enable ( dev, flags | I2C_BUS_RESET | I2C_PUP_RESET,
+	    flags ? 400000 : 100000 );
+}
+
+/* The hardware let an I2C_AUTO bus down, and i2c_hw_reset has
+ *  already had a go at it.  Shut it off, give the pins to the
+ *  GPIO driver, and decide when to try the hardware again.
+ */
+static void
+i2c_auto_fallback ( struct i2c *ip )
 {
-        if ( ip->type == I2C_HW ) {
-            //return i2c_hw_send ( ip->hw, addr, buf, count );
+	i2c_disable ( ip->hw );
+	iic_reclaim ( ip->sw );
+
+	if ( ip->retry_ms && ip->hw_good < AUTO_PROVEN ) {
+	    ip->retry_ms *= 2;
+	    if ( ip->retry_ms > AUTO_RETRY_MAX )
+		ip->retry_ms = AUTO_RETRY_MAX;
+	} else
+	    ip->retry_ms = AUTO_RETRY_MS;
+
+	ip->retry_at = systick_uptime () + ip->retry_ms;
+	ip->fallbacks++;
+	ip->fallback = 1;
+}
+
+/* Before each transaction while on GPIO, see if the
+ *  hardware is due for another chance.
+ * GPIO transactions only ever start in thread context (from
+ *  i2c_submit or i2c_poll), so this is never in an interrupt.
+ * The reset takes the pins back and clocks out the bus, and
+ *  gives up after a bounded time if a line stays low.  Then
+ *  the hardware is no better off than before, so we stay on
+ *  GPIO and wait twice as long before the next look.
+ */
+static void
+i2c_auto_retry ( struct i2c *ip )
+{
+	if ( (int32) (systick_uptime () - ip->retry_at) < 0 )
+	    return;
+
+	ip->hw_good = 0;
+	if ( i2c_hw_reset ( ip->hw ) ) {
+	    i2c_auto_fallback ( ip );
+	    return;
+	}
+	ip->fallback = 0;
+}
+
+static void i2c_hw_done ( i2c_dev *, int32, void * );
+
+/* Take back the NOSTOP flags i2c_hw_start added, so the caller
+ *  finds its flags as it left them.
+ */
+static void
+i2c_hw_flags ( struct i2c *ip, struct i2c_txn *tp )
+{
+	int i;
+
+	for ( i = 0; i < tp->nmsgs && i < 32; i++ )
+	    if ( ip->nostop & (1U << i) )
+		tp->msgs[i].flags &= ~I2C_MSG_NOSTOP;
+	ip->nostop = 0;
+}
+
+/* The hardware sends a stop after a write unless told not to.
+ * Nobody else wants that flag, so we only set it for the length
+ *  of the transfer (and only remember the first 32 messages,
+ *  which is plenty).
+ */
+static int32
+i2c_hw_start ( struct i2c *ip, struct i2c_txn *tp )
+{
+	int32 rv;
+	int i;
+
+	ip->nostop = 0;
+	for ( i = 0; i < tp->nmsgs - 1; i++ ) {
+	    if ( tp->msgs[i].flags & I2C_MSG_NOSTOP )
+		continue;
+	    tp->msgs[i].flags |= I2C_MSG_NOSTOP;
+	    if ( i < 32 )
+		ip->nostop |= 1U << i;
+	}
+
+	rv = i2c_master_xfer_async ( ip->hw, tp->msgs, tp->nmsgs,
+	    HW_TIMEOUT, i2c_hw_done, ip );
+	if ( rv )
+	    i2c_hw_flags ( ip, tp );
+	return rv;
+}
+
+/* Called by i2c_hw.c when a transfer is over, mostly from the
+ *  event interrupt.
+ * i2c_master_xfer counts the length down as it goes, so we put
+ *  that back, along with the flags, and the caller finds its
+ *  messages as it left them (with xferred filled in).
+ * A NACK is just the slave saying no, the error interrupt has
+ *  already sent the stop, so the device only needs to be told to
+ *  carry on.
+ * Anything else stalls the bus for i2c_poll to sort out.
+ */
+static void
+i2c_hw_done ( i2c_dev *dev, int32 rv, void *arg )
+{
+	struct i2c *ip = (struct i2c *) arg;
+	struct i2c_txn *tp = ip->cur;
+	int status = I2C_OK;
+	int i;
+
+	for ( i = 0; i < tp->nmsgs; i++ )
+	    tp->msgs[i].length += tp->msgs[i].xferred;
+	i2c_hw_flags ( ip, tp );
+
+	if ( rv ) {
+	    if ( dev->error_flags & I2C_SR1_AF ) {
+		i2c_master_clear_nack ( dev );
+		status = I2C_ERR_NACK;
+	    } else {
+		ip->stalled = rv == I2C_ERROR_TIMEOUT ?
+		    I2C_ERR_TIMEOUT : I2C_ERR_BUS;
+		return;
+	    }
+	}
+
+	i2c_txn_done ( ip, status );
+	i2c_next ( ip );
+}
+
+/* Called from the DMA interrupt by iic_dma.c */
+static void
+i2c_dma_done ( void *arg, int status )
+{
+	struct i2c *ip = (struct i2c *) arg;
+
+	/* Somebody called iic_dma_xfer behind our back */
+	if ( ! ip->cur )
+	    return;
+
+	i2c_txn_done ( ip, status );
+	i2c_next ( ip );
+}
+
+/* Get tp going on the bus.
+ * Returns 1 if it is already over (the GPIO bus does the
+ *  whole thing right here, and a start can fail), else 0.
+ */
+static int
+i2c_txn_start ( struct i2c *ip, struct i2c_txn *tp )
+{
+	int rv;
+
+	ip->start = dwt_cycles ();
+
+	if ( tp->nmsgs < 1 ) {
+	    i2c_txn_done ( ip, I2C_OK );
 	    return 1;
+	}
+
+	if ( ip->type == I2C_AUTO && ip->fallback )
+	    i2c_auto_retry ( ip );
+
+        if ( i2c_on_hw ( ip ) ) {
+	    /* Straight after the last one, the stop may still be
+	     *  going out.  We may be in an interrupt, so don't wait
+	     *  for it here, i2c_poll will.
+	     */
+	    if ( i2c_hw_start ( ip, tp ) != 0 )
+		ip->stalled = STALL_BUSY;
+	    return 0;
+        } else if ( ip->type == I2C_DMA ) {
+	    if ( (rv = iic_dma_start ( ip->hw, tp->msgs, tp->nmsgs )) == 0 )
+		return 0;
         } else {
-            return iic_send ( addr, buf, count );
+	    rv = iic_xfer ( i2c_iic ( ip ), tp->msgs, tp->nmsgs );
         }
+
+	i2c_txn_done ( ip, rv );
+	return 1;
 }
 
+/* If the bus is free, start whatever is at the head of the queue,
+ *  and keep at it while things finish right away.
+ */
+static void
+i2c_next ( struct i2c *ip )
+{
+	struct i2c_txn *tp;
+	uint32 irq;
+
+	for ( ;; ) {
+	    irq = nvic_globalirq_save ();
+	    tp = ip->queue;
+	    if ( ip->cur || ! tp ) {
+		nvic_globalirq_restore ( irq );
+		return;
+	    }
+	    ip->queue = tp->next;
+	    ip->cur = tp;
+	    nvic_globalirq_restore ( irq );
+
+	    if ( ! i2c_txn_start ( ip, tp ) )
+		return;
+	}
+}
+
+/* Deal with a stalled bus (see above), from thread context only.
+ * If the transaction could not even start because the bus was
+ *  busy, we just try again, until it has been busy too long, and
+ *  then it is a timeout like any other.
+ * We reset the hardware, then the transaction that was on the
+ *  bus has one more go.  An I2C_AUTO bus has that go with the
+ *  GPIO driver, and so does whatever is queued behind it.
+ * If the reset could not free the bus there is no point in
+ *  trying again, the transaction fails with what stalled it.
+ * Anybody who submits work and doesn't i2c_wait for it should
+ *  call this now and then (it costs nothing when all is well).
+ * Returns 1 if there was something to do, else 0.
+ */
 int
-i2c_recv ( struct i2c *ip, int addr, char *buf, int count )
+i2c_poll ( struct i2c *ip )
 {
-        if ( ip->type == I2C_HW ) {
-            // return i2c_hw_recv ( ip->hw, addr, buf, count );
+	struct i2c_txn *tp = ip->cur;
+	int status = ip->stalled;
+	int reset;
+
+	if ( ! status )
+	    return 0;
+	ip->stalled = 0;
+
+	if ( status == STALL_BUSY ) {
+	    if ( (dwt_cycles () - ip->start) / CYCLES_PER_MICROSECOND < BUSY_WAIT_US ) {
+		if ( i2c_hw_start ( ip, tp ) != 0 )
+		    ip->stalled = STALL_BUSY;
+		return 1;
+	    }
+	    status = I2C_ERR_TIMEOUT;
+	}
+
+	reset = i2c_hw_reset ( ip->hw );
+
+	if ( ip->type == I2C_AUTO ) {
+	    i2c_account ( ip, status );
+	    i2c_auto_fallback ( ip );
+	    if ( i2c_txn_start ( ip, tp ) )
+		i2c_next ( ip );
 	    return 1;
+	}
+
+	/* The failed go is counted before the retry, so if the
+	 *  retry can't even start, that is not another error.
+	 */
+	if ( reset == 0 && ++tp->tries < 2 ) {
+	    i2c_account ( ip, status );
+	    if ( i2c_hw_start ( ip, tp ) == 0 )
+		return 1;
+	    i2c_txn_finish ( ip, status );
+	} else
+	    i2c_txn_done ( ip, status );
+
+	i2c_next ( ip );
+	return 1;
+}
+
+/* Queue up a transaction, behind everything of the same or
+ *  higher priority, and return right away (unless this is
+ *  a GPIO bus, see above).
+ * Returns 0 if OK, I2C_ERR_BUSY if tp is still in use.
+ */
+int
+i2c_submit ( struct i2c *ip, struct i2c_txn *tp )
+{
+	struct i2c_txn **pp;
+	uint32 irq;
+
+	if ( tp->busy )
+	    return I2C_ERR_BUSY;
+
+	(void) i2c_poll ( ip );
+
+	tp->ip = ip;
+	tp->busy = 1;
+	tp->status = I2C_OK;
+	tp->tries = 0;
+
+	irq = nvic_globalirq_save ();
+	for ( pp = &ip->queue; *pp && (*pp)->prio <= tp->prio; pp = &(*pp)->next )
+	    ;
+	tp->next = *pp;
+	*pp = tp;
+	nvic_globalirq_restore ( irq );
+
+	i2c_next ( ip );
+	return 0;
+}
+
+/* Wait for a transaction to be over.
+ * Don't do this from an interrupt (or a done callback),
+ *  the bus may need that very interrupt to get there,
+ *  and a stalled bus needs us to get it going again.
+ * Return 0 if OK, or one of the I2C_ERR_* codes.
+ */
+int
+i2c_wait ( struct i2c_txn *tp )
+{
+	while ( tp->busy )
+	    (void) i2c_poll ( tp->ip );
+	return tp->status;
+}
+
+/* Let everything queued on the bus go out, so the settings
+ *  below can be changed under it without pulling the rug out
+ *  from under a transfer.  Thread context only, like i2c_wait.
+ */
+static void
+i2c_drain ( struct i2c *ip )
+{
+	while ( ip->cur || ip->queue )
+	    (void) i2c_poll ( ip );
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Send and Receive are the fundamental i2c primitives
+ * that everything else gets routed through.
+ * Return 0 if OK, or one of the I2C_ERR_* codes in i2c.h
+ *  (usually I2C_ERR_NACK).
+ */
+
+int
+i2c_send ( struct i2c *ip, int addr, char *buf, int count )
+{
+	i2c_msg msg;
+
+	msg.addr = addr;
+	msg.flags = 0;
+	msg.length = count;
+	msg.data = (uint8 *) buf;
+	return i2c_xfer ( ip, &msg, 1 );
+}
+
+int
+i2c_recv ( struct i2c *ip, int addr, char *buf, int count )
+{
+	i2c_msg msg;
+
+	msg.addr = addr;
+	msg.flags = I2C_MSG_READ;
+	msg.length = count;
+	msg.data = (uint8 *) buf;
+	return i2c_xfer ( ip, &msg, 1 );
+}
+
+/* Do a whole transaction made of several messages,
+ *  usually a write of a register number then a read.
+ * There is a repeated start between the messages and only
+ *  one stop at the end, so nobody else can get in between
+ *  and there is no extra stop, start and address to send.
+ * This goes to the head of the queue and waits its turn.
+ * Return 0 if OK, or one of the I2C_ERR_* codes.
+ */
+int
+i2c_xfer ( struct i2c *ip, i2c_msg *msgs, int n )
+{
+	struct i2c_txn txn;
+
+	txn.msgs = msgs;
+	txn.nmsgs = n;
+	txn.prio = I2C_PRIO_HIGH;
+	txn.done = NULL;
+	txn.busy = 0;
+
+	(void) i2c_submit ( ip, &txn );
+	return i2c_wait ( &txn );
+}
+
+/* Pick the bus speed, one of the I2C_SPEED_* values.
+ * The hardware can do standard and fast,
+ *  the GPIO driver can also do fast plus.
+ * Whatever is queued goes out first, at the old speed.
+ * Return 0 if OK, 1 if that speed is not possible.
+ */
+int
+i2c_set_speed ( struct i2c *ip, int speed )
+{
+	uint32 flags;
+
+	i2c_drain ( ip );
+
+        if ( ip->type == I2C_HW || ip->type == I2C_AUTO ) {
+	    if ( speed == I2C_SPEED_STANDARD )
+		flags = 0;
+	    else if ( speed == I2C_SPEED_FAST )
+		flags = I2C_FAST_MODE;
+	    else
+		return 1;
+
+	    if ( ip->type == I2C_AUTO ) {
+		(void) iic_set_speed ( ip->sw, speed );
+		/* Leave the pins to the GPIO driver,
+		 *  i2c_hw_reset finds the speed here later.
+		 */
+		if ( ip->fallback ) {
+		    ((i2c_dev *) ip->hw)->config_flags = flags;
+		    return 0;
+		}
+	    }
+	    i2c_master_enable ( ip->hw, flags, flags ? 400000 : 100000 );
+	    return 0;
         } else {
-            return iic_recv ( addr, buf, count );
+            return iic_set_speed ( ip->hw, speed );
         }
 }
 
+/* How long (in microseconds) a slave may hold SCL low
+ *  before we give up and call it I2C_ERR_TIMEOUT.
+ *  The GPIO driver starts out at 25 ms.
+ * The DMA driver can't wait at all, and the hardware has
+ *  its own timeout, so this only matters for GPIO
+ *  (and I2C_AUTO when it falls back to GPIO).
+ * Return 0 if OK, 1 if this bus has no such setting.
+ */
+int
+i2c_set_timeout ( struct i2c *ip, int usecs )
+{
+        if ( ip->type == I2C_HW )
+	    return 1;
+	iic_set_timeout ( i2c_iic ( ip ), usecs );
+	return 0;
+}
+
+/* Let DMA move the data on a hardware bus, a 1K display
+ *  refresh would otherwise be over a thousand interrupts.
+ * This is off to begin with, since the DMA channels are
+ *  shared with the USARTs (and iic_dma.c), see i2c_f1.c.
+ *  A channel some other driver has already claimed is left
+ *  alone, and that direction stays a byte at a time.
+ * Whatever is queued goes out first, the old way.
+ * Return 0 if OK, 1 if this bus can't (not hardware,
+ *  or no channel to be had).
+ */
+int
+i2c_set_dma ( struct i2c *ip, int on )
+{
+	i2c_dev *dev = ip->hw;
+
+        if ( ip->type != I2C_HW && ip->type != I2C_AUTO )
+	    return 1;
+	i2c_drain ( ip );
+
+	if ( ! on ) {
+	    i2c_master_dma_disable ( dev );
+	    return 0;
+	}
+	return i2c_master_dma_enable ( dev ) ? 1 : 0;
+}
+
+/* Find out what SCL rate we really get, in Hz,
+ *  by addressing the device at addr.
+ * Only the GPIO driver can measure itself, for HW we return 0,
+ *  and with DMA we return the rate we asked for.
+ * The measurement drives the pins itself, so the queue has
+ *  to be empty first.
+ */
+int
+i2c_scl_hz ( struct i2c *ip, int addr )
+{
+	i2c_drain ( ip );
+
+        if ( i2c_on_hw ( ip ) )
+	    return 0;
+        if ( ip->type == I2C_DMA )
+	    return iic_dma_scl_hz ( ip->hw );
+	return iic_scl_hz ( i2c_iic ( ip ), addr );
+}
+
+/* Show how the bus has been doing, a line for each backend
+ *  that has been used.  The rate is while the bus is busy,
+ *  which is what tells the hardware and GPIO drivers apart.
+ */
+void
+i2c_show_stats ( struct i2c *ip, int fd )
+{
+	static const char * const names[] = { "hw", "gpio" };
+	struct i2c_stats *sp;
+	uint32 rate;
+	uint32 pm;
+	int i;
+
+	for ( i = 0; i < 2; i++ ) {
+	    sp = &ip->stats[i];
+	    if ( ! sp->xfers )
+		continue;
+	    pm = (uint32) ((uint64) sp->errors * 1000 / sp->xfers);
+	    rate = sp->usecs ? (uint32) ((uint64) sp->bytes * 1000000 / sp->usecs) : 0;
+	    serial_printf ( fd, "i2c %s: %u xfers, %u errors (%u.%u%%), %u nacks, %u bytes, %u bytes/s\n",
+		names[i], sp->xfers, sp->errors, pm / 10, pm % 10,
+		sp->nacks, sp->bytes, rate );
+	}
+
+	if ( ip->type == I2C_AUTO ) {
+	    if ( ip->fallback )
+		serial_printf ( fd, "i2c auto: on gpio, %u fallbacks, hw again in %d ms\n",
+		    ip->fallbacks, (int32) (ip->retry_at - systick_uptime ()) );
+	    else
+		serial_printf ( fd, "i2c auto: on hw, %u fallbacks\n", ip->fallbacks );
+	}
+}
+
 /* THE END */
@@ -35,7 +35,10 @@
  * - Enable an I2C device with i2c_master_enable().
  * - Initialize an array of struct i2c_msg to suit the bus
  *   transactions (reads/writes) you wish to perform.
- * - Call i2c_master_xfer() to do the work.
+ * - Optionally call i2c_master_dma_enable(), so long messages
+ *   don't take an interrupt per byte.
+ * - Call i2c_master_xfer() to do the work, or i2c_master_xfer_async()
+ *   to have a callback when it is done and get on with other things.
  *
  * Slave Usage notes:
  * - Enable I2C slave by calling i2c_slave_enable().
@@ -54,6 +57,8 @@
 #ifndef _LIBMAPLE_I2C_H_
 #define _LIBMAPLE_I2C_H_
 
+#include <libmaple/libmaple_types.h>
+
 /* The following is from Kyu.  11-14-2020 Tom Trebisky
 *
  * I have introduced my "iic.c" bit bang GPIO driver and
@@ -65,17 +70,113 @@
 
 #define I2C_HW          1
 #define I2C_GPIO        2
+#define I2C_DMA         3
+#define I2C_AUTO        4	/* hardware, GPIO when it acts up */
+
+struct i2c_txn;
+struct iic;
+
+/* How one backend has been doing, see i2c_show_stats.
+ * Only transfer time counts, so bytes / usecs is what the
+ *  bus delivers while it is busy.  usecs wraps after an
+ *  hour or so of that.
+ */
+struct i2c_stats {
+	uint32 xfers;		/* tries, a retry counts again */
+	uint32 errors;		/* that failed, not counting NACKs */
+	uint32 nacks;
+	uint32 bytes;		/* in transfers that worked */
+	uint32 usecs;		/* on the bus, all tries */
+};
+
+#define I2C_STATS_HW		0
+#define I2C_STATS_SW		1	/* GPIO or DMA bit banging */
 
 struct i2c {
         int type;
         void *hw;
+
+	/* See i2c_submit */
+	struct i2c_txn *queue;		/* waiting, most urgent first */
+	struct i2c_txn * volatile cur;	/* on the bus right now */
+	uint32 start;			/* DWT cycles, when cur went out */
+	volatile int stalled;		/* I2C_ERR_*, cur waits for i2c_poll */
+	uint32 nostop;			/* msgs i2c_hw_start added NOSTOP to */
+
+	struct i2c_stats stats[2];
+
+	/* For I2C_AUTO, see i2c_auto_new */
+	struct iic *sw;			/* GPIO driver on the same pins */
+	volatile int fallback;		/* running on sw just now */
+	uint32 fallbacks;		/* how many times */
+	uint32 retry_at;		/* systick ms, give hw another go */
+	uint32 retry_ms;		/* the wait before that */
+	uint32 hw_good;			/* clean hw transfers since then */
+};
+
+/* A transaction for the bus queue.
+ * Fill in msgs, nmsgs, prio, and done (if you want to hear about
+ *  it) and hand it to i2c_submit.  It belongs to the queue (as do
+ *  the messages and their data) until busy goes back to 0.
+ * done gets called with the I2C_ERR_* status, often from an
+ *  interrupt, and may submit more work.
+ */
+struct i2c_msg;
+
+struct i2c_txn {
+	struct i2c_txn *next;
+	struct i2c_msg *msgs;
+	int nmsgs;
+	int prio;
+	void (*done) ( struct i2c_txn *, int );
+	void *arg;			/* for the owner */
+	volatile int busy;
+	volatile int status;
+	int tries;
+	struct i2c *ip;			/* the bus, for i2c_wait */
 };
 
+/* Lower runs first, and the same priority runs in order */
+#define I2C_PRIO_HIGH		0	/* short sensor reads, i2c_xfer */
+#define I2C_PRIO_NORMAL		1
+#define I2C_PRIO_LOW		2	/* display refresh and other bulk */
+
+/* Bus speeds for i2c_set_speed */
+#define I2C_SPEED_STANDARD	0	/* 100 kHz */
+#define I2C_SPEED_FAST		1	/* 400 kHz */
+#define I2C_SPEED_FAST_PLUS	2	/* 1 MHz, GPIO only */
+
+/* What i2c_send, i2c_recv and i2c_xfer return.
+ * Anything but 0 is trouble, these say what kind, so a caller
+ *  can decide to just try again.
+ */
+#define I2C_OK			0
+#define I2C_ERR_NACK		1	/* no ACK, nobody there or it said no */
+#define I2C_ERR_TIMEOUT		2	/* a slave held SCL low too long */
+#define I2C_ERR_BUS		3	/* SDA stuck low and we could not free it */
+#define I2C_ERR_BUSY		4	/* the DMA engine is in use */
+
 struct i2c *i2c_hw_new ( int );
 struct i2c *i2c_gpio_new ( int, int );
+struct i2c *i2c_dma_new ( int, int );
+struct i2c *i2c_auto_new ( int );
+void i2c_show_stats ( struct i2c *, int );
 
 int i2c_send ( struct i2c *, int, char *, int );
 int i2c_recv ( struct i2c *, int, char *, int );
+int i2c_set_speed ( struct i2c *, int );
+int i2c_set_timeout ( struct i2c *, int );
+int i2c_set_dma ( struct i2c *, int );
+
+/* A write then a read (or any list of messages) with
+ *  repeated starts, see i2c_msg below.
+ */
+int i2c_xfer ( struct i2c *, struct i2c_msg *, int );
+int i2c_scl_hz ( struct i2c *, int );
+
+int i2c_submit ( struct i2c *, struct i2c_txn * );
+int i2c_wait ( struct i2c_txn * );
+int i2c_poll ( struct i2c * );
 
 /*
  * Series header must provide:
@@ -242,17 +343,25 @@ typedef struct i2c_msg {
 #define I2C_SLAVE_GENERAL_CALL  0x80          // Enable the general call on address 0x00
 #define I2C_PUP_RESET           0x100         // Power-Up Reset
 
-void i2c_master_enable(i2c_dev *dev, uint32 flags, uint32 freq);
+int32 i2c_master_enable(i2c_dev *dev, uint32 flags, uint32 freq);
+void i2c_master_clear_nack(i2c_dev *dev);
 void i2c_slave_enable(i2c_dev *dev, uint32 flags, uint32 freq);
+int i2c_master_dma_enable(i2c_dev *dev);
+void i2c_master_dma_disable(i2c_dev *dev);
 
 #define I2C_ERROR_PROTOCOL      (-1)
 #define I2C_ERROR_TIMEOUT       (-2)
+#define I2C_ERROR_BUSY          (-3)
 
 void i2c_set_debug ( int );
+void i2c_trace_show(int fd);
+void i2c_trace_enable(int on);
 int32 i2c_master_xfer(i2c_dev *dev, i2c_msg *msgs, uint16 num, uint32 timeout);
+int32 i2c_master_xfer_async(i2c_dev *dev, i2c_msg *msgs, uint16 num, uint32 timeout,
+                            i2c_xfer_done_func done, void *arg);
 int32 wait_for_state_change(i2c_dev *dev, i2c_state state, uint32 timeout);
 
-void i2c_bus_reset(const i2c_dev *dev);
+int i2c_bus_reset(const i2c_dev *dev);
 
 /* Auxiliary procedure for enabling an I2C peripheral; `flags' as for
  * i2c_master_enable(). */
@@ -51,6 +51,8 @@
 struct gpio_dev;
 struct i2c_reg_map;
 struct i2c_msg;
+struct i2c_dev;
+struct dma_dev;
 
 /** I2C device states */
 typedef enum i2c_state {
@@ -63,6 +65,7 @@ typedef enum i2c_state {
 
 typedef void (*i2c_slave_recv_callback_func)(struct i2c_msg *);
 typedef void (*i2c_slave_xmit_callback_func)(struct i2c_msg *);
+typedef void (*i2c_xfer_done_func)(struct i2c_dev *, int32, void *);
 
 /**
  * @brief I2C device type.
@@ -113,6 +116,26 @@ typedef struct i2c_dev {
 
     struct i2c_msg *i2c_slave_xmit_msg;    /* the message that the i2c slave will use for transmitting */
     struct i2c_msg *i2c_slave_recv_msg;    /* the message that the i2c slave will use for receiving */
+
+    /*
+     * Master transfers by DMA, see i2c_master_dma_enable().
+     */
+    struct dma_dev *dma;        /**< DMA controller, or NULL for byte interrupts */
+    uint8 dma_tx_ch;            /**< TX DMA channel */
+    uint8 dma_rx_ch;            /**< RX DMA channel */
+    uint16 dma_tx_src;          /**< TX dma_request_src */
+    uint16 dma_rx_src;          /**< RX dma_request_src */
+    void (*dma_rx_irq)(void);   /**< RX transfer complete handler */
+    volatile uint8 dma_ch;      /**< Channel the current message is using, or 0 */
+    uint16 dma_left;            /**< DMA count at the last timeout check */
+
+    /*
+     * Master transfer completion, see i2c_master_xfer_async().
+     */
+    i2c_xfer_done_func xfer_done;   /**< Called when the transfer is over */
+    void *xfer_arg;             /**< Passed to xfer_done */
+    uint32 xfer_timeout;        /**< Bus idle timeout, in milliseconds */
+    volatile int32 xfer_rc;     /**< How the last transfer ended */
 } i2c_dev;
 
 #endif
@@ -31,6 +31,7 @@
 
 #include "i2c_private.h"
 #include <libmaple/i2c.h>
+#include <libmaple/dma.h>
 
 /*
  * Devices
@@ -96,6 +97,97 @@ __weak void __irq_i2c2_er(void) {
     _i2c_irq_error_handler(I2C2);
 }
 
+/*
+ * DMA
+ */
+
+static void i2c1_dma_rx_irq(void) {
+    _i2c_dma_rx_irq_handler(I2C1);
+}
+
+static void i2c2_dma_rx_irq(void) {
+    _i2c_dma_rx_irq_handler(I2C2);
+}
+
+/**
+ * @brief Move master transfer data by DMA.
+ *
+ * Instead of an interrupt for every byte, each message is handed to
+ * a DMA channel once the address has gone out, so a transfer costs
+ * a handful of interrupts however long it is.  Reads of 1 or 2 bytes
+ * still go through the byte interrupts, as the NACK/STOP timing for
+ * those can't be done with DMA.
+ *
+ * This is off unless asked for.  The channels are shared with other
+ * peripherals, so they are claimed (see dma_claim()) until
+ * i2c_master_dma_disable().  A direction whose channel another
+ * driver already has goes the byte interrupt way instead.
+ * I2C1 uses DMA1 channels 6 (TX) and 7 (RX); 6 is USART2 RX DMA's,
+ * and 7 is USART2 TX DMA's and the GPIO DMA driver's (iic_dma.c).
+ * I2C2 uses DMA1 channels 4 (TX) and 5 (RX), which are USART1's.
+ *
+ * Call this after i2c_master_enable(), it survives re-enabling.
+ *
+ * @param dev I2C device
+ * @return 0 if at least one direction goes by DMA, -1 if neither can.
+ */
+int i2c_master_dma_enable(i2c_dev *dev) {
+    if (dev->dma) {
+        return 0;
+    }
+    if (dev == I2C1) {
+        dev->dma_tx_ch = DMA_CH6;
+        dev->dma_rx_ch = DMA_CH7;
+        dev->dma_tx_src = DMA_REQ_SRC_I2C1_TX;
+        dev->dma_rx_src = DMA_REQ_SRC_I2C1_RX;
+        dev->dma_rx_irq = i2c1_dma_rx_irq;
+    } else if (dev == I2C2) {
+        dev->dma_tx_ch = DMA_CH4;
+        dev->dma_rx_ch = DMA_CH5;
+        dev->dma_tx_src = DMA_REQ_SRC_I2C2_TX;
+        dev->dma_rx_src = DMA_REQ_SRC_I2C2_RX;
+        dev->dma_rx_irq = i2c2_dma_rx_irq;
+    } else {
+        return -1;
+    }
+
+    dma_init(DMA1);
+    if (dma_claim(DMA1, dev->dma_tx_ch, dev) < 0) {
+        dev->dma_tx_ch = 0;
+    }
+    if (dma_claim(DMA1, dev->dma_rx_ch, dev) < 0) {
+        dev->dma_rx_ch = 0;
+    }
+    if (!dev->dma_tx_ch && !dev->dma_rx_ch) {
+        return -1;
+    }
+    dev->dma_ch = 0;
+    dev->dma = DMA1;
+    return 0;
+}
+
+/**
+ * @brief Go back to an interrupt for every byte.
+ *
+ * The DMA channels are released for other drivers.
+ *
+ * @param dev I2C device
+ */
+void i2c_master_dma_disable(i2c_dev *dev) {
+    ASSERT(dev->state != I2C_STATE_BUSY);
+    if (!dev->dma) {
+        return;
+    }
+    if (dev->dma_rx_ch) {
+        dma_detach_interrupt(dev->dma, dev->dma_rx_ch);
+        dma_release(dev->dma, dev->dma_rx_ch, dev);
+    }
+    if (dev->dma_tx_ch) {
+        dma_release(dev->dma, dev->dma_tx_ch, dev);
+    }
+    dev->dma = NULL;
+}
+
 /*
  * Internal APIs
  */
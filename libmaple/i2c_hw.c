@@ -53,8 +53,12 @@
 #include <libmaple/nvic.h>
 #include <libmaple/i2c.h>
 #include <libmaple/systick.h>
+#include <libmaple/dma.h>
 
 #include <serial.h>
+#include <tlog.h>
+#include <dwt.h>
+#include <boards.h>
 
 #include <string.h>
 
@@ -77,53 +81,110 @@ static inline void i2c_send_slave_addr(i2c_dev *dev, uint32 addr, uint32 rw) {
 }
 
 /*
- * Simple debugging trail. Define I2C_DEBUG to turn on.
+ * Event trace.
+ *
+ * Each interrupt leaves two entries in a small ring, one on the way
+ * in and one on the way out, and each master transfer one at the
+ * start and one at the end.  An entry is a DWT cycle count, the event,
+ * which bus, SR1 and SR2, and a word that depends on the event.
+ * The ring just wraps, so it always holds the most recent
+ * I2C_TRACE_SIZE events, which is what you want to see after a bus has
+ * hung in the field.  It costs a couple dozen cycles an entry and is
+ * on all the time; build with I2C_TRACE_SIZE=0 to leave it out.
+ *
+ * SR2 is only there when the handler had to read it anyway (ADDR,
+ * STOPF and errors), since reading SR2 is what clears ADDR.
+ *
+ * i2c_trace_show() prints the ring, support/scripts/i2c_trace.py
+ * turns that into per-byte latency and interrupt service times.
  */
-#ifdef I2C_DEBUG
+#ifndef I2C_TRACE_SIZE
+#define I2C_TRACE_SIZE          128     // entries, a power of 2
+#endif
+
+enum {
+    I2C_TR_XFER         = 1,    // arg: address byte of the first message
+    I2C_TR_IRQ          = 2,    // arg: CR1
+    I2C_TR_IRQ_EXIT     = 3,    // arg: bytes moved in the current message
+    I2C_TR_ERROR        = 4,    // arg: CR1
+    I2C_TR_DMA_RX       = 5,    // arg: dma_irq_cause
+    I2C_TR_DONE         = 6,    // arg: return code, SR1 is error_flags
+};
+
+#define I2C_TR_NO_MSG           0xffff
 
-// TODO : Add back DEBUG support to the IRQ functions to set these crumbs
+#if I2C_TRACE_SIZE > 0
 
-#define NR_CRUMBS       128
-struct crumb {
-    uint32 event;
-    uint32 arg0;
-    uint32 arg1;
-    uint32 arg2;	// filler to make the data fit GDB memory dump screen
+struct i2c_trace {
+    uint32 stamp;               // DWT cycles
+    uint16 sr1;
+    uint16 sr2;
+    uint8 event;
+    uint8 bus;
+    uint16 arg;
 };
-static struct crumb crumbs[NR_CRUMBS];
-static uint32 cur_crumb = 0;
 
-static inline void i2c_drop_crumb(uint32 event, uint32 arg0, uint32 arg1) {
-    if (cur_crumb < NR_CRUMBS) {
-        struct crumb *crumb = &crumbs[cur_crumb++];
-        crumb->event = event;
-        crumb->arg0 = arg0;
-        crumb->arg1 = arg1;
-        crumb->arg2 = cur_crumb-1;
+static struct i2c_trace i2c_trace_ring[I2C_TRACE_SIZE];
+static volatile uint32 i2c_trace_head = 0;
+static volatile uint8 i2c_trace_on = 1;
+
+/*
+ * Claim a slot.  Any interrupt level can get here, so bump the head
+ * with ldrex/strex rather than shutting interrupts off.
+ */
+static inline uint32 i2c_trace_slot(void) {
+    uint32 n, fail;
+
+    do {
+        asm volatile("ldrex %0, [%1]" : "=r" (n) : "r" (&i2c_trace_head));
+        asm volatile("strex %0, %2, [%1]" : "=&r" (fail)
+                     : "r" (&i2c_trace_head), "r" (n + 1) : "memory");
+    } while (fail);
+    return n;
+}
+
+static void i2c_trace(i2c_dev *dev, uint8 event, uint32 sr1, uint32 sr2, uint32 arg) {
+    struct i2c_trace *tp;
+
+    if (!i2c_trace_on) {
+        return;
     }
+    tp = &i2c_trace_ring[i2c_trace_slot() & (I2C_TRACE_SIZE - 1)];
+    tp->stamp = dwt_cycles();
+    tp->sr1 = sr1;
+    tp->sr2 = sr2;
+    tp->event = event;
+    tp->bus = (dev->regs == I2C1_BASE) ? 1 : 2;
+    tp->arg = arg;
 }
-#define I2C_CRUMB(event, arg0, arg1) i2c_drop_crumb(event, arg0, arg1)
+#define I2C_TRACE(dev, event, sr1, sr2, arg) i2c_trace(dev, event, sr1, sr2, arg)
 
 #else
-#define I2C_CRUMB(event, arg0, arg1)
+#define I2C_TRACE(dev, event, sr1, sr2, arg)
 #endif
 
+/*
+ * The bus resets below wait for the lines to follow what we drive.
+ * A slave may stretch the clock for a while, but a shorted line or a
+ * dead slave never lets go, so no wait is longer than SMBus allows a
+ * slave (25 ms), and no more than I2C_RESET_CLOCKS clocks are sent.
+ * The DWT cycle counter has to be running (i2c_master_enable sees to
+ * that).
+ */
+#define I2C_RESET_TIMEOUT_US    25000
+#define I2C_RESET_CLOCKS        9
 
-enum {
-    IRQ_ENTRY           = 1,
-    TXE_ONLY            = 2,
-    TXE_BTF             = 3,
-    STOP_SENT           = 4,
-    TEST                = 5,
-    RX_ADDR_START       = 6,
-    RX_ADDR_STOP        = 7,
-    RXNE_ONLY           = 8,
-    RXNE_SENDING        = 9,
-    RXNE_START_SENT     = 10,
-    RXNE_STOP_SENT      = 11,
-    RXNE_DONE           = 12,
-    ERROR_ENTRY         = 13,
-};
+/* Wait for a line to read level; 0 if it does, -1 if it never does */
+static int i2c_wait_line(struct gpio_dev *port, uint8 pin, uint8 level) {
+    uint32 start = dwt_cycles();
+
+    while (!gpio_read_bit(port, pin) != !level) {
+        if (dwt_cycles() - start > I2C_RESET_TIMEOUT_US * CYCLES_PER_MICROSECOND) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
 /**
  * @brief Reset an I2C bus.
@@ -132,9 +193,16 @@ enum {
  * release SDA and SCL, then generating a START condition, then a STOP
  * condition.
  *
+ * Takes a few hundred microseconds, or (if a line is stuck) up to
+ * about a quarter second, so call this from thread context.
+ *
  * @param dev I2C device
+ * @return 0 if the bus is free, I2C_ERROR_TIMEOUT if a line stayed low.
  */
-void i2c_bus_reset(const i2c_dev *dev) {
+int i2c_bus_reset(const i2c_dev *dev) {
+    int32 rc = 0;
+    int i;
+
     /* Release both lines */
     i2c_master_release_bus(dev);        // Note: This configures the pins as GPIO instead of AF
 
@@ -145,10 +213,13 @@ void i2c_bus_reset(const i2c_dev *dev) {
      * Make sure the bus is free by clocking it until any slaves release the
      * bus.
      */
-    while (!gpio_read_bit(sda_port(dev), dev->sda_pin)) {
+    for (i = 0; !gpio_read_bit(sda_port(dev), dev->sda_pin); i++) {
         /* Wait for any clock stretching to finish */
-        while (!gpio_read_bit(scl_port(dev), dev->scl_pin))
-            ;
+        if (i == I2C_RESET_CLOCKS ||
+            i2c_wait_line(scl_port(dev), dev->scl_pin, 1) < 0) {
+            rc = I2C_ERROR_TIMEOUT;
+            break;
+        }
         delay_us(10);
 
         /* Pull low */
@@ -171,6 +242,7 @@ void i2c_bus_reset(const i2c_dev *dev) {
 
     /* Release Software Reset: */
     dev->regs->CR1 = 0;
+    return rc;
 }
 
 /**
@@ -187,8 +259,14 @@ void i2c_bus_reset(const i2c_dev *dev) {
  * So if you are interfacing two of these micros together,
  * this reset logic will also clear other STM32 controllers
  * on the bus that are also in this stuck-state.
+ *
+ * If a line does not follow, we skip ahead to step 12, so the
+ * peripheral is at least reset and has its pins back, and say so.
+ * Returns 0, or I2C_ERROR_TIMEOUT.
  */
-static void i2c_clear_busy_flag_erratum(const i2c_dev *dev) {
+static int32 i2c_clear_busy_flag_erratum(const i2c_dev *dev) {
+    int32 rc = I2C_ERROR_TIMEOUT;
+
     // 1. Clear PE bit.
     dev->regs->CR1 &= ~I2C_CR1_PE;
 
@@ -196,33 +274,45 @@ static void i2c_clear_busy_flag_erratum(const i2c_dev *dev) {
     i2c_master_release_bus(dev);
 
     // 3. Check SCL and SDA High level in GPIOx_IDR.
-    while (gpio_read_bit(scl_port(dev), dev->scl_pin) == 0) { }
-    while (gpio_read_bit(sda_port(dev), dev->sda_pin) == 0) { }
+    if (i2c_wait_line(scl_port(dev), dev->scl_pin, 1) < 0 ||
+        i2c_wait_line(sda_port(dev), dev->sda_pin, 1) < 0) {
+        goto out;
+    }
 
     // 4. Configure the SDA I/O as General Purpose Output Open-Drain, Low level (Write 0 to GPIOx_ODR).
     gpio_write_bit(sda_port(dev), dev->sda_pin, 0);
 
     // 5. Check SDA Low level in GPIOx_IDR.
-    while (gpio_read_bit(sda_port(dev), dev->sda_pin)) { }
+    if (i2c_wait_line(sda_port(dev), dev->sda_pin, 0) < 0) {
+        goto out;
+    }
 
     // 6. Configure the SCL I/O as General Purpose Output Open-Drain, Low level (Write 0 to GPIOx_ODR).
     gpio_write_bit(scl_port(dev), dev->scl_pin, 0);
 
     // 7. Check SCL Low level in GPIOx_IDR.
-    while (gpio_read_bit(scl_port(dev), dev->scl_pin)) { }
+    if (i2c_wait_line(scl_port(dev), dev->scl_pin, 0) < 0) {
+        goto out;
+    }
 
     // 8. Configure the SCL I/O as General Purpose Output Open-Drain, High level (Write 1 to GPIOx_ODR).
     gpio_write_bit(scl_port(dev), dev->scl_pin, 1);
 
     // 9. Check SCL High level in GPIOx_IDR.
-    while (gpio_read_bit(scl_port(dev), dev->scl_pin) == 0) { }
+    if (i2c_wait_line(scl_port(dev), dev->scl_pin, 1) < 0) {
+        goto out;
+    }
 
     // 10. Configure the SDA I/O as General Purpose Output Open-Drain , High level (Write 1 to GPIOx_ODR).
     gpio_write_bit(sda_port(dev), dev->sda_pin, 1);
 
     // 11. Check SDA High level in GPIOx_IDR.
-    while (gpio_read_bit(sda_port(dev), dev->sda_pin) == 0) { }
+    if (i2c_wait_line(sda_port(dev), dev->sda_pin, 1) < 0) {
+        goto out;
+    }
+    rc = 0;
 
+ out:
     // 12. Configure the SCL and SDA I/Os as Alternate function Open-Drain.
     i2c_config_gpios(dev);
 
@@ -236,6 +326,7 @@ static void i2c_clear_busy_flag_erratum(const i2c_dev *dev) {
 
     // 15. Enable the I2C peripheral by setting the PE bit in I2Cx_CR1 register
     // This step handled in i2c_master_enable
+    return rc;
 }
 
 /**
@@ -269,11 +360,20 @@ void i2c_init(i2c_dev *dev) {
  *              I2C_SLAVE_DUAL_ADDRESS: Slave can respond on 2 i2C addresses
  *              I2C_SLAVE_GENERAL_CALL: SLA+W broadcast to all general call
  *                                      listeners on bus. Addr 0x00
+ * @return 0, or I2C_ERROR_TIMEOUT if I2C_BUS_RESET or I2C_PUP_RESET
+ *         found a line stuck low.  The device is enabled either way.
+ *         With either reset flag this can take a while, so call it
+ *         from thread context.
  */
-void i2c_master_enable(i2c_dev *dev, uint32 flags, uint32 freq) {
+int32 i2c_master_enable(i2c_dev *dev, uint32 flags, uint32 freq) {
+    int32 rc = 0;
+
     /* Remap I2C if needed */
     _i2c_handle_remap(dev, flags);
 
+    /* The resets time their waits with the cycle counter */
+    dwt_init();
+
     /* Turn on clock */
     i2c_init(dev);              // If clocks aren't running here, the reset and clear logic below doesn't work
 
@@ -283,12 +383,14 @@ void i2c_master_enable(i2c_dev *dev, uint32 flags, uint32 freq) {
     /* Reset the bus. Clock out any hung slaves. */
     /* Note that this call reconfigs the port pins as GPIO instead of AF */
     if (flags & I2C_BUS_RESET) {
-        i2c_bus_reset(dev);
+        rc = i2c_bus_reset(dev);
         flags &= ~I2C_BUS_RESET;
     }
 
     if (flags & I2C_PUP_RESET) {
-        i2c_clear_busy_flag_erratum(dev);
+        if (i2c_clear_busy_flag_erratum(dev) < 0) {
+            rc = I2C_ERROR_TIMEOUT;
+        }
         flags &= ~I2C_PUP_RESET;
     }
 
@@ -327,6 +429,24 @@ void i2c_master_enable(i2c_dev *dev, uint32 flags, uint32 freq) {
     }
 
     dev->state = I2C_STATE_IDLE;
+    return rc;
+}
+
+/**
+ * @brief Get ready for the next transfer after a NACK.
+ *
+ * A NACK is the slave's answer, not trouble with the bus: the error
+ * interrupt has already sent a STOP, so nothing needs resetting.
+ * This only takes the device out of I2C_STATE_ERROR.  Safe to call
+ * from the transfer's done callback.
+ *
+ * @param dev I2C device
+ */
+void i2c_master_clear_nack(i2c_dev *dev) {
+    if (dev->state == I2C_STATE_ERROR) {
+        dev->error_flags = 0;
+        dev->state = I2C_STATE_IDLE;
+    }
 }
 
 
@@ -351,6 +471,10 @@ void i2c_slave_enable(i2c_dev *dev, uint32 flags, uint32 freq)
     i2c_master_enable(dev, flags | I2C_SLAVE_MODE, freq);
 }
 
+/* When set, the transfer code and the interrupt handlers log
+ * what they are up to with TLOG (see tlog.c), which is cheap enough
+ * not to upset the timing.  Call tlog_drain() to see it.
+ */
 static int8_t i2c_debug = 0;
 
 void
@@ -360,27 +484,294 @@ i2c_set_debug ( int val )
     
 }
 
+#if I2C_TRACE_SIZE > 0
+static const char * const i2c_trace_names[] = {
+    "?", "xfer", "irq", "exit", "error", "dma_rx", "done"
+};
+#define I2C_TR_NAMES (sizeof(i2c_trace_names) / sizeof(i2c_trace_names[0]))
+
+/*
+ * Print the trace ring, oldest first, one event a line:
+ *
+ *   stamp bus event sr1 sr2 arg
+ *
+ * This is meant for a person to look at in a pinch, or better, to
+ * capture and feed to support/scripts/i2c_trace.py.  Recording is
+ * held off while we print so the ring doesn't move under us.
+ */
+void i2c_trace_show(int fd) {
+    struct i2c_trace *tp;
+    uint32 head, n, i;
+
+    i2c_trace_on = 0;
+    head = i2c_trace_head;
+    n = (head < I2C_TRACE_SIZE) ? head : I2C_TRACE_SIZE;
+
+    serial_printf(fd, "i2c trace: %u of %u events, %u Hz\n", n, head, F_CPU);
+    for (i = head - n; i != head; i++) {
+        tp = &i2c_trace_ring[i & (I2C_TRACE_SIZE - 1)];
+        serial_printf(fd, "%h %d %-6s %04x %04x %04x\n", tp->stamp, tp->bus,
+                      i2c_trace_names[tp->event < I2C_TR_NAMES ? tp->event : 0],
+                      tp->sr1, tp->sr2, tp->arg);
+    }
+    serial_printf(fd, "i2c trace: end\n");
+    i2c_trace_on = 1;
+}
+
+/* Stop (0) or start recording, to keep what led up to some problem */
+void i2c_trace_enable(int on) {
+    i2c_trace_on = on;
+}
+#else
+void i2c_trace_show(int fd) {
+    serial_printf(fd, "i2c trace: not built in\n");
+}
+
+void i2c_trace_enable(int on) {
+    UNUSED(on);
+}
+#endif
+
+/*
+ * DMA for master transfers, see i2c_master_dma_enable().
+ *
+ * The start bit interrupt sets up a channel for the message, the
+ * address interrupt lets it go (DMAEN, and LAST for a read so the
+ * final byte gets a NACK), and then we hear nothing until the end:
+ * BTF for a write, the DMA transfer complete interrupt for a read.
+ */
+
+/* Reads shorter than this go through the byte interrupts */
+#define I2C_DMA_MIN_READ        3
+
+/*
+ * Get a DMA channel ready for msg, if it is worth it and we hold the
+ * channel for that direction (see i2c_master_dma_enable()).
+ * Returns the channel, or 0 to do this one a byte at a time.
+ */
+static uint8 i2c_dma_setup(i2c_dev *dev, i2c_msg *msg) {
+    dma_tube_config cfg;
+    uint8 ch;
+
+    if (dev->dma == NULL || msg->length == 0) {
+        return 0;
+    }
+
+    if (msg->flags & I2C_MSG_READ) {
+        if (msg->length < I2C_DMA_MIN_READ) {
+            return 0;
+        }
+        ch = dev->dma_rx_ch;
+        cfg.tube_src = &dev->regs->DR;
+        cfg.tube_dst = &msg->data[msg->xferred];
+        cfg.tube_flags = DMA_CFG_DST_INC | DMA_CFG_CMPLT_IE | DMA_CFG_ERR_IE;
+        cfg.tube_req_src = dev->dma_rx_src;
+    } else {
+        ch = dev->dma_tx_ch;
+        cfg.tube_src = &msg->data[msg->xferred];
+        cfg.tube_dst = &dev->regs->DR;
+        cfg.tube_flags = DMA_CFG_SRC_INC;
+        cfg.tube_req_src = dev->dma_tx_src;
+    }
+    cfg.tube_src_size = DMA_SIZE_8BITS;
+    cfg.tube_dst_size = DMA_SIZE_8BITS;
+    cfg.tube_nr_xfers = msg->length;
+    cfg.target_data = 0;
+
+    if (ch == 0) {
+        return 0;               // Somebody else has this direction's channel
+    }
+    if (dma_tube_cfg(dev->dma, ch, &cfg) < 0) {
+        return 0;
+    }
+    if (msg->flags & I2C_MSG_READ) {
+        dma_attach_interrupt(dev->dma, ch, dev->dma_rx_irq);
+    }
+    return ch;
+}
+
+/* Once the address is ACKed, turn the channel loose */
+static void i2c_dma_start(i2c_dev *dev, i2c_msg *msg) {
+    uint32 cr2 = I2C_CR2_DMAEN;
+
+    if (msg->flags & I2C_MSG_READ) {
+        cr2 |= I2C_CR2_LAST;    // NACK the last byte
+    }
+    dev->regs->CR2 |= cr2;
+    dma_enable(dev->dma, dev->dma_ch);
+}
+
+/* Stop the channel (if any) and account for what it moved */
+static void i2c_dma_finish(i2c_dev *dev, i2c_msg *msg) {
+    uint8 ch = dev->dma_ch;
+    uint32 n;
+
+    if (ch == 0) {
+        return;
+    }
+
+    dma_disable(dev->dma, ch);
+    dev->regs->CR2 &= ~(I2C_CR2_DMAEN | I2C_CR2_LAST);
+    if (msg != NULL) {
+        n = msg->length - dma_tube_regs(dev->dma, ch)->CNDTR;
+        msg->xferred += n;
+        msg->length -= n;
+    }
+    dev->dma_ch = 0;
+}
+
+/*
+ * The end of a master transfer, however it went: shut off the
+ * interrupts and the DMA, settle the state, and tell whoever
+ * started it.  Called from the event, error and DMA interrupts, and
+ * from the SysTick timeout check.
+ */
+static void i2c_master_done(i2c_dev *dev, int32 rc) {
+    i2c_xfer_done_func done;
+
+    if (dev->state != I2C_STATE_BUSY) {
+        return;                 // Somebody beat us to it
+    }
+
+    i2c_disable_irq(dev, I2C_IRQ_BUFFER | I2C_IRQ_EVENT | I2C_IRQ_ERROR);
+    i2c_dma_finish(dev, dev->msg);
+
+    if ( i2c_debug )
+	TLOG ( "i2c xfer done: %d, sr1 = %h, sr2 = %h\n", rc, dev->error_sr1, dev->error_sr2 );
+
+    // Make use of the smb I2C_SR1_TIMEOUT flag to say why:
+    if (rc == I2C_ERROR_TIMEOUT) {
+        dev->error_flags |= I2C_SR1_TIMEOUT;
+    }
+
+    done = dev->xfer_done;
+    dev->xfer_done = NULL;
+    dev->xfer_rc = rc;
+    dev->state = (rc != 0) ? I2C_STATE_ERROR : I2C_STATE_IDLE;
+    I2C_TRACE(dev, I2C_TR_DONE, dev->error_flags, 0, rc);
+
+    if (done) {
+        done(dev, rc, dev->xfer_arg);
+    }
+}
+
+/*
+ * Bus idle timeouts for transfers in progress, checked every
+ * millisecond from SysTick rather than by the caller polling.
+ * Whatever SysTick callback was attached before us still gets called.
+ */
+static void (*i2c_prev_tick)(void);
+static uint8 i2c_tick_attached = 0;
+
+static void i2c_timeout_check(i2c_dev *dev) {
+    uint8 expired = 0;
+    uint8 ch;
+
+    if (dev->state != I2C_STATE_BUSY || dev->xfer_timeout == 0 ||
+        (dev->config_flags & I2C_SLAVE_MODE)) {
+        return;
+    }
+
+    // While a DMA channel moves the bytes there are no interrupts
+    // to reset the timestamp, so the count going down is what says
+    // the bus is still alive:
+    ch = dev->dma_ch;
+    if (ch != 0) {
+        uint16 left = dma_tube_regs(dev->dma, ch)->CNDTR;
+        if (left != dev->dma_left) {
+            dev->dma_left = left;
+            dev->timestamp = systick_uptime();
+        }
+    }
+
+    // Keep the I2C interrupts out while we decide:
+    nvic_irq_disable(dev->ev_nvic_line);
+    nvic_irq_disable(dev->er_nvic_line);
+
+    if (dev->state == I2C_STATE_BUSY &&
+        (uint32)(systick_uptime() - dev->timestamp) > dev->xfer_timeout) {
+        i2c_disable_irq(dev, I2C_IRQ_BUFFER | I2C_IRQ_EVENT | I2C_IRQ_ERROR);
+        expired = 1;
+    }
+
+    nvic_irq_enable(dev->er_nvic_line);
+    nvic_irq_enable(dev->ev_nvic_line);
+
+    if (expired) {
+        i2c_master_done(dev, I2C_ERROR_TIMEOUT);
+    }
+}
+
+static void i2c_timeout_tick(void) {
+    i2c_timeout_check(I2C1);
+    i2c_timeout_check(I2C2);
+
+    if (i2c_prev_tick) {
+        i2c_prev_tick();
+    }
+}
+
+/*
+ * Done with the current message, start the next or finish up.
+ */
+static void i2c_master_next_msg(i2c_dev *dev) {
+    i2c_msg *curMsg;
+
+    if (--dev->msgs_left != 0) {    // Check to see if there's another back-to-back message
+        i2c_disable_irq(dev, I2C_IRQ_BUFFER);   // Disable I2C_SR1_RXNE/I2C_SR1_TXE interrupt
+        ++dev->msg;
+        curMsg = dev->msg;
+        if (curMsg->flags & I2C_MSG_READ) {     // Send restart, disable POS, and enable ACK as necessary
+            dev->regs->CR1 = I2C_CR1_PE | I2C_CR1_START | I2C_CR1_ACK;
+        } else {
+            dev->regs->CR1 = I2C_CR1_PE | I2C_CR1_START;
+        }
+    } else {
+        dev->msg = NULL;
+        i2c_master_done(dev, 0);
+    }
+}
+
 /**
- * @brief Process an i2c transaction.
+ * @brief Start an i2c transaction and return without waiting for it.
  *
  * Transactions are composed of one or more i2c_msg's, and may be read
  * or write tranfers.  Multiple i2c_msg's will generate a repeated
  * start in between messages.
  *
+ * When the transaction is over, done is called from interrupt level
+ * (the I2C event or error interrupt, the DMA interrupt, or SysTick
+ * for a timeout) with the same code i2c_master_xfer() would return.
+ * The device is IDLE again (or ERROR) by then, so the callback may
+ * start the next transaction.  The messages and their buffers must
+ * stay put until then.
+ *
+ * The SysTick callback is borrowed for the timeouts, so attach any
+ * of your own before the first transfer; it gets called as before.
+ *
+ * This never waits: it may be called from the done callback, so from
+ * an interrupt, when the STOP of the last transaction may not be
+ * out yet.  If the device or the bus is still busy it says so and
+ * leaves the waiting to the caller.
+ *
  * @param dev I2C device
  * @param msgs Messages to send/receive
  * @param num Number of messages to send/receive
  * @param timeout Bus idle timeout in milliseconds before aborting the
  *                transfer.  0 denotes no timeout.
- * @return 0 on success,
- *         I2C_ERROR_PROTOCOL if there was a protocol error,
- *         I2C_ERROR_TIMEOUT if the transfer timed out.
+ * @param done Completion callback, may be NULL
+ * @param arg Passed to done
+ * @return 0 if the transaction was started (or there was nothing to
+ *         do, in which case done has already been called),
+ *         I2C_ERROR_BUSY if a transfer is still going or the bus is
+ *         busy, and done will not be called.
  */
-int32 i2c_master_xfer(i2c_dev *dev,
-                      i2c_msg *msgs,
-                      uint16 num,
-                      uint32 timeout) {
-    int32 rc;
+int32 i2c_master_xfer_async(i2c_dev *dev,
+                            i2c_msg *msgs,
+                            uint16 num,
+                            uint32 timeout,
+                            i2c_xfer_done_func done,
+                            void *arg) {
 
 #ifdef notdef
     /* For debug */
@@ -393,7 +784,9 @@ int32 i2c_master_xfer(i2c_dev *dev,
     volatile uint32_t sr2;                  // reserved for reading the SR2 register,
 #endif
 
-    ASSERT(dev->state == I2C_STATE_IDLE);
+    if (dev->state != I2C_STATE_IDLE) {
+        return I2C_ERROR_BUSY;
+    }
 
 #ifdef notdef
     ocr1 = dev->regs->CR1;     // initial control register
@@ -421,31 +814,44 @@ int32 i2c_master_xfer(i2c_dev *dev,
 #endif
 
     /* check for silly call with no messages */
-    if ( num < 1 )
+    if ( num < 1 ) {
+	dev->xfer_rc = 0;
+	if ( done )
+	    done ( dev, 0, arg );
 	return 0;
+    }
 
     if ( i2c_debug ) {
 	if ( msgs[0].flags & I2C_MSG_READ )
-	    printf ( " - i2c_READ; msg len = %d, flags = %h\n", msgs[0].length, msgs[0].flags );
+	    TLOG ( " - i2c_READ; addr = %x, msg len = %d, flags = %h\n", msgs[0].addr, msgs[0].length, msgs[0].flags );
 	else
-	    printf ( " - i2c_WRITE; msg len = %d, flags = %h\n", msgs[0].length, msgs[0].flags );
+	    TLOG ( " - i2c_WRITE; addr = %x, msg len = %d, flags = %h\n", msgs[0].addr, msgs[0].length, msgs[0].flags );
     }
 
-    // Wait for I2C to not be busy:
-    uint32_t count = I2C_TIMEOUT_BUSY_FLAG * (F_CPU / 25U /1000U);
-    do {
-        if (count-- == 0U) {
-            return I2C_ERROR_TIMEOUT;
-        }
-    } while (dev->regs->SR2 & I2C_SR2_BUSY);
+    if (dev->regs->SR2 & I2C_SR2_BUSY) {
+        return I2C_ERROR_BUSY;
+    }
 
     dev->error_flags = 0;
+    dev->dma_ch = 0;
     dev->msg = msgs;
     dev->msgs_left = num;
     do {
         dev->msg[num-1].xferred = 0;
     } while (--num);
+    dev->xfer_done = done;
+    dev->xfer_arg = arg;
+    dev->xfer_timeout = timeout;
+    dev->dma_left = 0;
     dev->timestamp = systick_uptime();
+
+    if (!i2c_tick_attached) {
+        i2c_prev_tick = systick_attach_callback(i2c_timeout_tick);
+        i2c_tick_attached = 1;
+    }
+
+    I2C_TRACE(dev, I2C_TR_XFER, 0, 0,
+              (msgs[0].addr << 1) | (msgs[0].flags & I2C_MSG_READ));
     dev->state = I2C_STATE_BUSY;
 
     /* Enable -- this starts the show */
@@ -453,8 +859,8 @@ int32 i2c_master_xfer(i2c_dev *dev,
     dev->regs->SR1 = 0;             // Reset error/status flags
 
     i2c_enable_irq(dev, I2C_IRQ_EVENT | I2C_IRQ_ERROR);
-    // if ( i2c_debug )
-	// printf ( "i2c - HW enabled and IRQ enabled\n" );
+    if ( i2c_debug )
+	TLOG ( "i2c - HW enabled and IRQ enabled\n" );
 
     /* Start -- this really starts the show */
     if (dev->msg[0].flags & I2C_MSG_READ) {
@@ -466,29 +872,50 @@ int32 i2c_master_xfer(i2c_dev *dev,
         dev->regs->CR1 = I2C_CR1_PE | I2C_CR1_START;
     }
 
-    /* This next printf gets chopped up by a burst of IRQ printouts */
-    // if ( i2c_debug )
-    //     printf ( "i2c xfer, begin wait\n" );
-    rc = wait_for_state_change(dev, I2C_STATE_XFER_DONE, timeout);
-    if ( i2c_debug )
-	printf ( "i2c xfer, wait done: %d\n", rc );
+    return 0;
+}
 
-    i2c_disable_irq(dev, I2C_IRQ_BUFFER | I2C_IRQ_EVENT | I2C_IRQ_ERROR);
+/**
+ * @brief Process an i2c transaction, and wait for it.
+ *
+ * As i2c_master_xfer_async(), but doesn't come back until it is over.
+ * Thread context only: it waits (a while) for the bus to be free
+ * first, which the async version won't.
+ *
+ * @param dev I2C device
+ * @param msgs Messages to send/receive
+ * @param num Number of messages to send/receive
+ * @param timeout Bus idle timeout in milliseconds before aborting the
+ *                transfer.  0 denotes no timeout.
+ * @return 0 on success,
+ *         I2C_ERROR_PROTOCOL if there was a protocol error,
+ *         I2C_ERROR_TIMEOUT if the transfer (or the wait for the bus)
+ *         timed out,
+ *         I2C_ERROR_BUSY if another transfer is still going.
+ */
+int32 i2c_master_xfer(i2c_dev *dev,
+                      i2c_msg *msgs,
+                      uint16 num,
+                      uint32 timeout) {
+    uint32 count = I2C_TIMEOUT_BUSY_FLAG * (F_CPU / 25U / 1000U);
+    int32 rc;
 
+    // Wait for I2C to not be busy:
+    while (dev->regs->SR2 & I2C_SR2_BUSY) {
+        if (count-- == 0U) {
+            return I2C_ERROR_TIMEOUT;
+        }
+    }
+    rc = i2c_master_xfer_async(dev, msgs, num, timeout, NULL, NULL);
     if (rc != 0) {
-	printf ( "Error i2c sr1 = %h\n", dev->error_sr1 );
-	printf ( "Error i2c sr2 = %h\n", dev->error_sr2 );
-        // If we had an error, make sure the device state reflects that
-        // and make use of the smb I2C_SR1_TIMEOUT flag.  These have to be
-        // done here after disabling the IRQ above to avoid a race-condition
-        // with state changes in the IRQ handlers:
-        dev->state = I2C_STATE_ERROR;
-        if (rc == I2C_ERROR_TIMEOUT) dev->error_flags |= I2C_SR1_TIMEOUT;
-    } else {
-        dev->state = I2C_STATE_IDLE;
+        return rc;
     }
 
-    return rc;
+    // The interrupts (and SysTick, for a timeout) do all the work
+    while (dev->state == I2C_STATE_BUSY)
+        ;
+
+    return dev->xfer_rc;
 }
 
 /**
@@ -544,9 +971,6 @@ int32 wait_for_state_change(i2c_dev *dev,
  */
 void _i2c_irq_handler(i2c_dev *dev) {
 
-    // if ( i2c_debug )
-	// printf ( "i2c_irq_handler\n" );
-
     // See Note in ST Specs:
     //  Reading I2C_SR2 after reading I2C_SR1 clears the ADDR flag, even if the ADDR flag was
     //  set after reading I2C_SR1. Consequently, I2C_SR2 must be read only when ADDR is found
@@ -558,6 +982,10 @@ void _i2c_irq_handler(i2c_dev *dev) {
 					    // but save it for latter since reading it clears ADDR
 
     dev->timestamp = systick_uptime();      // Reset timeout counter
+    I2C_TRACE(dev, I2C_TR_IRQ, sr1, 0, cr1);
+
+    if ( i2c_debug )
+	TLOG ( "i2c_irq_handler, cr1 = %h, sr1 = %h\n", cr1, sr1 );
 
     if (!(dev->config_flags & I2C_SLAVE_MODE)) {    // Handle Master Mode Here:
         int8_t bDone = 0;                       // Set to true when we're done with this transfer unit
@@ -567,14 +995,19 @@ void _i2c_irq_handler(i2c_dev *dev) {
             if (curMsg->flags & I2C_MSG_READ) {         // read transaction:
                 if (sr1 & I2C_SR1_SB) {	    // start bit
                     // TODO : Add support for 10-bit address
-		    // if ( i2c_debug )
-			// printf ( "IRQ - (1) Send slave address: %h\n", curMsg->addr );
+		    if ( i2c_debug )
+			TLOG ( "IRQ - (1) Send slave address: %h\n", curMsg->addr );
+                    dev->dma_ch = i2c_dma_setup(dev, curMsg);
                     i2c_send_slave_addr(dev, curMsg->addr, 1);
                 } else {
                     if (sr1 & I2C_SR1_ADDR) { // address sent
-			// if ( i2c_debug )
-			    // printf ( "IRQ - (2) addr was sent, todo: %d\n", todo );
-                        if (todo <= 1) {
+			if ( i2c_debug )
+			    TLOG ( "IRQ - (2) addr was sent, todo: %d\n", todo );
+                        if (dev->dma_ch) {
+                            dev->regs->CR1 = (cr1 |= I2C_CR1_ACK);  // Enable ACK, LAST NACKs the final byte
+                            i2c_dma_start(dev, curMsg);             // DMA reads DR from here on
+                            sr2 = dev->regs->SR2;                   // Clear ADDR bit
+                        } else if (todo <= 1) {
                             dev->regs->CR1 = (cr1 &= ~I2C_CR1_ACK); // Disable ACK
                             sr2 = dev->regs->SR2;                   // Clear ADDR bit
                             dev->regs->CR1 = (cr1 |= I2C_CR1_STOP); // Stop after last byte
@@ -586,15 +1019,16 @@ void _i2c_irq_handler(i2c_dev *dev) {
                             dev->regs->CR1 = (cr1 |= I2C_CR1_ACK);  // Enable ACK
                             sr2 = dev->regs->SR2;                   // Clear ADDR bit
                         }
-                        if (todo >= 1) {
+                        if (dev->dma_ch) {
+                            // Nothing more here, _i2c_dma_rx_irq_handler() finishes up
+                        } else if (todo >= 1) {
                             i2c_enable_irq(dev, I2C_IRQ_BUFFER);        // Enable I2C_SR1_RXNE interrupt
                         } else {
                             bDone = 1;
                         }
-                    } else {
-			// XXX
-			// if ( i2c_debug )
-			    // printf ( "IRQ - (3) ..... todo: %d\n", todo );
+                    } else if (!dev->dma_ch) {
+			if ( i2c_debug )
+			    TLOG ( "IRQ - (3) ..... todo: %d\n", todo );
                         int8_t bFlgRXNE = ((sr1 & I2C_SR1_RXNE) != 0);
                         int8_t bFlgBTF = ((sr1 & I2C_SR1_BTF) != 0);
 
@@ -630,7 +1064,8 @@ void _i2c_irq_handler(i2c_dev *dev) {
                 }
             } else { // write transaction
                 if (sr1 & I2C_SR1_SB) { // start bit
-                    if (todo != 0) {
+                    dev->dma_ch = i2c_dma_setup(dev, curMsg);
+                    if (todo != 0 && !dev->dma_ch) {
                         i2c_enable_irq(dev, I2C_IRQ_BUFFER);        // Enable I2C_SR1_TXE interrupt
                     }
                     // TODO : Add support for 10-bit address
@@ -640,11 +1075,22 @@ void _i2c_irq_handler(i2c_dev *dev) {
                     int8_t bFlgBTF = 0;
 
                     if (sr1 & I2C_SR1_ADDR) {
+                        if (dev->dma_ch) {
+                            i2c_dma_start(dev, curMsg);         // DMA feeds DR from here on
+                        }
                         sr2 = dev->regs->SR2;                   // Clear ADDR bit
+                    } else if (dev->dma_ch && (sr1 & I2C_SR1_BTF) &&
+                               dma_tube_regs(dev->dma, dev->dma_ch)->CNDTR == 0) {
+                        i2c_dma_finish(dev, curMsg);            // Last byte is out
+                        todo = 0;
                     }
 
-                    bFlgTXE = ((sr1 & I2C_SR1_TXE) != 0);
-                    bFlgBTF = (((sr1 & I2C_SR1_BTF) != 0) || (todo == 0));
+                    if (dev->dma_ch) {
+                        // DMA still at it
+                    } else {
+                        bFlgTXE = ((sr1 & I2C_SR1_TXE) != 0);
+                        bFlgBTF = (((sr1 & I2C_SR1_BTF) != 0) || (todo == 0));
+                    }
 
                     if (bFlgTXE || bFlgBTF) {
                         if (todo > 0) {
@@ -668,19 +1114,7 @@ void _i2c_irq_handler(i2c_dev *dev) {
             }
 
             if (bDone) {
-                if (--dev->msgs_left != 0) {    // Check to see if there's another back-to-back message
-                    i2c_disable_irq(dev, I2C_IRQ_BUFFER);   // Disable I2C_SR1_RXNE/I2C_SR1_TXE interrupt
-                    ++dev->msg;
-                    curMsg = dev->msg;
-                    if (curMsg->flags & I2C_MSG_READ) {     // Send restart, disable POS, and enable ACK as necessary
-                        dev->regs->CR1 = I2C_CR1_PE | I2C_CR1_START | I2C_CR1_ACK;
-                    } else {
-                        dev->regs->CR1 = I2C_CR1_PE | I2C_CR1_START;
-                    }
-                } else {
-                    dev->msg = NULL;
-                    dev->state = I2C_STATE_XFER_DONE;
-                }
+                i2c_master_next_msg(dev);
             }
         }   // curMsg != NULL
 
@@ -833,6 +1267,10 @@ void _i2c_irq_handler(i2c_dev *dev) {
         }
 
     }   // End of Slave Mode
+
+    I2C_TRACE(dev, I2C_TR_IRQ_EXIT, sr1, sr2,
+              ((dev->config_flags & I2C_SLAVE_MODE) || dev->msg == NULL) ?
+              I2C_TR_NO_MSG : dev->msg->xferred);
 }
 
 
@@ -844,8 +1282,10 @@ void _i2c_irq_error_handler(i2c_dev *dev) {
     __IO uint32_t sr1 = dev->regs->SR1;
     __IO uint32_t sr2 = dev->regs->SR2;
 
+    I2C_TRACE(dev, I2C_TR_ERROR, sr1, sr2, dev->regs->CR1);
+
     if ( i2c_debug )
-	printf ( "i2c_irq_error_handler\n" );
+	TLOG ( "i2c_irq_error_handler, sr1 = %h, sr2 = %h\n", sr1, sr2 );
 
     dev->timestamp = systick_uptime();      // Reset timeout counter
 
@@ -879,6 +1319,8 @@ void _i2c_irq_error_handler(i2c_dev *dev) {
             return;
         }
     } else {
+        i2c_dma_finish(dev, dev->msg);
+
         // Master should send a STOP on NACK:
         if (sr1 & I2C_SR1_AF) {
             dev->regs->CR1 |= I2C_CR1_STOP;
@@ -894,12 +1336,50 @@ void _i2c_irq_error_handler(i2c_dev *dev) {
     /* Clear flags */
     dev->regs->SR1 = 0;
     dev->regs->SR2 = 0;
-    dev->state = I2C_STATE_ERROR;
+    if (dev->config_flags & I2C_SLAVE_MODE) {
+        dev->state = I2C_STATE_ERROR;
+    } else {
+        i2c_master_done(dev, I2C_ERROR_PROTOCOL);
+    }
 
     UNUSED(sr2);
 }
 
 
+/*
+ * DMA transfer complete (or error) for a master read.  With LAST set
+ * the final byte has already been NACKed, so the bus is ours to stop
+ * or restart.
+ */
+void _i2c_dma_rx_irq_handler(i2c_dev *dev) {
+    dma_irq_cause cause = dma_get_irq_cause(dev->dma, dev->dma_rx_ch);
+    i2c_msg *curMsg = dev->msg;
+
+    if (dev->dma_ch != dev->dma_rx_ch || curMsg == NULL) {
+        return;                 // Already aborted by the error handler
+    }
+
+    I2C_TRACE(dev, I2C_TR_DMA_RX, dev->regs->SR1, 0, cause);
+
+    if ( i2c_debug )
+	TLOG ( "i2c_dma_rx_irq_handler, cause = %d\n", cause );
+
+    dev->timestamp = systick_uptime();      // Reset timeout counter
+
+    if (cause != DMA_TRANSFER_COMPLETE) {
+        i2c_dma_finish(dev, curMsg);
+        dev->regs->CR1 |= I2C_CR1_STOP;
+        i2c_master_done(dev, I2C_ERROR_PROTOCOL);
+        return;
+    }
+
+    if (dev->msgs_left == 1) {
+        dev->regs->CR1 |= I2C_CR1_STOP;
+    }
+    i2c_dma_finish(dev, curMsg);
+    i2c_master_next_msg(dev);
+}
+
 /*
  * CCR/TRISE configuration helper
  */
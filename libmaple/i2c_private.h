@@ -61,6 +61,7 @@
 
 void _i2c_irq_handler(i2c_dev *dev);
 void _i2c_irq_error_handler(i2c_dev *dev);
+void _i2c_dma_rx_irq_handler(i2c_dev *dev);
 
 struct gpio_dev;
 
@@ -25,9 +25,13 @@
  *  low level code derived from i2c_master.c
  *
  * There are 3 functions in the API:
- *    void iic_init ( sda_pin, sclk_pin );
- *    int iic_send ( addr, unsigned char *, int );
- *    int iic_recv ( addr, unsigned char *, int );
+ *    void iic_init ( bp, sda_pin, sclk_pin );
+ *    int iic_send ( bp, addr, unsigned char *, int );
+ *    int iic_recv ( bp, addr, unsigned char *, int );
+ *
+ * Everything we know about a bus lives in the struct iic (see iic.h)
+ *  that the caller hands us, so there can be as many buses as there
+ *  are pins to put them on.  Nothing about a bus is kept in here.
  */
 // #include <kyu.h>
 
@@ -38,19 +42,47 @@
 #include "time.h"
 #include "gpio.h"
 #include "io.h"
+#ifndef ARCH_ESP8266
+#include "dwt.h"
+#endif
+#include "i2c.h"
+#include "iic.h"
 
-#define GPIO_READ(x)	digitalRead ( x )
+#ifdef ARCH_MAPLE
 #define GPIO_INPUT(x)	pinMode ( x, INPUT_FLOATING )
 #define GPIO_OUTPUT(x)	pinMode ( x, OUTPUT_OPEN_DRAIN )
 
-#define GPIO_SET(x)	digitalWrite ( x, 1 )
-#define GPIO_CLEAR(x)	digitalWrite ( x, 0 )
-
 /* On the Maple/STM32, we have a handy upper layer on the more fundamental
  * lower gpio layer.  The lower layer requires a gpio device and pin.
  * The upper layer requires a single index that indexes pinmap transparently
- * hiding the details of device/pin.  So we use the upper layer.
+ * hiding the details of device/pin.  We use the upper layer to set up
+ *  the pins, but not to wiggle them.
+ * digitalWrite does a bounds check and a PIN_MAP lookup every time,
+ *  and takes something like 500 ns (see notes/vga.txt) where a store
+ *  to BSRR takes 60.  With several of those per bit, the library was
+ *  setting the clock rate more than our delays were.
+ * So iic_gpio_init looks up the port registers and bit masks once
+ *  (and keeps them in the struct iic), and from then on a change
+ *  to SDA or SCL is a single store.
+ */
+#define SDA_READ(bp)	((bp)->sda_port->IDR & (bp)->sda_bit)
+#define SDA_SET(bp)	((bp)->sda_port->BSRR = (bp)->sda_bit)
+#define SDA_CLEAR(bp)	((bp)->sda_port->BRR = (bp)->sda_bit)
+#define SCL_READ(bp)	((bp)->scl_port->IDR & (bp)->scl_bit)
+#define SCL_SET(bp)	((bp)->scl_port->BSRR = (bp)->scl_bit)
+#define SCL_CLEAR(bp)	((bp)->scl_port->BRR = (bp)->scl_bit)
+
+/* Both pins stay in open drain output mode all the time.
+ * Writing a 1 to ODR just lets go of the line, and IDR shows what
+ *  is really on the bus (us, a slave, or the pullup), so we can read
+ *  data, sample an ACK, or see a slave stretching the clock without
+ *  ever changing the pin mode.
+ * Changing modes was a read-modify-write of CRL/CRH twice a byte,
+ *  and left a little window where the pin was doing who knows what.
  */
+#define SDA_LISTEN(bp)
+#define SDA_DRIVE(bp)
+#endif
 
 #ifdef ARCH_ESP8266
 #include "ets_sys.h"
@@ -67,28 +99,38 @@
 #define GPIO_OUTPUT(x)	gpio_dir_out ( x )
 #define GPIO_SET(x)	gpio_set_bit ( x )
 #define GPIO_CLEAR(x)	gpio_clear_bit ( x )
+
+#define SDA_READ(bp)	GPIO_READ ( (bp)->sda_pin )
+#define SDA_SET(bp)	GPIO_SET ( (bp)->sda_pin )
+#define SDA_CLEAR(bp)	GPIO_CLEAR ( (bp)->sda_pin )
+#define SCL_SET(bp)	GPIO_SET ( (bp)->scl_pin )
+#define SCL_CLEAR(bp)	GPIO_CLEAR ( (bp)->scl_pin )
+
+/* These pins are push-pull, so we must switch SDA to input to read.
+ * Nor can we see clock stretching.
+ */
+#define SCL_READ(bp)	1
+#define SDA_LISTEN(bp)	GPIO_INPUT ( (bp)->sda_pin )
+#define SDA_DRIVE(bp)	GPIO_OUTPUT ( (bp)->sda_pin )
 #endif
 #endif
 
-static void iic_setdc ( int, int );
-static void iic_dc ( int, int );
-static void iic_dc_wait ( int, int, int );
-static void iic_writeb ( int );
-static int iic_readb ( void );
-static void iic_setAck ( int );
-static int iic_getAck ( void );
-
-static void iic_start ( void );
-static void iic_stop ( void );
-static int iic_recv_byte ( int );
-static int iic_send_byte ( int );
-
-/* The following functions are all that a person
- * should ever need to use.
+static void iic_setdc ( struct iic *, int, int );
+static void iic_dc ( struct iic *, int, int );
+static void iic_pause ( struct iic * );
+static void iic_writeb ( struct iic *, int );
+static int iic_readb ( struct iic * );
+static void iic_setAck ( struct iic *, int );
+static int iic_getAck ( struct iic * );
+
+static void iic_start ( struct iic * );
+static void iic_stop ( struct iic * );
+static int iic_recv_byte ( struct iic *, int );
+static int iic_send_byte ( struct iic *, int );
+
+/* The functions that a person should ever need to use
+ * are declared in iic.h
  */
-void iic_init ( int, int );
-int iic_send ( int, unsigned char *, int );
-int iic_recv ( int, unsigned char *, int );
 
 #ifndef ARCH_ESP8266
 #define ICACHE_FLASH_ATTR
@@ -159,51 +201,80 @@ gpio_iic_setup ( int gpio )
  */
 /* -------------------------------------------------- */
 
-static uint8 sda_pin;
-static uint8 scl_pin;	/* never used */
+#define MAX_BITS	28
 
-static uint8 cur_sda;
-static uint8 cur_scl;
+/* Bus timing.
+ * Each line change is followed by a wait, which is the high time
+ *  if SCL was just raised, otherwise half the low time (SCL stays low
+ *  across two changes, one to put out the data bit, one after the
+ *  high time).  The times are comfortably over the minimums in the
+ *  I2C spec (tHIGH and tLOW) for each mode.
+ * The waits are counted in CPU cycles with the DWT cycle counter,
+ *  from the moment of the last line change (bp->due is when the next
+ *  change may happen).  So the time spent in our own code between
+ *  changes is part of the wait rather than added on top of it,
+ *  and the rate holds up even at 1 MHz where a bit is 72 cycles.
+ * The ESP8266 has no DWT, so there we still just wait 5 us after
+ *  every change, which is about 100 kHz whatever speed is asked for.
+ */
+struct iic_timing {
+	int high_ns;
+	int low_ns;
+};
 
-#ifdef ARCH_ESP8266
-static uint8 sda_mask;
-static uint8 scl_mask;
-static uint8 all_mask;
-#endif
+static const struct iic_timing iic_timings[] = {
+	{ 4500, 5500 },		/* I2C_SPEED_STANDARD, 100 kHz */
+	{ 1000, 1500 },		/* I2C_SPEED_FAST, 400 kHz */
+	{ 400, 600 },		/* I2C_SPEED_FAST_PLUS, 1 MHz */
+};
 
-#define MAX_BITS	28
+#define NUM_SPEEDS	(sizeof(iic_timings) / sizeof(iic_timings[0]))
+
+#define NS_TO_CYCLES(ns)	((ns) * CYCLES_PER_MICROSECOND / 1000)
+
+/* For iic_scl_hz, how many SCL rises to time */
+#define SCL_RISES	8
+
+#ifndef ARCH_ESP8266
+static inline void
+iic_wait ( struct iic *bp )
+{
+    while ( (int32) (dwt_cycles () - bp->due) < 0 )
+	;
+}
+#endif
 
 static void ICACHE_FLASH_ATTR
-iic_bus_init ( void )
+iic_bus_init ( struct iic *bp )
 {
     int i;
 
-    iic_dc ( 1, 0 );
+    iic_dc ( bp, 1, 0 );
 
-    iic_dc ( 0, 0 );
-    iic_dc ( 1, 0 );
+    iic_dc ( bp, 0, 0 );
+    iic_dc ( bp, 1, 0 );
 
     for (i = 0; i < MAX_BITS; i++) {
-	iic_dc ( 1, 0 );
-	iic_dc ( 1, 1 );
+	iic_dc ( bp, 1, 0 );
+	iic_dc ( bp, 1, 1 );
     }
 
-    iic_stop();
+    iic_stop ( bp );
 }
 
 /* This does whatever needs to be done to get the gpio
  * system into a state that lets us do what we need to do.
  */
 static void ICACHE_FLASH_ATTR
-iic_gpio_init ( int sda, int scl )
+iic_gpio_init ( struct iic *bp, int sda, int scl )
 {
-    sda_pin = sda;
-    scl_pin = scl;
+    bp->sda_pin = sda;
+    bp->scl_pin = scl;
 
 #ifdef ARCH_ESP8266
-    sda_mask = 1 << sda;
-    scl_mask = 1 << scl;
-    all_mask = sda_mask | scl_mask;
+    bp->sda_mask = 1 << sda;
+    bp->scl_mask = 1 << scl;
+    bp->all_mask = bp->sda_mask | bp->scl_mask;
 
     ETS_GPIO_INTR_DISABLE() ;
     gpio_iic_setup ( sda );
@@ -225,19 +296,110 @@ iic_gpio_init ( int sda, int scl )
 #endif
 
 #ifdef ARCH_MAPLE
+    bp->sda_port = PIN_MAP[sda].gpio_device->regs;
+    bp->sda_bit = 1 << PIN_MAP[sda].gpio_bit;
+    bp->scl_port = PIN_MAP[scl].gpio_device->regs;
+    bp->scl_bit = 1 << PIN_MAP[scl].gpio_bit;
+
+    /* ODR first, so the lines do not dip low on the way */
+    SDA_SET ( bp );
+    SCL_SET ( bp );
     GPIO_OUTPUT ( sda );
     GPIO_OUTPUT ( scl );
 #endif
 
-    iic_setdc ( 1, 1 );
+    iic_setdc ( bp, 1, 1 );
+}
+
+/* Pick I2C_SPEED_STANDARD (the default), I2C_SPEED_FAST,
+ *  or I2C_SPEED_FAST_PLUS.  Fast plus needs strong pullups
+ *  (1k or so) and devices that can do it.
+ * Returns 0 if OK, 1 if there is no such speed.
+ */
+int
+iic_set_speed ( struct iic *bp, int speed )
+{
+    if ( speed < 0 || speed >= (int) NUM_SPEEDS )
+	return 1;
+
+    bp->high = NS_TO_CYCLES ( iic_timings[speed].high_ns );
+    bp->low2 = NS_TO_CYCLES ( iic_timings[speed].low_ns ) / 2;
+    return 0;
+}
+
+/* How long a slave may hold SCL low before we give up on it.
+ * The default is what SMBus allows, 25 ms, which is a long time
+ *  for anything that is working.
+ */
+#define IIC_TIMEOUT_US	25000
+
+/* The longest the cycle counter can time, about 59 seconds */
+#define IIC_TIMEOUT_MAX	(0xffffffffU / CYCLES_PER_MICROSECOND)
+
+void
+iic_set_timeout ( struct iic *bp, int usecs )
+{
+    if ( usecs < 0 )
+	usecs = 0;
+    if ( (uint32) usecs > IIC_TIMEOUT_MAX )
+	usecs = IIC_TIMEOUT_MAX;
+    bp->stretch_max = (uint32) usecs * CYCLES_PER_MICROSECOND;
 }
 
 /* Arguments are gpio numbers, 0-15 */
 void ICACHE_FLASH_ATTR
-iic_init ( int sda_pin, int scl_pin )
+iic_init ( struct iic *bp, int sda_pin, int scl_pin )
+{
+#ifndef ARCH_ESP8266
+    dwt_init ();
+    bp->due = dwt_cycles ();
+#endif
+    bp->scl_rises = -1;
+    bp->err = 0;
+    iic_set_speed ( bp, I2C_SPEED_STANDARD );
+    iic_set_timeout ( bp, IIC_TIMEOUT_US );
+
+    iic_gpio_init ( bp, sda_pin, scl_pin );
+    iic_bus_init ( bp );
+}
+
+/* Take the pins back after something else has had them
+ *  (the i2c hardware, see i2c_auto_new), and clock out
+ *  anybody left hanging.  Speed and timeout stay as they were.
+ */
+void ICACHE_FLASH_ATTR
+iic_reclaim ( struct iic *bp )
+{
+#ifndef ARCH_ESP8266
+    bp->due = dwt_cycles ();
+#endif
+    bp->err = 0;
+    iic_gpio_init ( bp, bp->sda_pin, bp->scl_pin );
+    iic_bus_init ( bp );
+}
+
+/* See how fast the clock really runs, no scope needed.
+ * We address the device at addr (it need not be there), and
+ *  note the cycle count as SCL is seen to go high for each of the
+ *  8 address bits.  Since we read the pin back, this includes rise
+ *  times and any clock stretching.
+ * Returns the SCL frequency in Hz.
+ */
+int
+iic_scl_hz ( struct iic *bp, int addr )
 {
-    iic_gpio_init ( sda_pin, scl_pin );
-    iic_bus_init ();
+    uint32 cycles;
+    int n;
+
+    bp->scl_rises = 0;
+    (void) iic_send ( bp, addr, (unsigned char *) 0, 0 );
+    n = bp->scl_rises;
+    bp->scl_rises = -1;
+
+    cycles = bp->scl_last - bp->scl_first;
+    if ( n < 2 || cycles == 0 )
+	return 0;
+    return (n - 1) * CYCLES_PER_MICROSECOND * 1000000 / cycles;
 }
 
 /* -------------------------------------------------- */
@@ -245,186 +407,236 @@ iic_init ( int sda_pin, int scl_pin )
 #ifdef ARCH_ESP8266
 /* Could be a macro */
 static int ICACHE_FLASH_ATTR
-iic_get_bit ( void )
+iic_get_bit ( struct iic *bp )
 {
     // return GPIO_INPUT_GET ( SDA_GPIO );
-    return ( gpio_input_get() >> sda_pin) & 1;
+    return ( gpio_input_get() >> bp->sda_pin) & 1;
 }
 
 /* ESP8266 */
 static void ICACHE_FLASH_ATTR
-iic_setdc ( int sda, int scl )
+iic_setdc ( struct iic *bp, int sda, int scl )
 {
     int high_mask;
     int low_mask;
 
-    cur_sda = sda;
-    cur_scl = scl;
+    bp->cur_sda = sda;
+    bp->cur_scl = scl;
 
     if ( sda ) {
-        high_mask = sda_mask;
+        high_mask = bp->sda_mask;
         low_mask = 0;
     } else {
         high_mask = 0;
-        low_mask = sda_mask;
+        low_mask = bp->sda_mask;
     }
 
     if ( scl )
-        high_mask |= scl_mask;
+        high_mask |= bp->scl_mask;
     else
-        low_mask |= scl_mask;
+        low_mask |= bp->scl_mask;
 
-    gpio_output_set( high_mask, low_mask, all_mask, 0);
+    gpio_output_set( high_mask, low_mask, bp->all_mask, 0);
 }
 #endif
 
 #ifdef ARCH_ARM
+/* A slave may hold SCL low after we let go of it,
+ *  until it is ready for the next bit.
+ * Wait (but not forever, see iic_set_timeout) for the line
+ *  to really go high.  If it never does, we note that in bp->err
+ *  and stop waiting for anything until the transaction is over,
+ *  so a dead slave costs us one timeout, not one per bit.
+ */
+static void
+iic_stretch ( struct iic *bp )
+{
+    uint32 start;
+
+    if ( SCL_READ ( bp ) || bp->err )
+	return;
+
+    start = dwt_cycles ();
+    while ( ! SCL_READ ( bp ) ) {
+	if ( dwt_cycles () - start > bp->stretch_max ) {
+	    bp->err = I2C_ERR_TIMEOUT;
+	    return;
+	}
+    }
+}
+
 static int
-iic_raw_bit ( void )
+iic_raw_bit ( struct iic *bp )
 {
-    return GPIO_READ ( sda_pin ) ? 1 : 0;
+    return SDA_READ ( bp ) ? 1 : 0;
 }
 
 static int
-iic_get_bit ( void )
+iic_get_bit ( struct iic *bp )
 {
     int rv;
 
-    GPIO_INPUT ( sda_pin );
-    rv = GPIO_READ ( sda_pin );
-    GPIO_OUTPUT ( sda_pin );
+    SDA_LISTEN ( bp );
+    rv = SDA_READ ( bp );
+    SDA_DRIVE ( bp );
     return rv ? 1 : 0;
 }
 
 static void
-iic_setdc ( int sda, int scl )
+iic_setdc ( struct iic *bp, int sda, int scl )
 {
-    cur_sda = sda;
+    iic_wait ( bp );
+
+    bp->cur_sda = sda;
     if ( sda ) {
-	GPIO_SET ( sda_pin );
+	SDA_SET ( bp );
     } else {
-	GPIO_CLEAR ( sda_pin );
+	SDA_CLEAR ( bp );
     }
 
-    cur_scl = scl;
     if ( scl ) {
-	GPIO_SET ( scl_pin );
+	SCL_SET ( bp );
+	iic_stretch ( bp );
+	if ( ! bp->cur_scl && bp->scl_rises >= 0 && bp->scl_rises < SCL_RISES ) {
+	    bp->scl_last = dwt_cycles ();
+	    if ( bp->scl_rises++ == 0 )
+		bp->scl_first = bp->scl_last;
+	}
     } else {
-	GPIO_CLEAR ( scl_pin );
+	SCL_CLEAR ( bp );
     }
+    bp->cur_scl = scl;
 }
 
 static void
-iic_setclk ( int scl )
+iic_setclk ( struct iic *bp, int scl )
 {
     if ( scl ) {
-	GPIO_SET ( scl_pin );
+	SCL_SET ( bp );
+	iic_stretch ( bp );
     } else {
-	GPIO_CLEAR ( scl_pin );
+	SCL_CLEAR ( bp );
     }
 }
 #endif
 
+#ifdef ARCH_ESP8266
+/* ESP8266 - the old fixed delays */
 static void ICACHE_FLASH_ATTR
-iic_dc ( int data, int clock )
+iic_dc ( struct iic *bp, int data, int clock )
 {
-    iic_setdc ( data, clock );
+    iic_setdc ( bp, data, clock );
     os_delay_us ( 5 );
 }
 
 static void ICACHE_FLASH_ATTR
-iic_dc_wait ( int data, int clock, int wait )
+iic_pause ( struct iic *bp )
 {
-    iic_setdc ( data, clock );
-    os_delay_us ( wait );
+    os_delay_us ( 5 );
+}
+#else
+/* Change the lines, and set when they may next change */
+static void ICACHE_FLASH_ATTR
+iic_dc ( struct iic *bp, int data, int clock )
+{
+    iic_setdc ( bp, data, clock );
+    bp->due = dwt_cycles () + (clock ? bp->high : bp->low2);
 }
 
+/* Leave the lines alone a little longer */
 static void ICACHE_FLASH_ATTR
-iic_start(void)
+iic_pause ( struct iic *bp )
 {
-    iic_dc ( 1, cur_scl );
-    iic_dc ( 1, 1 );
-    iic_dc ( 0, 1 );
+    iic_wait ( bp );
+    bp->due = dwt_cycles () + bp->low2;
 }
+#endif
 
 static void ICACHE_FLASH_ATTR
-iic_stop(void)
+iic_start ( struct iic *bp )
 {
-    os_delay_us (5);
+    iic_dc ( bp, 1, bp->cur_scl );
+    iic_dc ( bp, 1, 1 );
+    iic_dc ( bp, 0, 1 );
+}
+
+static void ICACHE_FLASH_ATTR
+iic_stop ( struct iic *bp )
+{
+    iic_pause ( bp );
 
-    iic_dc ( 0, cur_scl );
-    iic_dc ( 0, 1 );
-    iic_dc ( 1, 1 );
+    iic_dc ( bp, 0, bp->cur_scl );
+    iic_dc ( bp, 0, 1 );
+    iic_dc ( bp, 1, 1 );
 }
 
 static void ICACHE_FLASH_ATTR
-iic_setAck ( int level )
+iic_setAck ( struct iic *bp, int level )
 {
-    iic_dc ( cur_sda, 0 );
-    iic_dc ( level, 0 );
-    iic_dc ( level, 1 );
-    iic_dc ( level, 0 );
-    iic_dc ( 1, 0 );
+    iic_dc ( bp, bp->cur_sda, 0 );
+    iic_dc ( bp, level, 0 );
+    iic_dc ( bp, level, 1 );
+    iic_dc ( bp, level, 0 );
+    iic_dc ( bp, 1, 0 );
 }
 
 static int ICACHE_FLASH_ATTR
-iic_getAck ( void )
+iic_getAck ( struct iic *bp )
 {
     int rv;
 
-    iic_dc ( cur_sda, 0 );
-    iic_dc ( 1, 0 );
-    iic_dc ( 1, 1 );
+    iic_dc ( bp, bp->cur_sda, 0 );
+    iic_dc ( bp, 1, 0 );
+    iic_dc ( bp, 1, 1 );
 
-    rv = iic_get_bit ();
-    os_delay_us (5);
+    rv = iic_get_bit ( bp );
 
-    iic_dc ( 1, 0 );
+    iic_dc ( bp, 1, 0 );
 
     return rv;
 }
 
 #ifdef ARCH_ARM
-/* XXX - why even manipulate the sda pin when reading ?? */
+/* Only the push-pull pins need SDA switched to input for reading,
+ * on the Maple SDA_LISTEN and SDA_DRIVE are nothing.
+ */
 /* We send the Ack outside of this routine */
 static int
-iic_readb ( void )
+iic_readb ( struct iic *bp )
 {
     int rv = 0;
     int i;
 
-    GPIO_INPUT ( sda_pin );
+    SDA_LISTEN ( bp );
 
-    os_delay_us (5);
+    iic_pause ( bp );
 
-    iic_dc ( cur_sda, 0 );
+    iic_dc ( bp, bp->cur_sda, 0 );
 
     for (i = 0; i < 8; i++) {
-        os_delay_us (5);
-	iic_dc ( 1, 0 );
-	iic_dc ( 1, 1 );
+	iic_dc ( bp, 1, 0 );
+	iic_pause ( bp );
+	iic_dc ( bp, 1, 1 );
 
-        rv |= iic_get_bit() << (7-i);
-
-	iic_dc_wait ( 1, 1, i == 7 ? 8 : 5 );
+        rv |= iic_get_bit ( bp ) << (7-i);
     }
 
-    GPIO_OUTPUT ( sda_pin );
+    SDA_DRIVE ( bp );
 
-    iic_dc ( 1, 0 );
+    iic_dc ( bp, 1, 0 );
 
     return rv;
 }
 
 /* ARM */
 static void
-iic_watch ( int delay )
+iic_watch ( struct iic *bp, int delay )
 {
     int i;
     int val;
 
     for ( i=0; i<delay; i++ ) {
-        val = iic_raw_bit();
+        val = iic_raw_bit ( bp );
 	printf ( "SDA = %d\n", val );
 	os_delay_us ( 1 );
     }
@@ -432,47 +644,47 @@ iic_watch ( int delay )
 
 /* ARM */
 static void
-iic_clk_d ( int clk, int delay )
+iic_clk_d ( struct iic *bp, int clk, int delay )
 {
-    iic_setclk ( clk );
-    iic_watch ( delay );
+    iic_setclk ( bp, clk );
+    iic_watch ( bp, delay );
 }
 
 /* ARM */
 static int
-iic_readbx ( void )
+iic_readbx ( struct iic *bp )
 {
     int rv = 0;
     int i;
     int val;
 
-    GPIO_INPUT ( sda_pin );
+    SDA_LISTEN ( bp );
 
     os_delay_us (5);
 
-    // iic_dc ( cur_sda, 0 );
-    iic_clk_d ( 0, 5 );
+    // iic_dc ( bp, bp->cur_sda, 0 );
+    iic_clk_d ( bp, 0, 5 );
 
     for (i = 0; i < 8; i++) {
         // os_delay_us (5);
-	iic_watch ( 5 );
-	// iic_dc ( 1, 0 );
-	iic_clk_d ( 0, 5 );
-	// iic_dc ( 1, 1 );
-	iic_clk_d ( 1, 5 );
-
-        // rv |= GPIO_READ( sda_pin ) << (7-i);
-        val = iic_raw_bit();
+	iic_watch ( bp, 5 );
+	// iic_dc ( bp, 1, 0 );
+	iic_clk_d ( bp, 0, 5 );
+	// iic_dc ( bp, 1, 1 );
+	iic_clk_d ( bp, 1, 5 );
+
+        // rv |= GPIO_READ( bp->sda_pin ) << (7-i);
+        val = iic_raw_bit ( bp );
 	rv |= val << (7-i);
 	printf ( "*SDA = %d\n", val );
 
 	// iic_dc_wait ( 1, 1, i == 7 ? 8 : 5 );
-	iic_clk_d ( 1, i == 7 ? 8 : 5 );
+	iic_clk_d ( bp, 1, i == 7 ? 8 : 5 );
     }
 
-    GPIO_OUTPUT ( sda_pin );
+    SDA_DRIVE ( bp );
 
-    iic_dc ( 1, 0 );
+    iic_dc ( bp, 1, 0 );
 
     return rv;
 }
@@ -480,60 +692,60 @@ iic_readbx ( void )
 
 #ifdef ARCH_ESP8266
 static int ICACHE_FLASH_ATTR
-iic_readb ( void )
+iic_readb ( struct iic *bp )
 {
     int rv = 0;
     int i;
 
-    os_delay_us (5);
+    iic_pause ( bp );
 
-    iic_dc ( cur_sda, 0 );
+    iic_dc ( bp, bp->cur_sda, 0 );
 
     for (i = 0; i < 8; i++) {
-        os_delay_us (5);
-	iic_dc ( 1, 0 );
-	iic_dc ( 1, 1 );
+	iic_dc ( bp, 1, 0 );
+	iic_pause ( bp );
+	iic_dc ( bp, 1, 1 );
 
-        rv |= iic_get_bit () << (7-i);
-
-	iic_dc_wait ( 1, 1, i == 7 ? 8 : 5 );
+        rv |= iic_get_bit ( bp ) << (7-i);
     }
 
-    iic_dc ( 1, 0 );
+    iic_dc ( bp, 1, 0 );
 
     return rv;
 }
 #endif
 
 static void ICACHE_FLASH_ATTR
-iic_writeb ( int data )
+iic_writeb ( struct iic *bp, int data )
 {
     int bit;
     int i;
 
-    os_delay_us (5);
+    iic_pause ( bp );
 
-    iic_dc ( cur_sda, 0 );
+    iic_dc ( bp, bp->cur_sda, 0 );
 
     for (i = 7; i >= 0; i--) {
         // bit = data >> i;
         bit = (data >> i) & 1;
-	iic_dc ( bit, 0 );
-	iic_dc_wait ( bit, 1, i == 0 ? 8 : 5 );
-	iic_dc ( bit, 0 );
+	iic_dc ( bp, bit, 0 );
+	iic_dc ( bp, bit, 1 );
+	iic_dc ( bp, bit, 0 );
     }
 }
 
 static int ICACHE_FLASH_ATTR
-iic_send_byte ( int byte )
+iic_send_byte ( struct iic *bp, int byte )
 {
 	int ack;
 
-	iic_writeb ( byte );
-	ack = iic_getAck();
+	iic_writeb ( bp, byte );
+	ack = iic_getAck ( bp );
+	if ( bp->err )
+	    return bp->err;
 	if ( ack ) {
-	    iic_stop();
-	    return 1;
+	    iic_stop ( bp );
+	    return I2C_ERR_NACK;
 	}
 	return 0;
 }
@@ -542,27 +754,29 @@ iic_send_byte ( int byte )
  *  but not what I would want when in production.
  */
 static int ICACHE_FLASH_ATTR
-iic_send_byte_m ( int byte, char *msg )
+iic_send_byte_m ( struct iic *bp, int byte, char *msg )
 {
 	int ack;
 
-	iic_writeb ( byte );
-	ack = iic_getAck();
+	iic_writeb ( bp, byte );
+	ack = iic_getAck ( bp );
+	if ( bp->err )
+	    return bp->err;
 	if ( ack ) {
 	    printf("IIC: No ack after sending %s\n", msg);
-	    iic_stop();
-	    return 1;
+	    iic_stop ( bp );
+	    return I2C_ERR_NACK;
 	}
 	return 0;
 }
 
 static int ICACHE_FLASH_ATTR
-iic_recv_byte ( int ack )
+iic_recv_byte ( struct iic *bp, int ack )
 {
 	int rv;
 
-	rv = iic_readb();
-	iic_setAck ( ack );
+	rv = iic_readb ( bp );
+	iic_setAck ( bp, ack );
 	return rv;
 }
 
@@ -573,63 +787,163 @@ iic_recv_byte ( int ack )
 #define IIC_WADDR(a)	(a << 1)
 #define IIC_RADDR(a)	((a << 1) | 1)
 
+/* Get a stuck bus going again.
+ * If a slave was in the middle of sending us a byte when we lost
+ *  track of things (a reset, a timeout), it will sit there holding
+ *  SDA low, waiting for the rest of the clocks.  We give it up to 9
+ *  of them, until it lets go of SDA, and then send a stop.
+ *  This is what the i2c spec says to do, and what i2c_bus_reset
+ *  does for the hardware.
+ * Returns 0 if the bus is free now, I2C_ERR_BUS if not.
+ */
+int ICACHE_FLASH_ATTR
+iic_bus_clear ( struct iic *bp )
+{
+	int i;
+
+	bp->err = 0;
+	iic_dc ( bp, 1, 0 );
+	for ( i = 0; i < 9 && ! iic_get_bit ( bp ); i++ ) {
+		iic_dc ( bp, 1, 1 );
+		iic_dc ( bp, 1, 0 );
+	}
+	iic_stop ( bp );
+
+	i = bp->err || ! iic_get_bit ( bp );
+	bp->err = 0;
+	return i ? I2C_ERR_BUS : 0;
+}
+
+/* Before a transaction, see that nobody is holding SDA low */
+static int ICACHE_FLASH_ATTR
+iic_begin ( struct iic *bp )
+{
+	bp->err = 0;
+	if ( ! iic_get_bit ( bp ) )
+	    return iic_bus_clear ( bp );
+	return 0;
+}
+
+/* After a transaction, pass back the first thing that went wrong.
+ * If a slave held SCL too long, it is likely stuck part way through
+ *  a byte, so clear the bus for next time.
+ */
+static int ICACHE_FLASH_ATTR
+iic_end ( struct iic *bp, int rv )
+{
+	if ( ! rv )
+	    rv = bp->err;
+	if ( rv == I2C_ERR_TIMEOUT )
+	    (void) iic_bus_clear ( bp );
+	bp->err = 0;
+	return rv;
+}
+
 /* raw write an array of bytes (8 bit objects)
  * for a device without registers (like the MCP4725)
+ * Returns 0 if OK, or one of the I2C_ERR_* codes.
  */
 int ICACHE_FLASH_ATTR
-iic_send ( int addr, unsigned char *buf, int n )
+iic_send ( struct iic *bp, int addr, unsigned char *buf, int n )
 {
 	int i;
+	int rv;
+
+	if ( (rv = iic_begin ( bp )) ) return rv;
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return 1;
+	iic_start ( bp );
+	if ( (rv = iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" )) ) return iic_end ( bp, rv );
 	for ( i = 0; i < n; i++ ) {
-		if ( iic_send_byte_m ( buf[i], "reg" ) ) return 1;
+		if ( (rv = iic_send_byte_m ( bp, buf[i], "reg" )) ) return iic_end ( bp, rv );
 	}
-	iic_stop();
+	iic_stop ( bp );
 
-	return 0;
+	return iic_end ( bp, 0 );
 }
 
 /* raw read an array of bytes (8 bit objects)
  * for a device without registers (like the MCP4725)
  */
 int ICACHE_FLASH_ATTR
-iic_recv ( int addr, unsigned char *buf, int n )
+iic_recv ( struct iic *bp, int addr, unsigned char *buf, int n )
 {
 	int i;
+	int rv;
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_RADDR(addr), "R address" ) ) return 1;
+	if ( (rv = iic_begin ( bp )) ) return rv;
+
+	iic_start ( bp );
+	if ( (rv = iic_send_byte_m ( bp, IIC_RADDR(addr), "R address" )) ) return iic_end ( bp, rv );
 
 	for ( i=0; i < n; i++ ) {
-		*buf++ = iic_recv_byte ( i == n - 1 ? 1 : 0 );
+		*buf++ = iic_recv_byte ( bp, i == n - 1 ? 1 : 0 );
+		if ( bp->err ) return iic_end ( bp, 0 );
 	}
 
-	iic_stop();
+	iic_stop ( bp );
 
-	return 0;
+	return iic_end ( bp, 0 );
+}
+
+/* Do a list of messages as one transaction, with a repeated start
+ *  between messages and a stop only at the end.
+ * This is what most sensors want for a register read, write the
+ *  register number then read, without letting go of the bus.
+ * Only 7 bit addresses, and I2C_MSG_NOSTOP is not needed here.
+ */
+int ICACHE_FLASH_ATTR
+iic_xfer ( struct iic *bp, struct i2c_msg *msgs, int n )
+{
+	struct i2c_msg *mp;
+	int i;
+	int rv;
+
+	if ( (rv = iic_begin ( bp )) ) return rv;
+
+	for ( mp = msgs; mp < &msgs[n]; mp++ ) {
+		mp->xferred = 0;
+		iic_start ( bp );
+
+		if ( mp->flags & I2C_MSG_READ ) {
+		    if ( (rv = iic_send_byte ( bp, IIC_RADDR(mp->addr) )) ) return iic_end ( bp, rv );
+		    for ( i = 0; i < mp->length; i++ ) {
+			mp->data[i] = iic_recv_byte ( bp, i == mp->length - 1 ? 1 : 0 );
+			if ( bp->err ) return iic_end ( bp, 0 );
+			mp->xferred++;
+		    }
+		} else {
+		    if ( (rv = iic_send_byte ( bp, IIC_WADDR(mp->addr) )) ) return iic_end ( bp, rv );
+		    for ( i = 0; i < mp->length; i++ ) {
+			if ( (rv = iic_send_byte ( bp, mp->data[i] )) ) return iic_end ( bp, rv );
+			mp->xferred++;
+		    }
+		}
+	}
+
+	iic_stop ( bp );
+
+	return iic_end ( bp, 0 );
 }
 
 #ifdef OLD_HIGH_LEVEL
 /* raw read an array of shorts (16 bit objects)
  */
 int ICACHE_FLASH_ATTR
-iic_read_16raw ( int addr, unsigned short *buf, int n )
+iic_read_16raw ( struct iic *bp, int addr, unsigned short *buf, int n )
 {
 	unsigned int val;
 	int i;
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_RADDR(addr), "R address" ) ) return 1;
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_RADDR(addr), "R address" ) ) return 1;
 
 	for ( i=0; i < n; i++ ) {
-		val =  iic_recv_byte ( 0 ) << 8;
-		val |= iic_recv_byte ( i == n - 1 ? 1 : 0 );
+		val =  iic_recv_byte ( bp, 0 ) << 8;
+		val |= iic_recv_byte ( bp, i == n - 1 ? 1 : 0 );
 		*buf++ = val;
 	}
 
-	iic_stop();
+	iic_stop ( bp );
 
 	return 0;
 }
@@ -639,59 +953,59 @@ iic_read_16raw ( int addr, unsigned short *buf, int n )
  * ripped out of iic_read();
  */
 void
-iic_diag ( int addr, int reg )
+iic_diag ( struct iic *bp, int addr, int reg )
 {
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) {
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) {
 	    printf ( " Oops (addr) !!\n" );
 	    return;
 	}
-	if ( iic_send_byte_m ( reg, "reg" ) ) {
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) {
 	    printf ( " Oops (reg) !!\n" );
 	    return;
 	}
-	iic_stop();
+	iic_stop ( bp );
 	printf ( " OK !!\n" );
 }
 
 /* 8 bit read */
 int ICACHE_FLASH_ATTR
-iic_read ( int addr, int reg )
+iic_read ( struct iic *bp, int addr, int reg )
 {
 	int rv;
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return -1;
-	if ( iic_send_byte_m ( reg, "reg" ) ) return -1;
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) return -1;
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) return -1;
+	iic_stop ( bp );
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_RADDR(addr), "R address" ) ) return -1;
-	rv = iic_recv_byte ( 1 );
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_RADDR(addr), "R address" ) ) return -1;
+	rv = iic_recv_byte ( bp, 1 );
+	iic_stop ( bp );
 
 	return rv;
 }
 
 /* 8 bit read */
 int ICACHE_FLASH_ATTR
-iic_readx ( int addr, int reg )
+iic_readx ( struct iic *bp, int addr, int reg )
 {
 	int rv;
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return -1;
-	if ( iic_send_byte_m ( reg, "reg" ) ) return -1;
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) return -1;
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) return -1;
+	iic_stop ( bp );
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_RADDR(addr), "R address" ) ) return -1;
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_RADDR(addr), "R address" ) ) return -1;
 
-	// rv = iic_recv_byte ( 1 );
-	rv = iic_readbx();
-	iic_setAck ( 1 );
+	// rv = iic_recv_byte ( bp, 1 );
+	rv = iic_readbx ( bp );
+	iic_setAck ( bp, 1 );
 
-	iic_stop();
+	iic_stop ( bp );
 
 	return rv;
 }
@@ -701,20 +1015,20 @@ iic_readx ( int addr, int reg )
  * (or in some devices, a single 16 bit register)
  */
 int ICACHE_FLASH_ATTR
-iic_read_16 ( int addr, int reg )
+iic_read_16 ( struct iic *bp, int addr, int reg )
 {
 	int rv;
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return -1;
-	if ( iic_send_byte_m ( reg, "reg" ) ) return -1;
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) return -1;
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) return -1;
+	iic_stop ( bp );
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_RADDR(addr), "R address" ) ) return -1;
-	rv =  iic_recv_byte ( 0 ) << 8;
-	rv |= iic_recv_byte ( 1 );
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_RADDR(addr), "R address" ) ) return -1;
+	rv =  iic_recv_byte ( bp, 0 ) << 8;
+	rv |= iic_recv_byte ( bp, 1 );
+	iic_stop ( bp );
 
 	return rv;
 }
@@ -724,22 +1038,22 @@ iic_read_16 ( int addr, int reg )
  * consecutive i2c registers.
  */
 int ICACHE_FLASH_ATTR
-iic_read_n ( int addr, int reg, unsigned char *buf, int n )
+iic_read_n ( struct iic *bp, int addr, int reg, unsigned char *buf, int n )
 {
 	unsigned int val;
 	int i;
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return 1;
-	if ( iic_send_byte_m ( reg, "reg" ) ) return 1;
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) return 1;
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) return 1;
+	iic_stop ( bp );
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_RADDR(addr), "R address" ) ) return 1;
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_RADDR(addr), "R address" ) ) return 1;
 	for ( i=0; i < n; i++ ) {
-		*buf++ = iic_recv_byte ( i == n - 1 ? 1 : 0 );
+		*buf++ = iic_recv_byte ( bp, i == n - 1 ? 1 : 0 );
 	}
-	iic_stop();
+	iic_stop ( bp );
 
 	return 0;
 }
@@ -750,24 +1064,24 @@ iic_read_n ( int addr, int reg, unsigned char *buf, int n )
  *  until you send a nack
  */
 int ICACHE_FLASH_ATTR
-iic_read_16n ( int addr, int reg, unsigned short *buf, int n )
+iic_read_16n ( struct iic *bp, int addr, int reg, unsigned short *buf, int n )
 {
 	int val;
 	int i;
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return 1;
-	if ( iic_send_byte_m ( reg, "reg" ) ) return 1;
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) return 1;
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) return 1;
+	iic_stop ( bp );
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_RADDR(addr), "R address" ) ) return 1;
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_RADDR(addr), "R address" ) ) return 1;
 	for ( i=0; i < n; i++ ) {
-		val =  iic_recv_byte ( 0 ) << 8;
-		val |= iic_recv_byte ( i == n - 1 ? 1 : 0 );
+		val =  iic_recv_byte ( bp, 0 ) << 8;
+		val |= iic_recv_byte ( bp, i == n - 1 ? 1 : 0 );
 		*buf++ = val;
 	}
-	iic_stop();
+	iic_stop ( bp );
 
 	return 0;
 }
@@ -776,46 +1090,46 @@ iic_read_16n ( int addr, int reg, unsigned short *buf, int n )
  * two consecutive i2c registers.
  */
 int ICACHE_FLASH_ATTR
-iic_read_24 ( int addr, int reg )
+iic_read_24 ( struct iic *bp, int addr, int reg )
 {
 	int rv;
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return -1;
-	if ( iic_send_byte_m ( reg, "reg" ) ) return -1;
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) return -1;
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) return -1;
+	iic_stop ( bp );
 
-	iic_start();
-	if ( iic_send_byte_m ( IIC_RADDR(addr), "R address" ) ) return -1;
-	rv =  iic_recv_byte ( 0 ) << 16;
-	rv |=  iic_recv_byte ( 0 ) << 8;
-	rv |= iic_recv_byte ( 1 );
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_RADDR(addr), "R address" ) ) return -1;
+	rv =  iic_recv_byte ( bp, 0 ) << 16;
+	rv |=  iic_recv_byte ( bp, 0 ) << 8;
+	rv |= iic_recv_byte ( bp, 1 );
+	iic_stop ( bp );
 
 	return rv;
 }
 
 int ICACHE_FLASH_ATTR
-iic_write ( int addr, int reg, int val )
+iic_write ( struct iic *bp, int addr, int reg, int val )
 {
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return 1;
-	if ( iic_send_byte_m ( reg, "reg" ) ) return 1;
-	if ( iic_send_byte_m ( val, "val" ) ) return 1;
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) return 1;
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) return 1;
+	if ( iic_send_byte_m ( bp, val, "val" ) ) return 1;
+	iic_stop ( bp );
 
 	return 0;
 }
 
 int ICACHE_FLASH_ATTR
-iic_write16 ( int addr, int reg, int val )
+iic_write16 ( struct iic *bp, int addr, int reg, int val )
 {
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return 1;
-	if ( iic_send_byte_m ( reg, "reg" ) ) return 1;
-	if ( iic_send_byte_m ( val >> 8, "val_h" ) ) return 1;
-	if ( iic_send_byte_m ( val & 0xff, "val_l" ) ) return 1;
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) return 1;
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) return 1;
+	if ( iic_send_byte_m ( bp, val >> 8, "val_h" ) ) return 1;
+	if ( iic_send_byte_m ( bp, val & 0xff, "val_l" ) ) return 1;
+	iic_stop ( bp );
 
 	return 0;
 }
@@ -825,12 +1139,12 @@ iic_write16 ( int addr, int reg, int val )
  *   count of zero)
  */
 int ICACHE_FLASH_ATTR
-iic_write_nada ( int addr, int reg )
+iic_write_nada ( struct iic *bp, int addr, int reg )
 {
-	iic_start();
-	if ( iic_send_byte_m ( IIC_WADDR(addr), "W address" ) ) return 1;
-	if ( iic_send_byte_m ( reg, "reg" ) ) return 1;
-	iic_stop();
+	iic_start ( bp );
+	if ( iic_send_byte_m ( bp, IIC_WADDR(addr), "W address" ) ) return 1;
+	if ( iic_send_byte_m ( bp, reg, "reg" ) ) return 1;
+	iic_stop ( bp );
 
 	return 0;
 }
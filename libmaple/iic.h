@@ -0,0 +1,82 @@
+/* iic.h
+ *
+ * The bit banging i2c driver (iic.c).
+ *
+ * Everything about one bus is kept in a struct iic, which the
+ *  caller provides (i2c.c keeps a little pool of them), so we
+ *  can have as many buses going at once as we have pins for.
+ * Nothing outside of iic.c should need to look inside one.
+ */
+
+#ifndef _IIC_H_
+#define _IIC_H_
+
+#include <libmaple/libmaple_types.h>
+#include <libmaple/gpio.h>
+
+struct i2c_msg;
+
+/* How many i2c_gpio_new() will hand out */
+#define MAX_IIC		4
+
+struct iic {
+	uint8 sda_pin;
+	uint8 scl_pin;
+
+	/* What we last put on the lines */
+	uint8 cur_sda;
+	uint8 cur_scl;
+
+	/* Looked up once by iic_gpio_init */
+	gpio_reg_map *sda_port;
+	gpio_reg_map *scl_port;
+	uint32 sda_bit;
+	uint32 scl_bit;
+
+#ifdef ARCH_ESP8266
+	uint8 sda_mask;
+	uint8 scl_mask;
+	uint8 all_mask;
+#endif
+
+	/* Bus timing, in CPU cycles */
+	uint32 high;		/* SCL high time */
+	uint32 low2;		/* half the SCL low time */
+	uint32 due;		/* next line change allowed */
+
+	/* How long a slave may stretch the clock, in cycles */
+	uint32 stretch_max;
+
+	/* First thing that went wrong, I2C_ERR_* */
+	int err;
+
+	/* For iic_scl_hz */
+	int scl_rises;
+	uint32 scl_first;
+	uint32 scl_last;
+};
+
+void iic_init ( struct iic *, int, int );
+void iic_reclaim ( struct iic * );
+int iic_send ( struct iic *, int, unsigned char *, int );
+int iic_recv ( struct iic *, int, unsigned char *, int );
+int iic_set_speed ( struct iic *, int );
+void iic_set_timeout ( struct iic *, int );
+int iic_bus_clear ( struct iic * );
+int iic_scl_hz ( struct iic *, int );
+int iic_xfer ( struct iic *, struct i2c_msg *, int );
+
+/* In iic_dma.c */
+int iic_dma_init ( struct iic * );
+int iic_dma_start ( struct iic *, struct i2c_msg *, int );
+int iic_dma_busy ( struct iic * );
+int iic_dma_wait ( struct iic * );
+void iic_dma_callback ( struct iic *, void (*) ( void *, int ), void * );
+int iic_dma_xfer ( struct iic *, struct i2c_msg *, int );
+int iic_dma_send ( struct iic *, int, unsigned char *, int );
+int iic_dma_recv ( struct iic *, int, unsigned char *, int );
+int iic_dma_scl_hz ( struct iic * );
+
+#endif
+
+/* THE END */
@@ -0,0 +1,606 @@
+/* iic_dma.c
+ *
+ * An i2c master where a timer and DMA wiggle the pins.
+ *
+ * iic.c does a fine job, but the CPU spins for every bit it sends.
+ *  Sending a full frame to an SSD1306 (1K of data) keeps it busy
+ *  for 25 ms or so at 400 kHz, and that is time the main loop
+ *  could put to better use.
+ * Here the waveform is worked out ahead of time as a list of words
+ *  to store into the GPIO BSRR register, one per timer tick.  The
+ *  timer update event has a DMA channel copy the next word into
+ *  BSRR, and halfway through each tick the timer compare has a
+ *  second DMA channel copy IDR into a sample buffer, which is how
+ *  we see ACK bits and data from the slave.
+ * This is still all GPIO, so none of the F1 i2c silicon bugs that
+ *  sent us to bit banging in the first place come into it.
+ *
+ * Each bit (a "symbol") is 3 ticks:
+ *  - put the data on SDA (SCL is low)
+ *  - let SCL go high
+ *  - pull SCL low
+ *  SCL is high for 1 tick, low for 2, which suits the i2c spec,
+ *  and the tick is the high time iic_set_speed picked for the bus.
+ *  This runs a bit slower than iic.c at the same setting, since
+ *  the low time comes out longer than it needs to be.
+ *  The start and stop conditions are made from symbols too.
+ *
+ * A transfer is a list of i2c_msg (see i2c_xfer), with a repeated
+ *  start between messages and a stop only at the very end.
+ *
+ * The buffers are circular and hold 2 halves of HALF_SYMS symbols.
+ *  When the input channel finishes a half, we look at the samples
+ *  from it, and fill it with the next symbols to send while the
+ *  other half is going out.  So the CPU gets an interrupt once
+ *  every 4 bytes or so, rather than spinning for every tick.
+ *
+ * Things to know:
+ *  - SDA and SCL must be on the same GPIO port.
+ *  - The hardware can't wait for a slave that stretches the clock,
+ *    but we do notice it (SCL low when we sample) and call it
+ *    I2C_ERR_TIMEOUT, and then clear the bus like iic.c does.
+ *  - After a NACK, whatever was already queued (up to half the
+ *    buffer) still goes out before we get to send the stop.
+ *  - If the interrupt is held off so long that the output channel
+ *    gets into the half we have not refilled yet, it would replay
+ *    old words.  We check for that, and when it happens stop the
+ *    timer, clear the bus, and call it I2C_ERR_BUS.
+ *  - There is just one of these (one timer, two DMA channels),
+ *    so i2c_dma_new hands out just one bus.
+ *  - TIM4 update uses DMA1 channel 7 and TIM4 channel 1 uses
+ *    DMA1 channel 1.  Channel 7 is also what USART2 TX DMA and
+ *    I2C1 RX DMA would use.  We claim both channels (dma_claim),
+ *    and iic_dma_init fails if either one, or TIM4, is taken.
+ */
+
+#include <libmaple/libmaple_types.h>
+#include <libmaple/dma.h>
+#include <libmaple/timer.h>
+
+#include "boards.h"
+#include "i2c.h"
+#include "iic.h"
+
+#define IIC_TIMER	TIMER4
+#define IIC_OUT_CH	DMA_CH7		/* TIM4_UP */
+#define IIC_IN_CH	DMA_CH1		/* TIM4_CH1 */
+
+#define SLOTS		3		/* ticks per symbol */
+#define HALF_SYMS	36		/* 4 bytes with their ACKs */
+#define NUM_SYMS	(2 * HALF_SYMS)
+#define HALF_SLOTS	(HALF_SYMS * SLOTS)
+#define NUM_SLOTS	(NUM_SYMS * SLOTS)
+
+static uint32 out_ring[NUM_SLOTS];
+static uint16 in_ring[NUM_SLOTS];
+static uint8 sym_kind[NUM_SYMS];
+
+/* What the sample for a symbol means */
+#define K_IDLE		0	/* bus idle, nothing going on */
+#define K_OUT		1	/* we drive SDA */
+#define K_ACK		2	/* slave ACK (SDA low) */
+#define K_READ		3	/* data bit from the slave */
+#define K_STOP		4	/* the last one */
+
+/* Where we are in making symbols */
+#define P_START_A	0
+#define P_START_B	1
+#define P_BITS		2
+#define P_ACK		3
+#define P_STOP		4
+#define P_IDLE		5
+
+struct iic_dma {
+	struct iic *bp;
+
+	/* BSRR values */
+	uint32 sda_set;
+	uint32 sda_clr;
+	uint32 scl_set;
+	uint32 scl_clr;
+
+	struct i2c_msg *msgs;
+	int nmsgs;
+
+	/* making symbols */
+	int state;
+	int msg;
+	int pos;		/* -1 is the address byte */
+	int bit;
+
+	/* reading samples */
+	int rmsg;
+	int rpos;
+	int rbit;
+	int rbyte;
+
+	volatile int busy;
+	volatile int status;
+	int abort;
+
+	/* See iic_dma_callback */
+	void (*done) ( void *, int );
+	void *done_arg;
+};
+
+static struct iic_dma iic_dma;
+
+/* Make the next symbol, 3 BSRR words and what to expect back.
+ * A BSRR word of 0 changes nothing.
+ */
+static void
+iic_dma_sym ( struct iic_dma *dp, uint32 *w, uint8 *kp )
+{
+	struct i2c_msg *mp = &dp->msgs[dp->msg];
+	int read = mp->flags & I2C_MSG_READ;
+	int byte;
+
+	if ( dp->abort && dp->state < P_STOP )
+	    dp->state = P_STOP;
+
+	switch ( dp->state ) {
+	    case P_START_A:
+		/* both high, works for a repeated start also */
+		w[0] = dp->sda_set;
+		w[1] = dp->scl_set;
+		w[2] = 0;
+		*kp = K_OUT;
+		dp->state = P_START_B;
+		break;
+
+	    case P_START_B:
+		/* SDA falls with SCL high */
+		w[0] = dp->sda_clr;
+		w[1] = 0;
+		w[2] = dp->scl_clr;
+		*kp = K_OUT;
+		dp->state = P_BITS;
+		dp->bit = 7;
+		break;
+
+	    case P_BITS:
+		if ( read && dp->pos >= 0 ) {
+		    w[0] = dp->sda_set;
+		    *kp = K_READ;
+		} else {
+		    if ( dp->pos < 0 )
+			byte = (mp->addr << 1) | (read ? 1 : 0);
+		    else
+			byte = mp->data[dp->pos];
+		    w[0] = (byte >> dp->bit) & 1 ? dp->sda_set : dp->sda_clr;
+		    *kp = K_OUT;
+		}
+		w[1] = dp->scl_set;
+		w[2] = dp->scl_clr;
+		if ( dp->bit-- == 0 )
+		    dp->state = P_ACK;
+		break;
+
+	    case P_ACK:
+		if ( read && dp->pos >= 0 ) {
+		    /* We ACK all but the last byte */
+		    w[0] = dp->pos == mp->length - 1 ? dp->sda_set : dp->sda_clr;
+		    *kp = K_OUT;
+		} else {
+		    w[0] = dp->sda_set;
+		    *kp = K_ACK;
+		}
+		w[1] = dp->scl_set;
+		w[2] = dp->scl_clr;
+		dp->pos++;
+		dp->bit = 7;
+		if ( dp->pos < mp->length )
+		    dp->state = P_BITS;
+		else if ( dp->msg < dp->nmsgs - 1 ) {
+		    /* on to the next message, with a repeated start */
+		    dp->msg++;
+		    dp->pos = -1;
+		    dp->state = P_START_A;
+		} else
+		    dp->state = P_STOP;
+		break;
+
+	    case P_STOP:
+		/* SDA rises with SCL high */
+		w[0] = dp->sda_clr;
+		w[1] = dp->scl_set;
+		w[2] = dp->sda_set;
+		*kp = K_STOP;
+		dp->state = P_IDLE;
+		break;
+
+	    default:
+		w[0] = w[1] = w[2] = 0;
+		*kp = K_IDLE;
+		break;
+	}
+}
+
+static void
+iic_dma_fill ( struct iic_dma *dp, int half )
+{
+	int s;
+	int i;
+
+	for ( i = 0; i < HALF_SYMS; i++ ) {
+	    s = half * HALF_SYMS + i;
+	    iic_dma_sym ( dp, &out_ring[s * SLOTS], &sym_kind[s] );
+	}
+}
+
+/* Put a byte we read where it goes, that is in the next
+ *  read message that still has room.
+ */
+static void
+iic_dma_store ( struct iic_dma *dp, int byte )
+{
+	struct i2c_msg *mp;
+
+	for ( ;; ) {
+	    mp = &dp->msgs[dp->rmsg];
+	    if ( (mp->flags & I2C_MSG_READ) && dp->rpos < mp->length )
+		break;
+	    if ( ++dp->rmsg >= dp->nmsgs )
+		return;
+	    dp->rpos = 0;
+	}
+
+	mp->data[dp->rpos++] = byte;
+	mp->xferred = dp->rpos;
+}
+
+/* Look at the samples for one half.
+ * We take the sample from the middle of the SCL high tick.
+ * Returns 1 when the stop has gone out.
+ */
+static int
+iic_dma_decode ( struct iic_dma *dp, int half )
+{
+	struct iic *bp = dp->bp;
+	uint32 sample;
+	int s;
+	int i;
+
+	for ( i = 0; i < HALF_SYMS; i++ ) {
+	    s = half * HALF_SYMS + i;
+	    if ( sym_kind[s] == K_IDLE )
+		continue;
+	    if ( sym_kind[s] == K_STOP ) {
+		if ( dp->status == 0 ) {
+		    for ( i = 0; i < dp->nmsgs; i++ )
+			dp->msgs[i].xferred = dp->msgs[i].length;
+		}
+		return 1;
+	    }
+	    if ( dp->abort )
+		continue;
+
+	    sample = in_ring[s * SLOTS + 1];
+
+	    /* Somebody is holding SCL low, we can't wait for it */
+	    if ( ! (sample & bp->scl_bit) ) {
+		dp->status = I2C_ERR_TIMEOUT;
+		dp->abort = 1;
+		continue;
+	    }
+
+	    if ( sym_kind[s] == K_ACK ) {
+		if ( sample & bp->sda_bit ) {
+		    dp->status = I2C_ERR_NACK;
+		    dp->abort = 1;
+		}
+	    } else if ( sym_kind[s] == K_READ ) {
+		dp->rbyte = (dp->rbyte << 1) | (sample & bp->sda_bit ? 1 : 0);
+		if ( ++dp->rbit == 8 ) {
+		    iic_dma_store ( dp, dp->rbyte );
+		    dp->rbit = 0;
+		    dp->rbyte = 0;
+		}
+	    }
+	}
+
+	return 0;
+}
+
+static void
+iic_dma_halt ( void )
+{
+	timer_pause ( IIC_TIMER );
+	(IIC_TIMER->regs).gen->DIER &= ~(TIMER_DIER_UDE | TIMER_DIER_CC1DE);
+	dma_disable ( DMA1, IIC_OUT_CH );
+	dma_disable ( DMA1, IIC_IN_CH );
+}
+
+/* The transfer is over, one way or another.
+ * A slave that was stretching the clock (which we can't wait
+ *  for) may still be sitting on the bus, so get it off.
+ *  Same if we stopped part way through a byte.
+ */
+static void
+iic_dma_finish ( struct iic_dma *dp )
+{
+	iic_dma_halt ();
+	if ( dp->status == I2C_ERR_TIMEOUT || dp->status == I2C_ERR_BUS )
+	    (void) iic_bus_clear ( dp->bp );
+	dp->busy = 0;
+
+	if ( dp->done )
+	    dp->done ( dp->done_arg, dp->status );
+}
+
+/* Has the output channel got into this half already?
+ * It should be in the other half all the while we look at
+ *  this one and fill it again.  Once it has put out the first
+ *  word of this half, it is putting out words from last time
+ *  around.
+ * When the interrupt comes, the output channel has just put out
+ *  the last word of this half, and the next one is half a tick
+ *  away, so pos sitting right at the end of this half is the
+ *  normal case and on time.  That leaves the last word of the
+ *  half out of the check, which can't be told apart from that;
+ *  being that far behind is a whole half late, and the HT and
+ *  TC flags both being up catches it.
+ */
+static int
+iic_dma_late ( int half )
+{
+	uint32 pos = NUM_SLOTS - dma_tube_regs ( DMA1, IIC_OUT_CH )->CNDTR;
+
+	return (pos + NUM_SLOTS - half * HALF_SLOTS - 1) % NUM_SLOTS < HALF_SLOTS - 1;
+}
+
+/* The input channel is done with half (or all) of the buffer.
+ * The output channel is by now just into the next half.
+ */
+static void
+iic_dma_irq ( void )
+{
+	struct iic_dma *dp = &iic_dma;
+	dma_irq_cause cause;
+	uint8 bits;
+	int half;
+
+	/* Both flags means we missed one, and are a half behind */
+	bits = dma_get_isr_bits ( DMA1, IIC_IN_CH );
+	cause = dma_get_irq_cause ( DMA1, IIC_IN_CH );
+	if ( cause == DMA_TRANSFER_ERROR ) {
+	    dp->status = I2C_ERR_BUS;
+	    iic_dma_finish ( dp );
+	    return;
+	}
+
+	half = cause == DMA_TRANSFER_HALF_COMPLETE ? 0 : 1;
+
+	if ( (bits & (DMA_ISR_HTIF | DMA_ISR_TCIF)) == (DMA_ISR_HTIF | DMA_ISR_TCIF) ||
+		iic_dma_late ( half ) ) {
+	    dp->status = I2C_ERR_BUS;
+	    iic_dma_finish ( dp );
+	    return;
+	}
+
+	if ( iic_dma_decode ( dp, half ) ) {
+	    iic_dma_finish ( dp );
+	    return;
+	}
+
+	iic_dma_fill ( dp, half );
+
+	/* Did the refill make it in time */
+	if ( iic_dma_late ( half ) ) {
+	    dp->status = I2C_ERR_BUS;
+	    iic_dma_finish ( dp );
+	}
+}
+
+/* Take over a bus set up by iic_init for timer and DMA use.
+ * Returns 0 if OK, 1 if we can't.
+ */
+int
+iic_dma_init ( struct iic *bp )
+{
+	struct iic_dma *dp = &iic_dma;
+	dma_tube_config cfg;
+
+	if ( dp->bp )
+	    return 1;
+	if ( bp->sda_port != bp->scl_port )
+	    return 1;
+
+	/* TIM4 comes out of reset counting (init.c sets every timer
+	 *  up for PWM), so that alone means nothing.  But somebody
+	 *  using its interrupts, DMA, or outputs has it already.
+	 */
+	if ( (IIC_TIMER->regs).gen->DIER || (IIC_TIMER->regs).gen->CCER )
+	    return 1;
+
+	dma_init ( DMA1 );
+	if ( dma_claim ( DMA1, IIC_OUT_CH, dp ) )
+	    return 1;
+	if ( dma_claim ( DMA1, IIC_IN_CH, dp ) ) {
+	    dma_release ( DMA1, IIC_OUT_CH, dp );
+	    return 1;
+	}
+
+	cfg.tube_src = out_ring;
+	cfg.tube_src_size = DMA_SIZE_32BITS;
+	cfg.tube_dst = &bp->sda_port->BSRR;
+	cfg.tube_dst_size = DMA_SIZE_32BITS;
+	cfg.tube_nr_xfers = NUM_SLOTS;
+	cfg.tube_flags = DMA_CFG_SRC_INC | DMA_CFG_CIRC;
+	cfg.target_data = 0;
+	cfg.tube_req_src = DMA_REQ_SRC_TIM4_UP;
+	if ( dma_tube_cfg ( DMA1, IIC_OUT_CH, &cfg ) < 0 )
+	    goto bad;
+
+	/* GPIO wants 32 bit reads, we keep the low half */
+	cfg.tube_src = &bp->sda_port->IDR;
+	cfg.tube_src_size = DMA_SIZE_32BITS;
+	cfg.tube_dst = in_ring;
+	cfg.tube_dst_size = DMA_SIZE_16BITS;
+	cfg.tube_nr_xfers = NUM_SLOTS;
+	cfg.tube_flags = DMA_CFG_DST_INC | DMA_CFG_CIRC |
+	    DMA_CFG_HALF_CMPLT_IE | DMA_CFG_CMPLT_IE | DMA_CFG_ERR_IE;
+	cfg.tube_req_src = DMA_REQ_SRC_TIM4_CH1;
+	if ( dma_tube_cfg ( DMA1, IIC_IN_CH, &cfg ) < 0 )
+	    goto bad;
+
+	/* Late edges would be worse than slow memory access elsewhere */
+	dma_set_priority ( DMA1, IIC_OUT_CH, DMA_PRIORITY_VERY_HIGH );
+	dma_set_priority ( DMA1, IIC_IN_CH, DMA_PRIORITY_VERY_HIGH );
+	dma_attach_interrupt ( DMA1, IIC_IN_CH, iic_dma_irq );
+
+	timer_pause ( IIC_TIMER );
+	timer_oc_set_mode ( IIC_TIMER, TIMER_CH1, TIMER_OC_MODE_FROZEN, TIMER_OC_PE );
+
+	dp->sda_set = bp->sda_bit;
+	dp->sda_clr = bp->sda_bit << 16;
+	dp->scl_set = bp->scl_bit;
+	dp->scl_clr = bp->scl_bit << 16;
+	dp->bp = bp;
+	return 0;
+
+bad:
+	dma_release ( DMA1, IIC_OUT_CH, dp );
+	dma_release ( DMA1, IIC_IN_CH, dp );
+	return 1;
+}
+
+/* Get a transfer going and return right away.
+ * Use iic_dma_busy to see when it is done,
+ *  or iic_dma_wait to wait for it.
+ * The messages and their data must stay put until then.
+ * Returns 0 if it got started, else an I2C_ERR_* code.
+ */
+int
+iic_dma_start ( struct iic *bp, struct i2c_msg *msgs, int n )
+{
+	struct iic_dma *dp = &iic_dma;
+	uint32 tick = bp->high;
+	int i;
+
+	if ( dp->bp != bp || dp->busy )
+	    return I2C_ERR_BUSY;
+	dp->status = 0;
+	if ( n < 1 )
+	    return 0;
+
+	/* A slave still holding SDA from last time */
+	if ( ! (bp->sda_port->IDR & bp->sda_bit) && iic_bus_clear ( bp ) )
+	    return I2C_ERR_BUS;
+
+	for ( i = 0; i < n; i++ )
+	    msgs[i].xferred = 0;
+
+	dp->msgs = msgs;
+	dp->nmsgs = n;
+	dp->msg = 0;
+	dp->pos = -1;
+	dp->state = P_START_A;
+	dp->rmsg = 0;
+	dp->rpos = 0;
+	dp->rbit = 0;
+	dp->rbyte = 0;
+	dp->abort = 0;
+
+	iic_dma_fill ( dp, 0 );
+	iic_dma_fill ( dp, 1 );
+
+	dma_set_mem_addr ( DMA1, IIC_OUT_CH, out_ring );
+	dma_set_num_transfers ( DMA1, IIC_OUT_CH, NUM_SLOTS );
+	dma_set_mem_addr ( DMA1, IIC_IN_CH, in_ring );
+	dma_set_num_transfers ( DMA1, IIC_IN_CH, NUM_SLOTS );
+	dma_enable ( DMA1, IIC_IN_CH );
+	dma_enable ( DMA1, IIC_OUT_CH );
+
+	/* The compare (input) is half a tick after the update (output).
+	 * The forced update puts out the first word right now,
+	 *  so sample N lands in the middle of tick N.
+	 */
+	timer_set_prescaler ( IIC_TIMER, 0 );
+	timer_set_reload ( IIC_TIMER, tick - 1 );
+	timer_set_compare ( IIC_TIMER, TIMER_CH1, tick / 2 );
+	timer_set_count ( IIC_TIMER, 0 );
+	(IIC_TIMER->regs).gen->SR = 0;
+
+	dp->busy = 1;
+	(IIC_TIMER->regs).gen->DIER |= TIMER_DIER_UDE | TIMER_DIER_CC1DE;
+	timer_generate_update ( IIC_TIMER );
+	timer_resume ( IIC_TIMER );
+
+	return 0;
+}
+
+int
+iic_dma_busy ( struct iic *bp )
+{
+	return iic_dma.bp == bp && iic_dma.busy;
+}
+
+/* Returns 0 if OK, or one of the I2C_ERR_* codes */
+int
+iic_dma_wait ( struct iic *bp )
+{
+	while ( iic_dma_busy ( bp ) )
+	    ;
+	return iic_dma.status;
+}
+
+/* Have fn called from the DMA interrupt as each transfer
+ *  finishes, with arg and the I2C_ERR_* status.
+ * It may start the next transfer.  NULL turns this off.
+ */
+void
+iic_dma_callback ( struct iic *bp, void (*fn) ( void *, int ), void *arg )
+{
+	struct iic_dma *dp = &iic_dma;
+
+	if ( dp->bp != bp )
+	    return;
+	dp->done = NULL;
+	dp->done_arg = arg;
+	dp->done = fn;
+}
+
+/* These work just like iic_xfer, iic_send and iic_recv */
+int
+iic_dma_xfer ( struct iic *bp, struct i2c_msg *msgs, int n )
+{
+	int rv;
+
+	if ( (rv = iic_dma_start ( bp, msgs, n )) )
+	    return rv;
+	return iic_dma_wait ( bp );
+}
+
+int
+iic_dma_send ( struct iic *bp, int addr, unsigned char *buf, int n )
+{
+	struct i2c_msg msg;
+
+	msg.addr = addr;
+	msg.flags = 0;
+	msg.length = n;
+	msg.data = buf;
+	return iic_dma_xfer ( bp, &msg, 1 );
+}
+
+int
+iic_dma_recv ( struct iic *bp, int addr, unsigned char *buf, int n )
+{
+	struct i2c_msg msg;
+
+	msg.addr = addr;
+	msg.flags = I2C_MSG_READ;
+	msg.length = n;
+	msg.data = buf;
+	return iic_dma_xfer ( bp, &msg, 1 );
+}
+
+/* We can't watch SCL go by, but we know what we asked for */
+int
+iic_dma_scl_hz ( struct iic *bp )
+{
+	return CYCLES_PER_MICROSECOND * 1000000 / (SLOTS * bp->high);
+}
+
+/* THE END */
@@ -115,6 +115,40 @@ void nvic_sys_reset();
  */
 #define nvic_globalirq_disable() do { asm volatile("cpsid i"); } while (0)
 
+/**
+ * @brief Nonzero if interrupts are masked (PRIMASK is set).
+ */
+static inline uint32 nvic_globalirq_masked(void) {
+    uint32 primask;
+
+    asm volatile("mrs %0, primask" : "=r" (primask));
+    return primask;
+}
+
+/**
+ * @brief Mask interrupts, and say whether they were masked already.
+ *
+ * For short critical sections that may be entered with interrupts
+ * already off (from a handler, or inside another such section).
+ * Hand the result to nvic_globalirq_restore() on the way out.
+ */
+static inline uint32 nvic_globalirq_save(void) {
+    uint32 primask = nvic_globalirq_masked();
+
+    nvic_globalirq_disable();
+    return primask;
+}
+
+/**
+ * @brief Undo nvic_globalirq_save().
+ * @param primask What nvic_globalirq_save() returned
+ */
+static inline void nvic_globalirq_restore(uint32 primask) {
+    if (!primask) {
+        nvic_globalirq_enable();
+    }
+}
+
 /**
  * @brief Enable interrupt irq_num
  * @param irq_num Interrupt to enable
@@ -0,0 +1,228 @@
+/* regmap.c
+ *
+ * Register maps for i2c sensor chips.
+ *
+ * Every one of my sensor drivers grew its own little set of
+ *  i2c_read_8, i2c_read_16, i2c_read_16_le, i2c_read_24 ...
+ *  and each one of those is a whole i2c transaction (start,
+ *  address, register number, repeated start, address, data, stop)
+ *  to get one value.  Reading the 14 calibration values from
+ *  the BMP390 that way took 14 transactions for 21 bytes.
+ *
+ * Here a driver reads a block of registers into a shadow copy
+ *  in one transaction, and then takes the values it wants out of
+ *  the shadow, as many as it likes, for free.
+ * Calibration blocks and the like never change, so regmap_cache
+ *  reads them once and regmap_read never goes back for them.
+ *
+ * Values wider than a byte are put together from the shadow in
+ *  the byte order the chip uses (REGMAP_LE, or MSB first).
+ * Some chips (the MCP9808) have 16 bit registers and no auto
+ *  increment, so for those (REGMAP_NOINC) a range read is one
+ *  transaction per register, which is the best they can do.
+ */
+
+#include <libmaple/libmaple_types.h>
+
+#include "i2c.h"
+#include "regmap.h"
+
+/* Start over, as after a chip reset, nothing is cached */
+void
+regmap_init ( struct regmap *rp, struct i2c *ip )
+{
+	rp->ip = ip;
+	rp->ncache = 0;
+}
+
+/* For driver entry points that are handed a bus.
+ * If it is not the one we were on, what we have cached
+ *  came from some other chip, so start over on this one.
+ * Returns 1 if we moved, so the driver can reload what
+ *  it keeps of its own (calibration and the like).
+ */
+int
+regmap_bus ( struct regmap *rp, struct i2c *ip )
+{
+	if ( rp->ip == ip )
+	    return 0;
+	regmap_init ( rp, ip );
+	return 1;
+}
+
+static int
+regmap_in_range ( struct regmap *rp, int reg, int n )
+{
+	return reg >= rp->base && n > 0 && reg + n <= rp->base + rp->nregs;
+}
+
+/* Register number, a repeated start, then read len bytes */
+static int
+regmap_xfer ( struct regmap *rp, int reg, unsigned char *buf, int len )
+{
+	unsigned char rbuf[1];
+	i2c_msg msgs[2];
+
+	rbuf[0] = reg;
+	msgs[0].addr = rp->addr;
+	msgs[0].flags = 0;
+	msgs[0].length = 1;
+	msgs[0].data = rbuf;
+
+	msgs[1].addr = rp->addr;
+	msgs[1].flags = I2C_MSG_READ;
+	msgs[1].length = len;
+	msgs[1].data = buf;
+
+	return i2c_xfer ( rp->ip, msgs, 2 );
+}
+
+/* Read n registers, starting at reg, into the shadow.
+ * If they are all in a cached range we already have them.
+ * Returns 0 if OK, else one of the I2C_ERR_* codes
+ *  (or I2C_ERR_BUS for registers outside the shadow).
+ */
+int
+regmap_read ( struct regmap *rp, int reg, int n )
+{
+	struct regmap_range *cp;
+	unsigned char *buf;
+	int rv;
+	int i;
+
+	if ( ! regmap_in_range ( rp, reg, n ) )
+	    return I2C_ERR_BUS;
+
+	for ( i = 0; i < rp->ncache; i++ ) {
+	    cp = &rp->cache[i];
+	    if ( cp->valid && reg >= cp->reg && reg + n <= cp->reg + cp->n )
+		return 0;
+	}
+
+	buf = &rp->shadow[(reg - rp->base) * rp->width];
+
+	if ( ! (rp->flags & REGMAP_NOINC) )
+	    return regmap_xfer ( rp, reg, buf, n * rp->width );
+
+	for ( i = 0; i < n; i++ ) {
+	    rv = regmap_xfer ( rp, reg + i, buf, rp->width );
+	    if ( rv )
+		return rv;
+	    buf += rp->width;
+	}
+	return 0;
+}
+
+/* Say that n registers from reg never change, and read them.
+ * If the read fails, the range is not valid and the next
+ *  regmap_read of it (or regmap_cache again) will try again.
+ * Returns what the read did.
+ */
+int
+regmap_cache ( struct regmap *rp, int reg, int n )
+{
+	struct regmap_range *cp = NULL;
+	int rv;
+	int i;
+
+	for ( i = 0; i < rp->ncache; i++ )
+	    if ( rp->cache[i].reg == reg && rp->cache[i].n == n )
+		cp = &rp->cache[i];
+
+	if ( ! cp ) {
+	    if ( rp->ncache >= REGMAP_MAX_CACHE )
+		return regmap_read ( rp, reg, n );
+	    cp = &rp->cache[rp->ncache++];
+	    cp->reg = reg;
+	    cp->n = n;
+	}
+
+	cp->valid = 0;
+	rv = regmap_read ( rp, reg, n );
+	cp->valid = ! rv;
+	return rv;
+}
+
+/* Write one register (width bytes), and keep the shadow in step.
+ * The shadow only changes once the chip has taken the value,
+ *  if the write fails it still holds what the chip has.
+ * Returns 0 if OK, else one of the I2C_ERR_* codes.
+ */
+int
+regmap_write ( struct regmap *rp, int reg, int val )
+{
+	char buf[3];
+	unsigned char *sp;
+	int i, b;
+	int rv;
+
+	buf[0] = reg;
+	for ( i = 0; i < rp->width; i++ ) {
+	    b = (rp->flags & REGMAP_LE) ? i : rp->width - 1 - i;
+	    buf[1+i] = val >> (8 * b);
+	}
+
+	rv = i2c_send ( rp->ip, rp->addr, buf, 1 + rp->width );
+	if ( rv || ! regmap_in_range ( rp, reg, 1 ) )
+	    return rv;
+
+	sp = &rp->shadow[(reg - rp->base) * rp->width];
+	for ( i = 0; i < rp->width; i++ )
+	    sp[i] = buf[1+i];
+	return 0;
+}
+
+/* nbytes from the shadow, starting at reg, in the chip's byte order.
+ * Registers outside the shadow read as 0.
+ */
+static uint32
+regmap_get ( struct regmap *rp, int reg, int nbytes )
+{
+	unsigned char *sp;
+	uint32 rv = 0;
+	int i;
+
+	if ( ! regmap_in_range ( rp, reg, (nbytes + rp->width - 1) / rp->width ) )
+	    return 0;
+
+	sp = &rp->shadow[(reg - rp->base) * rp->width];
+	for ( i = 0; i < nbytes; i++ ) {
+	    if ( rp->flags & REGMAP_LE )
+		rv |= sp[i] << (8 * i);
+	    else
+		rv = (rv << 8) | sp[i];
+	}
+	return rv;
+}
+
+int
+regmap_u8 ( struct regmap *rp, int reg )
+{
+	return regmap_get ( rp, reg, 1 );
+}
+
+int
+regmap_s8 ( struct regmap *rp, int reg )
+{
+	return (signed char) regmap_get ( rp, reg, 1 );
+}
+
+int
+regmap_u16 ( struct regmap *rp, int reg )
+{
+	return regmap_get ( rp, reg, 2 );
+}
+
+int
+regmap_s16 ( struct regmap *rp, int reg )
+{
+	return (short) regmap_get ( rp, reg, 2 );
+}
+
+int
+regmap_u24 ( struct regmap *rp, int reg )
+{
+	return regmap_get ( rp, reg, 3 );
+}
+
+/* THE END */
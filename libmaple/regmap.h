@@ -0,0 +1,72 @@
+/* regmap.h
+ *
+ * Register maps for i2c sensor chips (regmap.c).
+ *
+ * A driver describes its chip once, in a struct regmap, with a
+ *  buffer (the shadow) that holds a copy of the registers from
+ *  base to base + nregs - 1.  regmap_read pulls any range of them
+ *  into the shadow in one transaction, and then the regmap_u8,
+ *  regmap_s16 and friends pick values out of the shadow without
+ *  going near the bus.
+ * Something like:
+ *
+ *   static unsigned char my_shadow[MY_NREGS];
+ *   static struct regmap my_map = {
+ *	.addr = MY_ADDR, .width = 1, .flags = REGMAP_LE,
+ *	.base = 0, .nregs = MY_NREGS, .shadow = my_shadow
+ *   };
+ *
+ *   regmap_init ( &my_map, ip );
+ *   regmap_cache ( &my_map, MY_CALS, MY_NCALS );
+ *   regmap_read ( &my_map, MY_DATA, 6 );
+ *   t = regmap_u24 ( &my_map, MY_TEMP );
+ */
+
+#ifndef _REGMAP_H_
+#define _REGMAP_H_
+
+struct i2c;
+
+/* Ranges that never change (calibration and ID), see regmap_cache */
+#define REGMAP_MAX_CACHE	2
+
+/* flags */
+#define REGMAP_LE	0x01	/* multi byte values are LSB first */
+#define REGMAP_NOINC	0x02	/* no auto increment, one register a read */
+
+struct regmap_range {
+	int reg;
+	int n;
+	int valid;
+};
+
+struct regmap {
+	/* The chip, filled in by the driver */
+	int addr;		/* 7 bit i2c address */
+	int width;		/* bytes in a register, 1 or 2 */
+	int flags;
+	int base;		/* first register in the shadow */
+	int nregs;		/* how many */
+	unsigned char *shadow;	/* nregs * width bytes */
+
+	/* The rest belongs to regmap.c */
+	struct i2c *ip;
+	int ncache;
+	struct regmap_range cache[REGMAP_MAX_CACHE];
+};
+
+void regmap_init ( struct regmap *, struct i2c * );
+int regmap_bus ( struct regmap *, struct i2c * );
+int regmap_cache ( struct regmap *, int, int );
+int regmap_read ( struct regmap *, int, int );
+int regmap_write ( struct regmap *, int, int );
+
+int regmap_u8 ( struct regmap *, int );
+int regmap_s8 ( struct regmap *, int );
+int regmap_u16 ( struct regmap *, int );
+int regmap_s16 ( struct regmap *, int );
+int regmap_u24 ( struct regmap *, int );
+
+#endif
+
+/* THE END */
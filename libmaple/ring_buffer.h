@@ -28,8 +28,12 @@
  * @file libmaple/include/libmaple/ring_buffer.h
  * @brief Simple circular buffer
  *
- * This implementation is not thread-safe.  In particular, none of
- * these functions is guaranteed re-entrant.
+ * The ring_buffer implementation is not thread-safe.  In particular,
+ * none of these functions is guaranteed re-entrant.
+ *
+ * The ring_fifo variant further down is safe for exactly one producer
+ * and one consumer (typically an ISR and the main loop) without
+ * masking interrupts.
  */
 
 #ifndef _LIBMAPLE_RING_BUFFER_H_
@@ -40,6 +44,7 @@ extern "C"{
 #endif
 
 #include <libmaple/libmaple_types.h>
+#include <string.h>
 
 /**
  * Ring buffer type.
@@ -181,6 +186,174 @@ static inline void rb_reset(ring_buffer *rb) {
     rb->tail = rb->head;
 }
 
+/*
+ * Power of two ring buffer
+ */
+
+/**
+ * Power of two, single-producer/single-consumer ring buffer.
+ *
+ * head and tail are free-running counters; they are only reduced
+ * modulo the buffer size (by masking) when the buffer is indexed.
+ * The buffer is empty when head == tail and full when
+ * tail - head == mask + 1, so every slot is usable.
+ *
+ * Only the producer writes tail and only the consumer writes head.
+ * Each side publishes its index after the data it covers has been
+ * moved, so one producer and one consumer (e.g. an ISR and the main
+ * loop) can share a ring_fifo without disabling interrupts.  On the
+ * single core Cortex-M3 a compiler barrier is all the ordering needed.
+ */
+typedef struct ring_fifo {
+    uint8 *buf;             /**< Buffer items are stored into */
+    volatile uint32 head;   /**< Count of items removed (consumer) */
+    volatile uint32 tail;   /**< Count of items inserted (producer) */
+    uint32 mask;            /**< Buffer size minus one */
+} ring_fifo;
+
+#define rb_fifo_barrier()   __asm__ __volatile__("" ::: "memory")
+
+/**
+ * @brief Initialise a power of two ring buffer.
+ * @param rb   Instance to initialise
+ * @param size Number of items in buf; must be a power of two.
+ * @param buf  Buffer to store items into
+ */
+static inline void rb_fifo_init(ring_fifo *rb, uint32 size, uint8 *buf) {
+    rb->head = 0;
+    rb->tail = 0;
+    rb->mask = size - 1;
+    rb->buf = buf;
+}
+
+/**
+ * @brief Return the number of items stored in a ring_fifo.
+ * @param rb Buffer whose items to count.
+ */
+static inline uint32 rb_fifo_count(ring_fifo *rb) {
+    return rb->tail - rb->head;
+}
+
+/**
+ * @brief Return the number of free slots in a ring_fifo.
+ * @param rb Buffer to check.
+ */
+static inline uint32 rb_fifo_space(ring_fifo *rb) {
+    return rb->mask + 1 - (rb->tail - rb->head);
+}
+
+/**
+ * @brief Insert one item (producer side).
+ * @param rb Buffer to insert into.
+ * @param element Value to insert.
+ * @return 1 if the item was inserted, 0 if the buffer was full.
+ */
+static inline int rb_fifo_put(ring_fifo *rb, uint8 element) {
+    uint32 tail = rb->tail;
+    if (tail - rb->head > rb->mask) {
+        return 0;
+    }
+    rb->buf[tail & rb->mask] = element;
+    rb_fifo_barrier();
+    rb->tail = tail + 1;
+    return 1;
+}
+
+/**
+ * @brief Remove one item (consumer side).
+ * @param rb Buffer to remove from.
+ * @return The item, or -1 if the buffer was empty.
+ */
+static inline int16 rb_fifo_get(ring_fifo *rb) {
+    uint32 head = rb->head;
+    uint8 ch;
+    if (head == rb->tail) {
+        return -1;
+    }
+    ch = rb->buf[head & rb->mask];
+    rb_fifo_barrier();
+    rb->head = head + 1;
+    return ch;
+}
+
+/**
+ * @brief Discard all items (consumer side).
+ * @param rb Ring buffer to discard all items from.
+ */
+static inline void rb_fifo_reset(ring_fifo *rb) {
+    rb->head = rb->tail;
+}
+
+/**
+ * @brief Insert up to len items (producer side).
+ *
+ * Copies as much of src as fits, using at most two memcpy calls.
+ *
+ * @param rb Buffer to insert into.
+ * @param src Items to insert.
+ * @param len Number of items in src.
+ * @return Number of items inserted.
+ */
+static inline uint32 rb_write_n(ring_fifo *rb, const uint8 *src, uint32 len) {
+    uint32 tail = rb->tail;
+    uint32 space = rb->mask + 1 - (tail - rb->head);
+    uint32 off = tail & rb->mask;
+    uint32 first;
+
+    if (len > space) {
+        len = space;
+    }
+    first = rb->mask + 1 - off;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(rb->buf + off, src, first);
+    memcpy(rb->buf, src + first, len - first);
+    rb_fifo_barrier();
+    rb->tail = tail + len;
+    return len;
+}
+
+/**
+ * @brief Copy out up to len items without removing them.
+ * @param rb Buffer to copy from.
+ * @param dst Where to copy the items.
+ * @param len Maximum number of items to copy.
+ * @return Number of items copied.
+ */
+static inline uint32 rb_peek_n(ring_fifo *rb, uint8 *dst, uint32 len) {
+    uint32 head = rb->head;
+    uint32 count = rb->tail - head;
+    uint32 off = head & rb->mask;
+    uint32 first;
+
+    if (len > count) {
+        len = count;
+    }
+    rb_fifo_barrier();
+    first = rb->mask + 1 - off;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(dst, rb->buf + off, first);
+    memcpy(dst + first, rb->buf, len - first);
+    return len;
+}
+
+/**
+ * @brief Remove up to len items (consumer side).
+ * @param rb Buffer to remove from.
+ * @param dst Where to copy the items.
+ * @param len Maximum number of items to remove.
+ * @return Number of items removed.
+ */
+static inline uint32 rb_read_n(ring_fifo *rb, uint8 *dst, uint32 len) {
+    len = rb_peek_n(rb, dst, len);
+    rb_fifo_barrier();
+    rb->head += len;
+    return len;
+}
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
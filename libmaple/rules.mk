@@ -46,8 +46,13 @@ cSRCS_$(d) += util.c
 cSRCS_$(d) += i2c.c
 cSRCS_$(d) += i2c_hw.c
 cSRCS_$(d) += iic.c
+cSRCS_$(d) += iic_dma.c
+cSRCS_$(d) += regmap.c
 cSRCS_$(d) += serial.c
 cSRCS_$(d) += serial_usb.c
+cSRCS_$(d) += serial_mem.c
+cSRCS_$(d) += fmt.c
+cSRCS_$(d) += tlog.c
 cSRCS_$(d) += time.c
 cSRCS_$(d) += digital.c
 cSRCS_$(d) += digital_f1.c
@@ -39,6 +39,7 @@
 #include "board.h"
 
 #include "serial.h"
+#include "fmt.h"
 
 #include <libmaple/libmaple.h>
 #include <libmaple/gpio.h>
@@ -47,23 +48,22 @@
 
 void usb_serial_wait ( void );
 void usb_serial_wait_t ( int );
-char usb_serial_getc ( void );
-void usb_serial_putc ( char );
+void usb_serial_write ( const char *, int );
+int usb_serial_read ( char *, int );
 int usb_serial_available ( void );
 
 // pins are defined in wirish/boards/maple_mini/include/board/board.h
 
-/* The STM32F1 has 3 uarts (1,2,3) and USB */
-#define NUM_SERIAL	4
-
-enum serial_type{ HW_UART, USB_UART };
-
 /* slot 0 is for USB
  * 1,2,3 are for HW
+ * 4 is for the memory backend (see serial_mem.c)
+ * Each slot points at the ops for its backend, and everything
+ *  above the ops deals in whole buffers.
  */
 struct serial_info {
-	enum serial_type type;	/* 0 = HW, 1 = USB */
-	usart_dev *dev;
+	struct serial_ops *ops;
+	void *arg;		/* handed to the ops */
+	usart_dev *dev;		/* NULL unless HW */
 	int tx_pin;
 	int rx_pin;
 };
@@ -72,6 +72,84 @@ static struct serial_info serial_info[NUM_SERIAL];
 
 /* -------------------------------------------------- */
 
+/* HW uart backend, arg is the usart_dev */
+
+static void
+hw_write ( void *arg, const char *buf, int len )
+{
+	usart_write ( (usart_dev *) arg, (const uint8 *) buf, len );
+}
+
+static int
+hw_read ( void *arg, char *buf, int len )
+{
+	return usart_rx ( (usart_dev *) arg, (uint8 *) buf, len );
+}
+
+static int
+hw_poll ( void *arg )
+{
+	return usart_data_available ( (usart_dev *) arg );
+}
+
+static void
+hw_flush ( void *arg )
+{
+	usart_reset_rx ( (usart_dev *) arg );
+}
+
+static void
+hw_drain ( void *arg )
+{
+	usart_tx_drain ( (usart_dev *) arg );
+}
+
+static struct serial_ops hw_ops = {
+	hw_write, hw_read, hw_poll, hw_flush, hw_drain
+};
+
+/* USB backend, no arg.
+ * Writes are synchronous, so there is nothing to drain,
+ *  and we cannot flush the USB.
+ */
+
+static void
+usb_write ( void *arg, const char *buf, int len )
+{
+	usb_serial_write ( buf, len );
+}
+
+static int
+usb_read ( void *arg, char *buf, int len )
+{
+	return usb_serial_read ( buf, len );
+}
+
+static int
+usb_poll ( void *arg )
+{
+	return usb_serial_available ();
+}
+
+static struct serial_ops usb_ops = {
+	usb_write, usb_read, usb_poll, NULL, NULL
+};
+
+/* Hook any backend to a slot */
+int
+serial_attach ( int fd, struct serial_ops *ops, void *arg )
+{
+	if ( fd < 0 || fd >= NUM_SERIAL )
+	    return -1;
+
+	serial_info[fd].ops = ops;
+	serial_info[fd].arg = arg;
+	serial_info[fd].dev = NULL;
+	return fd;
+}
+
+/* -------------------------------------------------- */
+
 /* F1 MCUs have no GPIO_AFR[HL], so turn off PWM if there's a conflict
  * on this GPIO bit. */
 static void
@@ -84,6 +162,19 @@ disable_timer_if_necessary ( timer_dev *dev, uint8 ch)
 
 int
 serial_begin ( int port, int baud )
+{
+	return serial_begin_sized ( port, baud, 0, 0 );
+}
+
+/* Like serial_begin, but you get to pick the buffer sizes.
+ * Sizes must be powers of two, 0 means the default.
+ * The buffers come from the usart arena the first time a port
+ *  is set up, so a GPS can have 1024 bytes of RX and the console
+ *  a big TX buffer, and ports you never use cost nothing.
+ * (Ignored for USB)
+ */
+int
+serial_begin_sized ( int port, int baud, int rx_size, int tx_size )
 {
 	int fd;
 	struct serial_info *si;
@@ -96,8 +187,18 @@ serial_begin ( int port, int baud )
 	/* It used to be different */
 	fd = port;
 
+	/* ignores baud rate */
+	if ( port == SERIAL_USB ) {
+	    serial_attach ( fd, &usb_ops, NULL );
+	    usb_serial_wait ();
+	    return fd;
+	}
+
+	/* use serial_mem_begin for this */
+	if ( port == SERIAL_MEM )
+	    return -1;
+
 	si = &serial_info[fd];
-	si->type = HW_UART;
 
 	if ( port == SERIAL_1 ) {
 	    si->dev = USART1;
@@ -115,13 +216,6 @@ serial_begin ( int port, int baud )
 	    si->rx_pin = BOARD_USART3_RX_PIN;
 	}
 
-	/* ignores baud rate */
-	if ( port == SERIAL_USB ) {
-	    si->type = USB_UART;
-	    usb_serial_wait ();
-	    return fd;
-	}
-
 	ASSERT(baud <= si->dev->max_baud);
 
 	if (baud > si->dev->max_baud) {
@@ -138,10 +232,16 @@ serial_begin ( int port, int baud )
                              txi->gpio_device, txi->gpio_bit,
                              0);
 
+	if ( usart_set_buffers ( si->dev, NULL, rx_size, NULL, tx_size ) < 0 )
+	    return -1;
+
 	usart_init ( si->dev );
 	usart_set_baud_rate ( si->dev, USART_USE_PCLK, baud );
 	usart_enable ( si->dev );
 
+	si->ops = &hw_ops;
+	si->arg = si->dev;
+
 	return fd;
 }
 
@@ -149,10 +249,16 @@ serial_begin ( int port, int baud )
 void
 serial_write ( int fd, int ch )
 {
-	if ( serial_info[fd].type == USB_UART )
-	    usb_serial_putc ( ch );
-	else
-	    usart_putc ( serial_info[fd].dev, ch );
+	char c = ch;
+
+	serial_info[fd].ops->write ( serial_info[fd].arg, &c, 1 );
+}
+
+/* Send a buffer, no monkey business */
+void
+serial_write_buf ( int fd, const char *buf, int len )
+{
+	serial_info[fd].ops->write ( serial_info[fd].arg, buf, len );
 }
 
 /* This is what we really want to use */
@@ -168,34 +274,118 @@ serial_putc ( int fd, int ch )
 int
 serial_available ( int fd )
 {
-	if ( serial_info[fd].type == USB_UART )
-	    return usb_serial_available ();
-	else
-	    return usart_data_available ( serial_info[fd].dev );
+	return serial_info[fd].ops->poll ( serial_info[fd].arg );
+}
+
+/* Neither does this, it hands back whatever is there (maybe 0) */
+int
+serial_read_buf ( int fd, char *buf, int len )
+{
+	return serial_info[fd].ops->read ( serial_info[fd].arg, buf, len );
 }
 
 void
 serial_flush ( int fd )
 {
-	if ( serial_info[fd].type == HW_UART )
-	    usart_reset_rx ( serial_info[fd].dev );
-	/* Cannot flush the USB */
+	struct serial_info *si = &serial_info[fd];
+
+	if ( si->ops->flush )
+	    si->ops->flush ( si->arg );
+}
+
+/* Output to a HW serial port goes into a buffer and gets sent
+ * by the TX interrupt.  This waits until it has all gone out,
+ * which you want before (say) a reset or changing the baud rate.
+ * The USB writes are already synchronous, so nothing to do there.
+ */
+void
+serial_drain ( int fd )
+{
+	struct serial_info *si = &serial_info[fd];
+
+	if ( si->ops->drain )
+	    si->ops->drain ( si->arg );
+}
+
+/* Switch a HW serial port to receive by circular DMA.
+ * Call this after serial_begin().
+ * Worth doing at high baud rates or with bursty input like a GPS,
+ *  since you get an interrupt per half buffer (or per burst)
+ *  rather than one per byte.
+ * Returns 0 if all is well, -1 if the port cannot do it.
+ */
+int
+serial_rx_dma ( int fd )
+{
+	if ( ! serial_info[fd].dev )
+	    return -1;
+	return usart_rx_dma_enable ( serial_info[fd].dev );
+}
+
+/* Put a HW serial port into line mode.
+ * The RX interrupt collects lines ending in any of the characters
+ *  in terms (e.g. "\r\n") into nbufs buffers of max bytes
+ *  (including the null), and serial_readline hands them over whole.
+ * The buffers are pool (nbufs * max bytes), or if pool is NULL
+ *  they come from the usart arena.
+ * Lines too long to fit, or that show up when all the buffers
+ *  are full, get tossed and counted.
+ * The RX ring sits idle in line mode, so a port that will only
+ *  ever do lines can be opened with a small one.
+ * Returns 0 if all is well, -1 if not (bad sizes, or no room
+ *  left in the arena), and then serial_readline never has a line.
+ */
+int
+serial_lines ( int fd, char *pool, int nbufs, int max, const char *terms )
+{
+	if ( ! serial_info[fd].dev )
+	    return -1;
+	return usart_set_lines ( serial_info[fd].dev, pool, nbufs, max, terms );
+}
+
+/* Does not block.
+ * Returns the length of the next line and points *line at it,
+ *  or returns 0 if there is no complete line yet.
+ * The line is yours until the next call.
+ */
+int
+serial_readline ( int fd, char **line )
+{
+	if ( ! serial_info[fd].dev )
+	    return 0;
+	return usart_readline ( serial_info[fd].dev, line );
 }
 
-/* This blocks for a HW serial port */
+/* How many lines have been thrown away */
+int
+serial_line_overflows ( int fd )
+{
+	if ( ! serial_info[fd].dev )
+	    return 0;
+	return serial_info[fd].dev->lines.overflows;
+}
+
+/* Decide what to do when the TX buffer is full.
+ * SERIAL_TX_BLOCK (the default) waits for room,
+ * SERIAL_TX_DROP throws away what will not fit, which is handy
+ *  for debug chatter that must never hold up the real work.
+ */
+void
+serial_tx_policy ( int fd, int policy )
+{
+	if ( serial_info[fd].dev )
+	    usart_set_tx_policy ( serial_info[fd].dev, policy );
+}
+
+/* This blocks */
 uint8
 serial_getc ( int fd )
 {
-	int rv;
+	struct serial_info *si = &serial_info[fd];
+	char rv;
 
-	if ( serial_info[fd].type == USB_UART ) {
-	    rv = usb_serial_getc ();
-	} else {
-	    // avoid confusion
-	    while ( ! serial_available ( fd ) )
-		;
-	    rv = usart_getc ( serial_info[fd].dev );
-	}
+	while ( si->ops->read ( si->arg, &rv, 1 ) == 0 )
+	    ;
 
 	if ( rv == '\r' )
 	    rv = '\n';
@@ -213,11 +403,40 @@ serial_read ( int fd )
 /* The following used to be in print.c, but that entire file
  * has been copied into here and gotten rid of.
  */
+/* Hand the backend whole runs of text in one call,
+ * rather than a call per character.
+ * Each newline becomes "\n\r", as in serial_putc.
+ * This is also the sink for printf (see fmt.c), so arg is
+ *  our serial_info entry.
+ */
+static void
+serial_put_text ( void *arg, const char *str, int len )
+{
+	struct serial_info *si = arg;
+	const char *p;
+	const char *end = str + len;
+
+	while ( str < end ) {
+	    for ( p = str; p < end && *p != '\n'; p++ )
+		;
+	    if ( p < end ) {
+		si->ops->write ( si->arg, str, p - str + 1 );
+		si->ops->write ( si->arg, "\r", 1 );
+		p++;
+	    } else
+		si->ops->write ( si->arg, str, p - str );
+	    str = p;
+	}
+}
+
 void
 serial_puts ( int fd, char *str )
 {
-    while (*str)
-        serial_putc ( fd, *str++ );
+	const char *p;
+
+	for ( p = str; *p; p++ )
+	    ;
+	serial_put_text ( &serial_info[fd], str, p - str );
 }
 
 #ifdef notdef
@@ -285,168 +504,47 @@ serial_print_num_base ( int fd, int n, uint8 base)
 /* -------------------------------------------------- */
 /* -------------------------------------------------- */
 
-/* Here I develop a simple printf.
- * It only has 3 triggers:
- *  %s to inject a string
- *  %d to inject a decimal number
- *  %h to inject a 32 bit hex value as xxxxyyyy
+/* The formatting itself is done by fmt_vformat (see fmt.c),
+ * which hands us the output a piece at a time as it goes.
+ * There is no buffer here, so no limit on how long a line can be,
+ *  and the stack use is small and fixed, which matters when this
+ *  gets called from deep down (or from an interrupt handler).
  */
 
-#define PRINTF_BUF_SIZE 128
-
-#define PUTCHAR(x)      if ( buf <= end ) *buf++ = (x)
-
-static const char hex_table[] = "0123456789ABCDEF";
-
-// #define HEX(x)  ((x)<10 ? '0'+(x) : 'A'+(x)-10)
-#define HEX(x)  hex_table[(x)]
-
-#ifdef notdef
-static char *
-sprintnb ( char *buf, char *end, int n, int b)
-{
-        char prbuf[16];
-        register char *cp;
-
-        if (b == 10 && n < 0) {
-            PUTCHAR('-');
-            n = -n;
-        }
-        cp = prbuf;
-
-        do {
-            // *cp++ = "0123456789ABCDEF"[n%b];
-            *cp++ = hex_table[n%b];
-            n /= b;
-        } while (n);
-
-        do {
-            PUTCHAR(*--cp);
-        } while (cp > prbuf);
-
-        return buf;
-}
-#endif
-
-static char *
-sprintn ( char *buf, char *end, int n )
-{
-        char prbuf[16];
-        char *cp;
-
-        if ( n < 0 ) {
-            PUTCHAR('-');
-            n = -n;
-        }
-        cp = prbuf;
-
-        do {
-            // *cp++ = "0123456789"[n%10];
-            *cp++ = hex_table[n%10];
-            n /= 10;
-        } while (n);
-
-        do {
-            PUTCHAR(*--cp);
-        } while (cp > prbuf);
-
-        return buf;
-}
-
-static char *
-shex2( char *buf, char *end, int val )
-{
-        PUTCHAR( HEX((val>>4)&0xf) );
-        PUTCHAR( HEX(val&0xf) );
-        return buf;
-}
-
-#ifdef notdef
-static char *
-shex3( char *buf, char *end, int val )
-{
-        PUTCHAR( HEX((val>>8)&0xf) );
-        return shex2(buf,end,val);
-}
-
-static char *
-shex4( char *buf, char *end, int val )
-{
-        buf = shex2(buf,end,val>>8);
-        return shex2(buf,end,val);
-}
-#endif
-
-static char *
-shex8( char *buf, char *end, int val )
-{
-        buf = shex2(buf,end,val>>24);
-        buf = shex2(buf,end,val>>16);
-        buf = shex2(buf,end,val>>8);
-        return shex2(buf,end,val);
-}
-
-static void
-asnprintf (char *abuf, unsigned int size, const char *fmt, va_list args)
-{
-    char *buf, *end;
-    int c;
-    char *p;
-
-    buf = abuf;
-    end = buf + size - 1;
-    if (end < buf - 1) {
-        end = ((void *) -1);
-        size = end - buf + 1;
-    }
-
-    while ( c = *fmt++ ) {
-	if ( c != '%' ) {
-            PUTCHAR(c);
-            continue;
-        }
-	c = *fmt++;
-	if ( c == 'd' ) {
-	    buf = sprintn ( buf, end, va_arg(args,int) );
-	    continue;
-	}
-	if ( c == 'x' ) {
-	    buf = shex2 ( buf, end, va_arg(args,int) & 0xff );
-	    continue;
-	}
-	if ( c == 'h' ) {
-	    buf = shex8 ( buf, end, va_arg(args,int) );
-	    continue;
-	}
-	if ( c == 'c' ) {
-            PUTCHAR( va_arg(args,int) );
-	    continue;
-	}
-	if ( c == 's' ) {
-	    p = va_arg(args,char *);
-	    // printf ( "Got: %s\n", p );
-	    while ( c = *p++ )
-		PUTCHAR(c);
-	    continue;
-	}
-    }
-    if ( buf > end )
-	buf = end;
-    PUTCHAR('\0');
-}
-
-
 void
 serial_printf ( int fd, char *fmt, ... )
 {
-	char buf[PRINTF_BUF_SIZE];
         va_list args;
 
         va_start ( args, fmt );
-        asnprintf ( buf, PRINTF_BUF_SIZE, fmt, args );
+        fmt_vformat ( serial_put_text, &serial_info[fd], fmt, args );
         va_end ( args );
+}
 
-        serial_puts ( fd, buf );
+/* Show the counters for a HW serial port on the console.
+ * The high water marks say how close the buffers came to filling,
+ *  which is what you want to know when picking buffer sizes.
+ * If ore climbs, interrupts are being held off too long;
+ *  if drops climb, the reader is not keeping up.
+ */
+void
+serial_show_stats ( int fd )
+{
+	usart_dev *dev = serial_info[fd].dev;
+	usart_stats st;
+
+	if ( ! dev ) {
+	    printf ( "serial %d: no stats\n", fd );
+	    return;
+	}
+
+	usart_get_stats ( dev, &st );
+	printf ( "serial %d: rx %u, drops %u, rx hwm %u/%u\n", fd,
+	    st.rx_bytes, st.rx_drops, st.rx_hwm, dev->rb->mask + 1 );
+	printf ( "serial %d: ore %u, fe %u, ne %u\n", fd,
+	    st.ore, st.fe, st.ne );
+	printf ( "serial %d: tx %u, tx hwm %u/%u, dma errors %u\n", fd,
+	    st.tx_bytes, st.tx_hwm, dev->wb->mask + 1, st.tx_dma_errors );
 }
 
 /* -------------------------------------------------- */
@@ -493,14 +591,11 @@ puts ( char *msg )
 void
 printf ( char *fmt, ... )
 {
-	char buf[PRINTF_BUF_SIZE];
         va_list args;
 
         va_start ( args, fmt );
-        asnprintf ( buf, PRINTF_BUF_SIZE, fmt, args );
+        fmt_vformat ( serial_put_text, &serial_info[std_serial], fmt, args );
         va_end ( args );
-
-        serial_puts ( std_serial, buf );
 }
 
 /* The limit is absurd, so take care */
@@ -510,7 +605,7 @@ sprintf ( char *buf, char *fmt, ... )
         va_list args;
 
         va_start ( args, fmt );
-        asnprintf ( buf, 256, fmt, args );
+        fmt_vsnprintf ( buf, 256, fmt, args );
         va_end ( args );
 }
 
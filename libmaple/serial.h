@@ -39,9 +39,33 @@
 #define SERIAL_1	1
 #define SERIAL_2	2
 #define SERIAL_3	3
+#define SERIAL_MEM	4
+
+/* The STM32F1 has 3 uarts (1,2,3), USB, and the memory backend */
+#define NUM_SERIAL	5
+
+/* What a backend has to provide.
+ * Reads do not block and return the count read (maybe 0).
+ * Poll returns the count waiting to be read.
+ * Flush (discard input) and drain (wait for output) may be NULL.
+ */
+struct serial_ops {
+	void (*write) ( void *, const char *, int );
+	int (*read) ( void *, char *, int );
+	int (*poll) ( void * );
+	void (*flush) ( void * );
+	void (*drain) ( void * );
+};
+
+#define SERIAL_TX_BLOCK	0
+#define SERIAL_TX_DROP	1
 
 int serial_begin ( int port, int baud );
+int serial_begin_sized ( int port, int baud, int rx_size, int tx_size );
+int serial_attach ( int fd, struct serial_ops *ops, void *arg );
 void serial_write ( int fd, int ch );
+void serial_write_buf ( int fd, const char *buf, int len );
+int serial_read_buf ( int fd, char *buf, int len );
 void serial_putc ( int fd, int ch );
 void serial_puts ( int fd, char *str );
 void serial_printf ( int fd, char *str, ... );
@@ -51,9 +75,20 @@ void serial_print_hex ( int fd, int num );
 void serial_print_num_base ( int fd, int n, uint8 base);
 int serial_available ( int fd );
 void serial_flush ( int fd );
+void serial_drain ( int fd );
+void serial_tx_policy ( int fd, int policy );
+int serial_rx_dma ( int fd );
+void serial_show_stats ( int fd );
+int serial_lines ( int fd, char *pool, int nbufs, int max, const char *terms );
+int serial_readline ( int fd, char **line );
+int serial_line_overflows ( int fd );
 uint8 serial_read ( int fd );
 uint8 serial_getc ( int fd );
 
+int serial_mem_begin ( char *rx_buf, int rx_size, char *tx_buf, int tx_size );
+int serial_mem_inject ( const char *buf, int len );
+int serial_mem_collect ( char *buf, int len );
+
 void console_init ( void );
 void set_std_serial ( int );
 int getc ( void );
@@ -0,0 +1,113 @@
+/* serial_mem.c
+ *
+ * A serial "port" that is just memory.
+ *
+ * It plugs into the serial fd layer like the USB and HW uarts,
+ *  so printf and friends can be pointed at it with set_std_serial()
+ *  and the whole serial stack exercised without any hardware.
+ * The far end is played by serial_mem_inject (which puts bytes
+ *  where serial_getc will find them) and serial_mem_collect
+ *  (which picks up what was written).
+ * If you do not give it a TX buffer, it loops back, and what
+ *  you write is what you read.
+ *
+ * Buffer sizes must be powers of two.
+ * Writes do not block; anything that does not fit is dropped.
+ */
+
+#include <libmaple/ring_buffer.h>
+
+#include "serial.h"
+
+struct serial_mem {
+	ring_fifo rx;
+	ring_fifo tx;
+	ring_fifo *out;		/* where writes go */
+};
+
+static struct serial_mem serial_mem;
+
+static int
+mem_pow2 ( int size )
+{
+	return size > 0 && ! (size & (size - 1));
+}
+
+static void
+mem_write ( void *arg, const char *buf, int len )
+{
+	struct serial_mem *mp = arg;
+
+	rb_write_n ( mp->out, (const uint8 *) buf, len );
+}
+
+static int
+mem_read ( void *arg, char *buf, int len )
+{
+	struct serial_mem *mp = arg;
+
+	return rb_read_n ( &mp->rx, (uint8 *) buf, len );
+}
+
+static int
+mem_poll ( void *arg )
+{
+	struct serial_mem *mp = arg;
+
+	return rb_fifo_count ( &mp->rx );
+}
+
+static void
+mem_flush ( void *arg )
+{
+	struct serial_mem *mp = arg;
+
+	rb_fifo_reset ( &mp->rx );
+}
+
+static struct serial_ops mem_ops = {
+	mem_write, mem_read, mem_poll, mem_flush, NULL
+};
+
+/* Returns the fd (SERIAL_MEM), or -1 if the sizes are no good */
+int
+serial_mem_begin ( char *rx_buf, int rx_size, char *tx_buf, int tx_size )
+{
+	struct serial_mem *mp = &serial_mem;
+
+	if ( ! mem_pow2 ( rx_size ) )
+	    return -1;
+	if ( tx_buf && ! mem_pow2 ( tx_size ) )
+	    return -1;
+
+	rb_fifo_init ( &mp->rx, rx_size, (uint8 *) rx_buf );
+	if ( tx_buf ) {
+	    rb_fifo_init ( &mp->tx, tx_size, (uint8 *) tx_buf );
+	    mp->out = &mp->tx;
+	} else
+	    mp->out = &mp->rx;
+
+	return serial_attach ( SERIAL_MEM, &mem_ops, mp );
+}
+
+/* The far end sends us something.
+ * Returns how much fit.
+ */
+int
+serial_mem_inject ( const char *buf, int len )
+{
+	return rb_write_n ( &serial_mem.rx, (const uint8 *) buf, len );
+}
+
+/* The far end picks up what we wrote.
+ * (In loopback mode there is nothing here, it all went to RX).
+ */
+int
+serial_mem_collect ( char *buf, int len )
+{
+	if ( serial_mem.out != &serial_mem.tx )
+	    return 0;
+	return rb_read_n ( &serial_mem.tx, (uint8 *) buf, len );
+}
+
+/* THE END */
@@ -184,6 +184,13 @@ usb_serial_available ( void )
     return usb_cdcacm_data_available();
 }
 
+/* Does not block, returns what is there (maybe 0) */
+int
+usb_serial_read ( char *buf, int len )
+{
+    return usb_cdcacm_rx ( (uint8 *) buf, len );
+}
+
 /* blocks */
 static int
 usb_serial_readbuf ( void *buf, int len )
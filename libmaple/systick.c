@@ -67,7 +67,7 @@ typedef struct systick_reg_map {
 #define SYSTICK_CVR_TENMS               0xFFFFFF
 
 volatile uint32 systick_uptime_millis;
-static void (*systick_user_callback)(void);
+static systick_callback_func systick_user_callback;
 
 /**
  * @brief Initialize and enable SysTick.
@@ -105,9 +105,15 @@ void systick_enable() {
  * @brief Attach a callback to be called from the SysTick exception handler.
  *
  * To detach a callback, call this function again with a null argument.
+ *
+ * @return The callback that was attached before, so a new one can
+ *         chain to it.
  */
-void systick_attach_callback(void (*callback)(void)) {
+systick_callback_func systick_attach_callback(systick_callback_func callback) {
+    systick_callback_func old = systick_user_callback;
+
     systick_user_callback = callback;
+    return old;
 }
 
 /**
@@ -52,7 +52,8 @@ static inline uint32 systick_uptime(void) {
 void systick_init(uint32 reload_val);
 void systick_disable();
 void systick_enable();
-void systick_attach_callback(void (*)(void));
+typedef void (*systick_callback_func)(void);
+systick_callback_func systick_attach_callback(systick_callback_func);
 
 uint32 systick_get_count(void);
 uint32 systick_check_underflow(void);
@@ -0,0 +1,185 @@
+/* tlog.c
+ *
+ * Deferred trace logging.
+ *
+ * A printf from an interrupt handler takes long enough to change
+ *  the very timing you are trying to look at (and a printf in the
+ *  i2c interrupt is a fine way to make i2c bugs go away).
+ * So here a log call does none of the work.  It puts the "ID" of the
+ *  format string, a cycle count timestamp, and up to 4 arguments
+ *  as raw 32 bit words into a ring in RAM, which is a couple dozen
+ *  instructions.  Later, when nothing is in a hurry, tlog_drain()
+ *  sends the records out a serial port (or USB) as binary, and
+ *  support/scripts/tlog.py on the host turns them back into text,
+ *  getting the format strings out of the ELF file.
+ *
+ * The format strings never take up any room on the chip.  They go
+ *  into the .tlog_fmt section, which the linker script marks INFO
+ *  (there in the ELF file, but never loaded) starting at address 0,
+ *  so the address of a string is just its offset in that section.
+ *
+ * Each record is:
+ *  header - TLOG_MAGIC, the number of arguments, and the ID
+ *  timestamp - DWT cycle counter
+ *  args - 0 to 4 words
+ *
+ * Any number of writers (main line code and interrupts at any level)
+ *  can log at once without disabling interrupts.  A writer reserves
+ *  space by bumping tlog_head with ldrex/strex, fills in the record,
+ *  and writes the header last.  The reader stops at a slot that is
+ *  still 0, since that record has been reserved but not finished,
+ *  and zeros the slots it has read.
+ * If the ring is full, the record is dropped and counted, and the
+ *  next drain tells the host how many went missing.
+ */
+
+#include <libmaple/libmaple_types.h>
+
+#include "dwt.h"
+#include "serial.h"
+#include "tlog.h"
+
+/* In words, and a power of 2 */
+#ifndef TLOG_SIZE
+#define TLOG_SIZE	256
+#endif
+
+#define TLOG_MASK	(TLOG_SIZE - 1)
+
+static uint32 tlog_ring[TLOG_SIZE];
+static volatile uint32 tlog_head;
+static volatile uint32 tlog_tail;
+static volatile uint32 tlog_dropped;
+
+static inline uint32
+ldrex ( volatile uint32 *addr )
+{
+	uint32 rv;
+
+	asm volatile ( "ldrex %0, [%1]" : "=r" (rv) : "r" (addr) );
+	return rv;
+}
+
+/* Returns 0 if it worked */
+static inline uint32
+strex ( volatile uint32 *addr, uint32 val )
+{
+	uint32 rv;
+
+	asm volatile ( "strex %0, %2, [%1]" : "=&r" (rv) : "r" (addr), "r" (val) : "memory" );
+	return rv;
+}
+
+static inline void
+clrex ( void )
+{
+	asm volatile ( "clrex" ::: "memory" );
+}
+
+static void
+tlog_count_drop ( void )
+{
+	uint32 n;
+
+	do {
+	    n = ldrex ( &tlog_dropped );
+	} while ( strex ( &tlog_dropped, n + 1 ) );
+}
+
+/* Start the cycle counter we use for timestamps */
+void
+tlog_init ( void )
+{
+	dwt_init ();
+}
+
+/* Use the TLOG macro rather than calling this */
+void
+tlog_put ( uint32 hdr, uint32 a0, uint32 a1, uint32 a2, uint32 a3 )
+{
+	uint32 n = TLOG_NARGS ( hdr ) + 2;
+	uint32 h;
+
+	do {
+	    h = ldrex ( &tlog_head );
+	    if ( h + n - tlog_tail > TLOG_SIZE ) {
+		clrex ();
+		tlog_count_drop ();
+		return;
+	    }
+	} while ( strex ( &tlog_head, h + n ) );
+
+	tlog_ring[(h+1) & TLOG_MASK] = dwt_cycles ();
+
+	switch ( n ) {
+	    case 6:
+		tlog_ring[(h+5) & TLOG_MASK] = a3;
+		/* fall through */
+	    case 5:
+		tlog_ring[(h+4) & TLOG_MASK] = a2;
+		/* fall through */
+	    case 4:
+		tlog_ring[(h+3) & TLOG_MASK] = a1;
+		/* fall through */
+	    case 3:
+		tlog_ring[(h+2) & TLOG_MASK] = a0;
+	}
+
+	/* The header last, this makes the record visible */
+	asm volatile ( "" ::: "memory" );
+	tlog_ring[h & TLOG_MASK] = hdr;
+}
+
+/* Send whatever is in the ring out the given serial fd.
+ * Do this from the main loop, never from an interrupt,
+ *  and only from one place.
+ * Returns the number of records sent.
+ */
+int
+tlog_drain ( int fd )
+{
+	uint32 rec[TLOG_MAX_ARGS+2];
+	uint32 t, n, i;
+	int count = 0;
+
+	while ( (t = tlog_tail) != tlog_head ) {
+	    rec[0] = tlog_ring[t & TLOG_MASK];
+	    if ( ! rec[0] )
+		break;
+
+	    n = TLOG_NARGS ( rec[0] ) + 2;
+	    tlog_ring[t & TLOG_MASK] = 0;
+	    for ( i = 1; i < n; i++ ) {
+		rec[i] = tlog_ring[(t+i) & TLOG_MASK];
+		tlog_ring[(t+i) & TLOG_MASK] = 0;
+	    }
+
+	    asm volatile ( "" ::: "memory" );
+	    tlog_tail = t + n;
+
+	    serial_write_buf ( fd, (char *) rec, n * sizeof(uint32) );
+	    count++;
+	}
+
+	if ( tlog_dropped ) {
+	    do {
+		n = ldrex ( &tlog_dropped );
+	    } while ( strex ( &tlog_dropped, 0 ) );
+
+	    rec[0] = TLOG_HDR ( TLOG_ID_DROPS, 1 );
+	    rec[1] = dwt_cycles ();
+	    rec[2] = n;
+	    serial_write_buf ( fd, (char *) rec, 3 * sizeof(uint32) );
+	}
+
+	return count;
+}
+
+/* How many records are waiting to be reported as lost */
+uint32
+tlog_drops ( void )
+{
+	return tlog_dropped;
+}
+
+/* THE END */
@@ -0,0 +1,57 @@
+/* tlog.h
+ *
+ * Deferred trace logging, see tlog.c
+ *
+ * TLOG ( "xfer done: %d, sr1 = %h\n", rc, sr1 );
+ *
+ * Up to TLOG_MAX_ARGS arguments, each of which is kept as
+ *  a raw 32 bit value (so no %f, and %s only makes sense for
+ *  strings that live in flash).
+ * The format string itself never goes into flash, it goes into
+ *  the .tlog_fmt section of the ELF file, and what gets logged
+ *  is its offset in there.
+ */
+
+#ifndef _TLOG_H_
+#define _TLOG_H_
+
+#include <libmaple/libmaple_types.h>
+
+#define TLOG_MAX_ARGS	4
+
+/* The first word of a record.
+ * The magic keeps it from ever being 0 (which means "not done yet"
+ *  in the ring) and helps the host find its place in the stream.
+ */
+#define TLOG_MAGIC	0xA0000000
+#define TLOG_HDR(id,n)	(TLOG_MAGIC | ((n) << 24) | ((id) & 0xffffff))
+#define TLOG_NARGS(h)	(((h) >> 24) & 0xf)
+#define TLOG_ID(h)	((h) & 0xffffff)
+
+/* Not a format, says how many records got dropped */
+#define TLOG_ID_DROPS	0xffffff
+
+void tlog_init ( void );
+void tlog_put ( uint32, uint32, uint32, uint32, uint32 );
+int tlog_drain ( int );
+uint32 tlog_drops ( void );
+
+/* The first argument (0) is a dummy that keeps the GNU ##
+ * comma trick happy when there are no arguments at all.
+ */
+#define TLOG_COUNT(...)		_TLOG_COUNT(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define _TLOG_COUNT(x,a,b,c,d,n,...)	n
+#define TLOG_ARGS(...)		_TLOG_ARGS(0, ##__VA_ARGS__, 0, 0, 0, 0)
+#define _TLOG_ARGS(x,a,b,c,d,...)	(uint32) (a), (uint32) (b), (uint32) (c), (uint32) (d)
+
+#define TLOG(fmt, ...) \
+	do { \
+	    static const char _tlog_fmt[] \
+		__attribute__ ((section (".tlog_fmt"))) = fmt; \
+	    tlog_put ( TLOG_HDR ( (uint32) _tlog_fmt, TLOG_COUNT ( __VA_ARGS__ ) ), \
+		TLOG_ARGS ( __VA_ARGS__ ) ); \
+	} while ( 0 )
+
+#endif
+
+/* THE END */
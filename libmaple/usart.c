@@ -32,14 +32,102 @@
  * @brief Portable USART routines
  */
 
+#include <string.h>
+
 #include <libmaple/usart.h>
+#include <libmaple/bitband.h>
+#include <libmaple/scb.h>
+#include <libmaple/dma.h>
+#include "usart_private.h"
+
+/*
+ * Buffer arena
+ */
+
+__weak uint8 usart_arena[USART_ARENA_SIZE] __attribute__((aligned(4)));
+__weak uint32 usart_arena_size = USART_ARENA_SIZE;
+static uint32 usart_arena_used;
+
+/* Buffers are never given back; ports are set up once. */
+static uint8* usart_alloc(uint32 size) {
+    uint8 *buf;
+
+    if (size > usart_arena_size - usart_arena_used) {
+        return NULL;
+    }
+    buf = &usart_arena[usart_arena_used];
+    usart_arena_used += size;
+    return buf;
+}
+
+static inline int usart_pow2(uint32 size) {
+    return size && !(size & (size - 1));
+}
+
+/**
+ * @brief Give a serial port its RX and TX buffers.
+ *
+ * Call this before usart_init().  For each direction, a size of 0
+ * leaves that buffer alone (usart_init() will use the default size),
+ * and a NULL buffer with a nonzero size is taken from usart_arena
+ * (unless the port already has a buffer of that size).  Sizes must
+ * be powers of two.
+ *
+ * @param dev Serial port
+ * @param rx_buf RX buffer, or NULL to allocate one
+ * @param rx_size RX buffer size, or 0
+ * @param tx_buf TX buffer, or NULL to allocate one
+ * @param tx_size TX buffer size, or 0
+ * @return 0 on success, -1 on a bad size or if the arena is exhausted.
+ */
+int usart_set_buffers(usart_dev *dev,
+                      uint8 *rx_buf, uint32 rx_size,
+                      uint8 *tx_buf, uint32 tx_size) {
+    if ((rx_size && !usart_pow2(rx_size)) ||
+        (tx_size && !usart_pow2(tx_size))) {
+        return -1;
+    }
+    /* Setting a port up again with the same sizes reuses its buffers */
+    if (!rx_buf && dev->rb->buf && dev->rb->mask + 1 == rx_size) {
+        rx_buf = dev->rb->buf;
+    }
+    if (!tx_buf && dev->wb->buf && dev->wb->mask + 1 == tx_size) {
+        tx_buf = dev->wb->buf;
+    }
+    if (rx_size && !rx_buf && !(rx_buf = usart_alloc(rx_size))) {
+        return -1;
+    }
+    if (tx_size && !tx_buf && !(tx_buf = usart_alloc(tx_size))) {
+        return -1;
+    }
+    if (rx_size) {
+        rb_fifo_init(dev->rb, rx_size, rx_buf);
+    }
+    if (tx_size) {
+        rb_fifo_init(dev->wb, tx_size, tx_buf);
+    }
+    return 0;
+}
 
 /**
  * @brief Initialize a serial port.
+ *
+ * Ports that have no buffers yet get default sized ones from the
+ * arena.
+ *
  * @param dev         Serial port to be initialized
+ * @see usart_set_buffers()
  */
 void usart_init(usart_dev *dev) {
-    rb_init(dev->rb, USART_RX_BUF_SIZE, dev->rx_buf);
+    if (!dev->rb->buf) {
+        usart_set_buffers(dev, NULL, USART_RX_BUF_SIZE, NULL, 0);
+    }
+    if (!dev->wb->buf) {
+        usart_set_buffers(dev, NULL, 0, NULL, USART_TX_BUF_SIZE);
+    }
+    ASSERT(dev->rb->buf && dev->wb->buf);
+    rb_fifo_reset(dev->rb);
+    rb_fifo_reset(dev->wb);
     rcc_clk_enable(dev->clk_id);
     nvic_irq_enable(dev->irq_num);
 }
@@ -71,34 +159,260 @@ void usart_disable(usart_dev *dev) {
     /* FIXME this misbehaves (on F1) if you try to use PWM on TX afterwards */
     usart_reg_map *regs = dev->regs;
 
-    /* TC bit must be high before disabling the USART */
-    while((regs->CR1 & USART_CR1_UE) && !(regs->SR & USART_SR_TC))
-        ;
+    /* Queued bytes go out, and TC must be high, before disabling */
+    usart_tx_drain(dev);
 
     /* Disable UE */
     regs->CR1 &= ~USART_CR1_UE;
+    usart_rx_dma_disable(dev);
 
     /* Clean up buffer */
     usart_reset_rx(dev);
+    rb_fifo_reset(dev->wb);
 }
 
+/*
+ * The TX buffer and DMA queue have one consumer (the TX interrupt)
+ * but may have several producers, since printf is allowed from
+ * interrupt handlers.  Producers mask interrupts while they queue, so
+ * a handler cannot cut into a thread's write and reuse its slots
+ * (nvic_globalirq_save/restore).
+ */
+
 /**
  * @brief Nonblocking USART transmit
+ *
+ * Queues as much of buf as fits in the TX buffer and makes sure the
+ * TXE interrupt is enabled to send it.  May be called from thread and
+ * interrupt context alike.
+ *
  * @param dev Serial port to transmit over
  * @param buf Buffer to transmit
  * @param len Maximum number of bytes to transmit
- * @return Number of bytes transmitted
+ * @return Number of bytes queued
  */
 uint32 usart_tx(usart_dev *dev, const uint8 *buf, uint32 len) {
+    uint32 primask = nvic_globalirq_save();
+    uint32 txed = rb_write_n(dev->wb, buf, len);
+    uint32 n;
+
+    if (txed) {
+        bb_peri_set_bit(&dev->regs->CR1, USART_CR1_TXEIE_BIT, 1);
+        dev->stats.tx_bytes += txed;
+        if ((n = rb_fifo_count(dev->wb)) > dev->stats.tx_hwm) {
+            dev->stats.tx_hwm = n;
+        }
+    }
+    nvic_globalirq_restore(primask);
+    return txed;
+}
+
+/*
+ * True if the TX interrupt cannot run for us: we are in a handler
+ * (which may outrank the USART), or interrupts are masked.
+ */
+static int usart_irq_blocked(void) {
+    return nvic_globalirq_masked() ||
+        (SCB_BASE->ICSR & SCB_ICSR_VECTACTIVE);
+}
+
+/*
+ * Make some TX progress by polling, for when the interrupts cannot.
+ * Either move one byte from the TX buffer to the hardware, or, if a
+ * DMA transfer owns DR, do the completion handling once it is done.
+ * Interrupts are masked so the handlers cannot run meanwhile.
+ */
+static void usart_tx_poll(usart_dev *dev) {
     usart_reg_map *regs = dev->regs;
-    uint32 txed = 0;
+    uint32 primask = nvic_globalirq_save();
+    int16 ch;
+
+    if (dev->txq && dev->txq->active) {
+        uint8 bits = dma_get_isr_bits(dev->tx_dma, dev->tx_dma_ch);
+
+        if (bits & (DMA_ISR_TCIF | DMA_ISR_TEIF)) {
+            dma_clear_isr_bits(dev->tx_dma, dev->tx_dma_ch);
+            usart_tx_dma_done(dev, bits & DMA_ISR_TEIF);
+        }
+    } else {
+        while (!(regs->SR & USART_SR_TXE))
+            ;
+        ch = rb_fifo_get(dev->wb);
+        if (ch >= 0) {
+            regs->DR = ch;
+        } else if (dev->txq) {
+            usart_tx_dma_next(dev);
+        }
+    }
+    nvic_globalirq_restore(primask);
+}
+
+static inline uint32 usart_tx_dma_pending(usart_dev *dev) {
+    return dev->txq ? dev->txq->tail - dev->txq->head : 0;
+}
 
-    while ((regs->SR & USART_SR_TXE) && (txed < len)) {
-        regs->DR = buf[txed++];
+/**
+ * @brief Queue a buffer for transmission by DMA, without copying it.
+ *
+ * The buffer must stay untouched until done is called (from
+ * interrupt context).  Queued buffers are chained back to back by
+ * the DMA completion interrupt.  Bytes queued with usart_tx() are
+ * sent between DMA buffers, never in the middle of one.
+ *
+ * Only USART1-3 are supported, on DMA1 channels 4, 7 and 2.  The
+ * first call claims the channel (see dma_claim()) and keeps it.
+ *
+ * @param dev Serial port to transmit over
+ * @param buf Bytes to send
+ * @param len Number of bytes, 1 to 65535
+ * @param done Called once buf has been sent, or NULL
+ * @return 0 if queued, -1 if the queue is full, the request is bad,
+ *         or another driver has the channel
+ */
+int usart_tx_dma(usart_dev *dev, const uint8 *buf, uint32 len,
+                 usart_tx_done_fn done) {
+    usart_tx_queue *q = dev->txq;
+    usart_tx_desc *d;
+    uint32 primask;
+    uint32 tail;
+
+    if (!q || len == 0 || len > 0xFFFF) {
+        return -1;
+    }
+    if (!dev->tx_dma && _usart_tx_dma_init(dev) < 0) {
+        return -1;
+    }
+    primask = nvic_globalirq_save();
+    tail = q->tail;
+    if (tail - q->head >= USART_TX_DMA_QUEUE_LEN) {
+        nvic_globalirq_restore(primask);
+        return -1;
+    }
+    d = &q->desc[tail & (USART_TX_DMA_QUEUE_LEN - 1)];
+    d->buf = buf;
+    d->len = len;
+    d->done = done;
+    rb_fifo_barrier();
+    q->tail = tail + 1;
+    dev->stats.tx_bytes += len;
+
+    /* Let the TX interrupt start it once the TX buffer is empty */
+    bb_peri_set_bit(&dev->regs->CR1, USART_CR1_TXEIE_BIT, 1);
+    nvic_globalirq_restore(primask);
+    return 0;
+}
+
+/**
+ * @brief Start the next queued DMA buffer, if any.
+ *
+ * Interrupt context only: called when the TX buffer has run dry.
+ *
+ * @param dev Serial port
+ */
+void usart_tx_dma_next(usart_dev *dev) {
+    usart_tx_queue *q = dev->txq;
+    usart_tx_desc *d;
+
+    if (q->active || q->head == q->tail) {
+        return;
+    }
+    d = &q->desc[q->head & (USART_TX_DMA_QUEUE_LEN - 1)];
+    dma_disable(dev->tx_dma, dev->tx_dma_ch);
+    dma_set_mem_addr(dev->tx_dma, dev->tx_dma_ch, (__io void*)d->buf);
+    dma_set_num_transfers(dev->tx_dma, dev->tx_dma_ch, (uint16)d->len);
+    q->active = 1;
+    dev->regs->CR3 |= USART_CR3_DMAT;
+    dma_enable(dev->tx_dma, dev->tx_dma_ch);
+}
+
+/**
+ * @brief Finish the DMA buffer in flight and start the next one.
+ *
+ * Interrupt context only: called on DMA transfer complete or error.
+ * A transfer error means the DMA could not read the buffer, so
+ * sending it again would fail the same way; it is counted and
+ * dropped, its callback still runs so the owner gets it back, and
+ * the queue moves on.  When the DMA queue is empty, DR goes back to
+ * the TX buffer.
+ *
+ * @param dev Serial port
+ * @param error Nonzero if the transfer ended in an error
+ */
+void usart_tx_dma_done(usart_dev *dev, int error) {
+    usart_tx_queue *q = dev->txq;
+    usart_tx_desc *d = &q->desc[q->head & (USART_TX_DMA_QUEUE_LEN - 1)];
+
+    dma_disable(dev->tx_dma, dev->tx_dma_ch);
+    q->active = 0;
+    if (error) {
+        dev->stats.tx_dma_errors++;
+    }
+    if (d->done) {
+        d->done(d->buf, d->len);
+    }
+    q->head++;
+
+    if (q->head != q->tail) {
+        usart_tx_dma_next(dev);
+        return;
+    }
+    dev->regs->CR3 &= ~USART_CR3_DMAT;
+    if (rb_fifo_count(dev->wb)) {
+        bb_peri_set_bit(&dev->regs->CR1, USART_CR1_TXEIE_BIT, 1);
+    }
+}
+
+/**
+ * @brief Queue bytes for transmission according to the TX policy.
+ *
+ * With USART_TX_BLOCK this returns once all of buf is queued.  If
+ * called from an interrupt handler or with interrupts disabled, room
+ * is made by polling the hardware rather than waiting for the TX
+ * interrupt.  With USART_TX_DROP whatever does not fit is discarded.
+ *
+ * @param dev Serial port to transmit over
+ * @param buf Buffer to transmit
+ * @param len Number of bytes to transmit
+ * @return Number of bytes queued
+ */
+uint32 usart_write(usart_dev *dev, const uint8 *buf, uint32 len) {
+    uint32 txed = usart_tx(dev, buf, len);
+
+    if (dev->tx_policy == USART_TX_DROP) {
+        return txed;
+    }
+    while (txed < len) {
+        if (usart_irq_blocked()) {
+            usart_tx_poll(dev);
+        }
+        txed += usart_tx(dev, buf + txed, len - txed);
     }
     return txed;
 }
 
+/**
+ * @brief Wait until everything queued has left the serial port.
+ *
+ * Returns once the TX buffer and the DMA queue are empty and the
+ * last stop bit has been shifted out (TC set).
+ *
+ * @param dev Serial port to drain
+ */
+void usart_tx_drain(usart_dev *dev) {
+    usart_reg_map *regs = dev->regs;
+
+    if (!(regs->CR1 & USART_CR1_UE)) {
+        return;
+    }
+    while (rb_fifo_count(dev->wb) || usart_tx_dma_pending(dev)) {
+        if (usart_irq_blocked()) {
+            usart_tx_poll(dev);
+        }
+    }
+    while (!(regs->SR & USART_SR_TC))
+        ;
+}
+
 /**
  * @brief Nonblocking USART receive.
  * @param dev Serial port to receive bytes from
@@ -107,13 +421,189 @@ uint32 usart_tx(usart_dev *dev, const uint8 *buf, uint32 len) {
  * @return Number of bytes received
  */
 uint32 usart_rx(usart_dev *dev, uint8 *buf, uint32 len) {
-    uint32 rxed = 0;
+    ring_fifo *rb = dev->rb;
+    uint32 primask;
+    uint32 head;
+    uint32 written;
+
+    if (!usart_data_available(dev)) {
+        return 0;
+    }
+    if (!dev->rx_dma) {
+        return rb_read_n(rb, buf, len);
+    }
+
+    /* The DMA channel does not wait for us.  If we are far enough
+     * behind, it can write over the bytes while we copy them, so
+     * copy first, then make sure it has not got to them before
+     * giving the slots back. */
+    head = rb->head;
+    len = rb_peek_n(rb, buf, len);
+    primask = nvic_globalirq_save();
+    written = rb->tail + ((rb->mask + 1 -
+        dma_tube_regs(dev->rx_dma, dev->rx_dma_ch)->CNDTR - rb->tail) &
+        rb->mask);
+    nvic_globalirq_restore(primask);
+    if (written - head > rb->mask + 1) {
+        dev->stats.rx_drops += rb->tail - head;
+        rb_fifo_reset(rb);
+        return 0;
+    }
+    rb_fifo_barrier();
+    rb->head = head + len;
+    return len;
+}
+
+/**
+ * @brief Publish bytes written by the RX DMA channel.
+ *
+ * Advances the RX buffer's tail to where the DMA channel is now
+ * writing.  This is called from the DMA half/full transfer and the
+ * USART IDLE interrupts, which must not preempt one another.
+ *
+ * The channel position only says where in the buffer it is, not how
+ * many times it has been round.  Between two calls here it crosses
+ * both the half way point and the end of the buffer only if it has
+ * gone more than half way round, so when both of those flags are
+ * waiting it may have lapped us.  We then count the lap as well,
+ * which leaves more than a buffer's worth in the RX buffer, and
+ * usart_data_available() throws it away.
+ *
+ * @param dev Serial port in DMA receive mode
+ * @see usart_rx_dma_enable()
+ */
+void usart_rx_dma_update(usart_dev *dev) {
+    ring_fifo *rb = dev->rb;
+    uint8 bits = dma_get_isr_bits(dev->rx_dma, dev->rx_dma_ch);
+    uint32 pos;
+    uint32 new;
+    uint32 n;
 
-    while (usart_data_available(dev) && rxed < len) {
-        *buf++ = usart_getc(dev);
-        rxed++;
+    /* Clear before reading the position, so a flag set from here on
+     * stays for next time */
+    dma_clear_isr_bits(dev->rx_dma, dev->rx_dma_ch);
+    pos = rb->mask + 1 -
+        dma_tube_regs(dev->rx_dma, dev->rx_dma_ch)->CNDTR;
+    new = (pos - rb->tail) & rb->mask;
+    if ((bits & (DMA_ISR_HTIF | DMA_ISR_TCIF)) ==
+        (DMA_ISR_HTIF | DMA_ISR_TCIF)) {
+        new += rb->mask + 1;
     }
-    return rxed;
+
+    rb->tail += new;
+    dev->stats.rx_bytes += new;
+    if ((n = rb_fifo_count(rb)) > dev->stats.rx_hwm) {
+        dev->stats.rx_hwm = n;
+    }
+}
+
+/**
+ * @brief Have the RX interrupt assemble complete lines.
+ *
+ * Received bytes are collected into lines ended by any character in
+ * terms, and each line is published as a NUL terminated string for
+ * usart_readline().  The RX buffer is not used meanwhile.  Lines
+ * longer than max - 1 bytes, or that arrive while all nbufs buffers
+ * are in use, are thrown away and counted in lines.overflows.
+ *
+ * Line mode needs interrupt receive, not DMA receive.
+ *
+ * @param dev Serial port
+ * @param pool nbufs * max bytes, or NULL to take it from usart_arena
+ * @param nbufs Number of line buffers, a power of two (at most 128),
+ *              or 0 to go back to the RX buffer
+ * @param max Size of each line buffer, including the NUL
+ * @param terms Line terminators, e.g. "\r\n"
+ * @return 0 on success, -1 on bad arguments or no memory.
+ */
+int usart_set_lines(usart_dev *dev, char *pool, uint32 nbufs,
+                    uint32 max, const char *terms) {
+    usart_lines *ln = &dev->lines;
+    usart_reg_map *regs = dev->regs;
+
+    if (dev->rx_dma) {
+        return -1;
+    }
+    if (nbufs == 0) {
+        ln->pool = NULL;
+        return 0;
+    }
+    if (!usart_pow2(nbufs) || nbufs > 128 || max < 2 || max > 0xFFFF) {
+        return -1;
+    }
+    if (!pool && !(pool = (char*)usart_alloc(nbufs * max))) {
+        return -1;
+    }
+
+    /* Keep the RX interrupt off while we rearrange its world */
+    bb_peri_set_bit(&regs->CR1, USART_CR1_RXNEIE_BIT, 0);
+    ln->terms = terms;
+    ln->head = 0;
+    ln->tail = 0;
+    ln->overflows = 0;
+    ln->max = max;
+    ln->len = 0;
+    ln->nbufs = nbufs;
+    ln->discard = 0;
+    ln->held = 0;
+    ln->pool = pool;
+    if (regs->CR1 & USART_CR1_UE) {
+        bb_peri_set_bit(&regs->CR1, USART_CR1_RXNEIE_BIT, 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the oldest complete line, in line mode.
+ *
+ * Does not block.  The line stays valid until the next call, which
+ * hands its buffer back to the RX interrupt.
+ *
+ * @param dev Serial port in line mode
+ * @param line Set to the NUL terminated line
+ * @return Length of the line, or 0 if none is ready.
+ * @see usart_set_lines()
+ */
+int usart_readline(usart_dev *dev, char **line) {
+    usart_lines *ln = &dev->lines;
+    char *buf;
+    int len;
+
+    if (!ln->pool) {
+        return 0;
+    }
+    if (ln->held) {
+        ln->held = 0;
+        rb_fifo_barrier();
+        ln->head++;
+    }
+    if (ln->head == ln->tail) {
+        return 0;
+    }
+    rb_fifo_barrier();
+    buf = ln->pool + (ln->head & (ln->nbufs - 1)) * ln->max;
+    ln->held = 1;
+    *line = buf;
+    for (len = 0; buf[len]; len++)
+        ;
+    return len;
+}
+
+/**
+ * @brief Take a snapshot of a serial port's counters.
+ * @param dev Serial port
+ * @param stats Where to put them
+ */
+void usart_get_stats(usart_dev *dev, usart_stats *stats) {
+    *stats = dev->stats;
+}
+
+/**
+ * @brief Zero a serial port's counters.
+ * @param dev Serial port
+ */
+void usart_reset_stats(usart_dev *dev) {
+    memset(&dev->stats, 0, sizeof(dev->stats));
 }
 
 /**
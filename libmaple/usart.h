@@ -376,24 +376,159 @@ typedef struct usart_reg_map {
  * Devices
  */
 
+/** Default RX buffer size; must be a power of two */
 #ifndef USART_RX_BUF_SIZE
 #define USART_RX_BUF_SIZE               64
 #endif
 
+/** Default TX buffer size; must be a power of two */
+#ifndef USART_TX_BUF_SIZE
+#define USART_TX_BUF_SIZE               128
+#endif
+
+/** Ports the default arena has room for at the default sizes */
+#ifndef USART_ARENA_PORTS
+#define USART_ARENA_PORTS               3
+#endif
+
+/**
+ * Arena space beyond the default buffers, for usart_set_lines()
+ * pools and bigger buffers.  The default holds four NMEA sentences
+ * (82 bytes each) with some to spare.
+ */
+#ifndef USART_ARENA_EXTRA
+#define USART_ARENA_EXTRA               512
+#endif
+
+/**
+ * Size of the library's default buffer arena.  RX and TX buffers not
+ * given to usart_set_buffers() are carved from usart_arena[] when a
+ * port is first initialized, so ports that are never used cost no
+ * buffer RAM.  The default opens every port at the default sizes and
+ * leaves USART_ARENA_EXTRA over.  usart_arena and usart_arena_size
+ * are weak; to resize the arena without rebuilding the library,
+ * define both in your program, e.g.:
+ *
+ *     uint8 usart_arena[2048];
+ *     uint32 usart_arena_size = sizeof(usart_arena);
+ */
+#ifndef USART_ARENA_SIZE
+#define USART_ARENA_SIZE \
+    (USART_ARENA_PORTS * (USART_RX_BUF_SIZE + USART_TX_BUF_SIZE) + \
+     USART_ARENA_EXTRA)
+#endif
+
+extern uint8 usart_arena[];
+extern uint32 usart_arena_size;
+
+/** When the TX buffer is full, wait for room (the default) */
+#define USART_TX_BLOCK                  0
+/** When the TX buffer is full, throw away what does not fit */
+#define USART_TX_DROP                   1
+
+/** Number of queued usart_tx_dma() buffers; must be a power of two */
+#ifndef USART_TX_DMA_QUEUE_LEN
+#define USART_TX_DMA_QUEUE_LEN          4
+#endif
+
+/**
+ * Called from interrupt context once a usart_tx_dma() buffer has
+ * been handed to the USART (or dropped after a DMA transfer error,
+ * see usart_stats.tx_dma_errors), so the buffer may be reused.
+ */
+typedef void (*usart_tx_done_fn)(const uint8 *buf, uint32 len);
+
+/** A buffer waiting to be sent by DMA */
+typedef struct usart_tx_desc {
+    const uint8 *buf;           /**< Bytes to send */
+    uint32 len;                 /**< Number of bytes */
+    usart_tx_done_fn done;      /**< Completion callback, or NULL */
+} usart_tx_desc;
+
+/**
+ * Queue of buffers for DMA transmit.  Producers (usart_tx_dma) mask
+ * interrupts while they queue; the single consumer is the USART and
+ * DMA interrupts, as with ring_fifo.  The descriptor at head is the
+ * one being sent.
+ */
+typedef struct usart_tx_queue {
+    usart_tx_desc desc[USART_TX_DMA_QUEUE_LEN];
+    volatile uint32 head;       /**< Count of descriptors completed */
+    volatile uint32 tail;       /**< Count of descriptors queued */
+    volatile uint8 active;      /**< DMA owns DR until this clears */
+} usart_tx_queue;
+
+/**
+ * Per-port counters, kept by the driver.  The RX counters are kept by
+ * the receive interrupts (rx_drops by the reader in DMA receive mode),
+ * and the TX counters by usart_tx() and usart_tx_dma() with
+ * interrupts masked (tx_dma_errors by the TX DMA completion), so no
+ * update can be lost and they are cheap enough to leave on.
+ * @see usart_get_stats()
+ */
+typedef struct usart_stats {
+    uint32 rx_bytes;            /**< Bytes received */
+    uint32 rx_drops;            /**< Bytes lost because the RX buffer
+                                 * was full (or, with DMA receive,
+                                 * overwritten) */
+    uint32 ore;                 /**< Hardware overrun errors */
+    uint32 fe;                  /**< Framing errors */
+    uint32 ne;                  /**< Noise errors */
+    uint32 tx_bytes;            /**< Bytes queued for transmit */
+    uint32 rx_hwm;              /**< Most bytes ever waiting in RX */
+    uint32 tx_hwm;              /**< Most bytes ever waiting in TX */
+    uint32 tx_dma_errors;       /**< usart_tx_dma() buffers dropped
+                                 * on a DMA transfer error */
+} usart_stats;
+
+/**
+ * Line discipline state.  When pool is set, the RX interrupt
+ * assembles lines into a pool of nbufs buffers of max bytes each,
+ * instead of filling the RX buffer.  Completed lines are published
+ * like ring_fifo items: the interrupt owns tail, the reader head.
+ * @see usart_set_lines()
+ */
+typedef struct usart_lines {
+    char *pool;                 /**< nbufs * max bytes, or NULL */
+    const char *terms;          /**< Characters that end a line */
+    volatile uint32 head;       /**< Count of lines released */
+    volatile uint32 tail;       /**< Count of lines completed */
+    uint32 overflows;           /**< Lines lost: too long, or no
+                                 * free buffer */
+    uint16 max;                 /**< Buffer size, including the NUL */
+    uint16 len;                 /**< Length of the line being built */
+    uint8 nbufs;                /**< Number of buffers, a power of 2 */
+    uint8 discard;              /**< Throwing away a bad line */
+    uint8 held;                 /**< Reader holds the line at head */
+} usart_lines;
+
+struct dma_dev;                 /* forward declaration */
+
 /** USART device type */
 typedef struct usart_dev {
     usart_reg_map *regs;             /**< Register map */
-    ring_buffer *rb;                 /**< RX ring buffer */
+    ring_fifo *rb;                   /**< RX ring buffer */
+    ring_fifo *wb;                   /**< TX ring buffer */
     uint32 max_baud;                 /**< @brief Deprecated.
                                       * Maximum baud rate. */
-    uint8 rx_buf[USART_RX_BUF_SIZE]; /**< @brief Deprecated.
-                                      * Actual RX buffer used by rb.
-                                      * This field will be removed in
-                                      * a future release. */
+    uint8 tx_policy;                 /**< USART_TX_BLOCK or USART_TX_DROP */
+    struct dma_dev *rx_dma;          /**< RX DMA device, or NULL when
+                                      * receiving by interrupt */
+    uint8 rx_dma_ch;                 /**< RX DMA channel */
+    usart_tx_queue *txq;             /**< DMA transmit queue, or NULL
+                                      * if not supported */
+    struct dma_dev *tx_dma;          /**< TX DMA device, set up by the
+                                      * first usart_tx_dma() */
+    uint8 tx_dma_ch;                 /**< TX DMA channel */
+    usart_stats stats;               /**< Counters */
+    usart_lines lines;               /**< Line discipline */
     rcc_clk_id clk_id;               /**< RCC clock information */
     nvic_irq_num irq_num;            /**< USART NVIC interrupt */
 } usart_dev;
 
+int usart_set_buffers(usart_dev *dev,
+                      uint8 *rx_buf, uint32 rx_size,
+                      uint8 *tx_buf, uint32 tx_size);
 void usart_init(usart_dev *dev);
 
 struct gpio_dev;                /* forward declaration */
@@ -419,6 +554,20 @@ void usart_enable(usart_dev *dev);
 void usart_disable(usart_dev *dev);
 void usart_foreach(void (*fn)(usart_dev *dev));
 uint32 usart_tx(usart_dev *dev, const uint8 *buf, uint32 len);
+uint32 usart_write(usart_dev *dev, const uint8 *buf, uint32 len);
+int usart_tx_dma(usart_dev *dev, const uint8 *buf, uint32 len,
+                 usart_tx_done_fn done);
+void usart_tx_dma_next(usart_dev *dev);
+void usart_tx_dma_done(usart_dev *dev, int error);
+void usart_tx_drain(usart_dev *dev);
+int usart_rx_dma_enable(usart_dev *dev);
+void usart_rx_dma_disable(usart_dev *dev);
+void usart_rx_dma_update(usart_dev *dev);
+int usart_set_lines(usart_dev *dev, char *pool, uint32 nbufs,
+                    uint32 max, const char *terms);
+int usart_readline(usart_dev *dev, char **line);
+void usart_get_stats(usart_dev *dev, usart_stats *stats);
+void usart_reset_stats(usart_dev *dev);
 uint32 usart_rx(usart_dev *dev, uint8 *buf, uint32 len);
 void usart_putudec(usart_dev *dev, uint32 val);
 
@@ -429,24 +578,33 @@ static inline void usart_disable_all(void) {
     usart_foreach(usart_disable);
 }
 
+/**
+ * @brief Choose what happens when the TX buffer is full.
+ * @param dev Serial port to configure.
+ * @param policy USART_TX_BLOCK or USART_TX_DROP.
+ */
+static inline void usart_set_tx_policy(usart_dev *dev, uint8 policy) {
+    dev->tx_policy = policy;
+}
+
 /**
  * @brief Transmit one character on a serial port.
  *
- * This function blocks until the character has been successfully
- * transmitted.
+ * The character is queued for the TX interrupt.  If the TX buffer
+ * is full, this either waits for room or drops the character,
+ * depending on the port's TX policy.
  *
  * @param dev Serial port to send on.
  * @param byte Byte to transmit.
  */
 static inline void usart_putc(usart_dev* dev, uint8 byte) {
-    while (!usart_tx(dev, &byte, 1))
-        ;
+    usart_write(dev, &byte, 1);
 }
 
 /**
  * @brief Transmit a character string on a serial port.
  *
- * This function blocks until str is completely transmitted.
+ * The string is queued as by usart_putc().
  *
  * @param dev Serial port to send on
  * @param str String to send
@@ -469,7 +627,7 @@ static inline void usart_putstr(usart_dev *dev, const char* str) {
  * @see usart_data_available()
  */
 static inline uint8 usart_getc(usart_dev *dev) {
-    return rb_remove(dev->rb);
+    return (uint8)rb_fifo_get(dev->rb);
 }
 
 /**
@@ -478,7 +636,20 @@ static inline uint8 usart_getc(usart_dev *dev) {
  * @return Number of bytes in dev's RX buffer.
  */
 static inline uint32 usart_data_available(usart_dev *dev) {
-    return rb_full_count(dev->rb);
+    ring_fifo *rb = dev->rb;
+    uint32 n = rb_fifo_count(rb);
+
+    /* In DMA receive mode nothing holds the producer off.  Once the
+     * buffer is full its next byte goes over the oldest one we have
+     * not read, and it may have lapped us already (see
+     * usart_rx_dma_update()).  Either way what is in the buffer can
+     * not be trusted; start over. */
+    if (dev->rx_dma && n > rb->mask) {
+        dev->stats.rx_drops += n;
+        rb_fifo_reset(rb);
+        n = 0;
+    }
+    return n;
 }
 
 /**
@@ -486,7 +657,7 @@ static inline uint32 usart_data_available(usart_dev *dev) {
  * @param dev Serial port whose buffer to empty.
  */
 static inline void usart_reset_rx(usart_dev *dev) {
-    rb_reset(dev->rb);
+    rb_fifo_reset(dev->rb);
 }
 
 #ifdef __cplusplus
@@ -34,16 +34,22 @@
 
 #include <libmaple/usart.h>
 #include <libmaple/gpio.h>
+#include <libmaple/dma.h>
+#include <libmaple/bitband.h>
 #include "usart_private.h"
 
 /*
  * Devices
  */
 
-static ring_buffer usart1_rb;
+static ring_fifo usart1_rb;
+static ring_fifo usart1_wb;
+static usart_tx_queue usart1_txq;
 static usart_dev usart1 = {
     .regs     = USART1_BASE,
     .rb       = &usart1_rb,
+    .wb       = &usart1_wb,
+    .txq      = &usart1_txq,
     .max_baud = 4500000UL,
     .clk_id   = RCC_USART1,
     .irq_num  = NVIC_USART1,
@@ -51,10 +57,14 @@ static usart_dev usart1 = {
 /** USART1 device */
 usart_dev *USART1 = &usart1;
 
-static ring_buffer usart2_rb;
+static ring_fifo usart2_rb;
+static ring_fifo usart2_wb;
+static usart_tx_queue usart2_txq;
 static usart_dev usart2 = {
     .regs     = USART2_BASE,
     .rb       = &usart2_rb,
+    .wb       = &usart2_wb,
+    .txq      = &usart2_txq,
     .max_baud = 2250000UL,
     .clk_id   = RCC_USART2,
     .irq_num  = NVIC_USART2,
@@ -62,10 +72,14 @@ static usart_dev usart2 = {
 /** USART2 device */
 usart_dev *USART2 = &usart2;
 
-static ring_buffer usart3_rb;
+static ring_fifo usart3_rb;
+static ring_fifo usart3_wb;
+static usart_tx_queue usart3_txq;
 static usart_dev usart3 = {
     .regs     = USART3_BASE,
     .rb       = &usart3_rb,
+    .wb       = &usart3_wb,
+    .txq      = &usart3_txq,
     .max_baud = 2250000UL,
     .clk_id   = RCC_USART3,
     .irq_num  = NVIC_USART3,
@@ -74,10 +88,12 @@ static usart_dev usart3 = {
 usart_dev *USART3 = &usart3;
 
 #if defined(STM32_HIGH_DENSITY) || defined(STM32_XL_DENSITY)
-static ring_buffer uart4_rb;
+static ring_fifo uart4_rb;
+static ring_fifo uart4_wb;
 static usart_dev uart4 = {
     .regs     = UART4_BASE,
     .rb       = &uart4_rb,
+    .wb       = &uart4_wb,
     .max_baud = 2250000UL,
     .clk_id   = RCC_UART4,
     .irq_num  = NVIC_UART4,
@@ -85,10 +101,12 @@ static usart_dev uart4 = {
 /** UART4 device */
 usart_dev *UART4 = &uart4;
 
-static ring_buffer uart5_rb;
+static ring_fifo uart5_rb;
+static ring_fifo uart5_wb;
 static usart_dev uart5 = {
     .regs     = UART5_BASE,
     .rb       = &uart5_rb,
+    .wb       = &uart5_wb,
     .max_baud = 2250000UL,
     .clk_id   = RCC_UART5,
     .irq_num  = NVIC_UART5,
@@ -143,28 +161,211 @@ void usart_foreach(void (*fn)(usart_dev*)) {
 #endif
 }
 
+/*
+ * DMA receive
+ */
+
+static void usart1_rx_dma_irq(void) {
+    usart_rx_dma_update(&usart1);
+}
+
+static void usart2_rx_dma_irq(void) {
+    usart_rx_dma_update(&usart2);
+}
+
+static void usart3_rx_dma_irq(void) {
+    usart_rx_dma_update(&usart3);
+}
+
+/**
+ * @brief Receive into the RX buffer by circular DMA.
+ *
+ * Instead of one interrupt per byte, the DMA channel fills the RX
+ * buffer continuously and the half transfer, transfer complete and
+ * USART IDLE interrupts publish what has arrived.  The usual
+ * usart_data_available()/usart_rx()/usart_getc() calls keep working.
+ *
+ * Call this after usart_enable().  Anything already in the RX buffer
+ * is discarded.  If the reader lets the buffer fill, the DMA channel
+ * starts writing over what has not been read yet, so the buffer is
+ * discarded (and counted in rx_drops) when usart_data_available()
+ * or usart_rx() notices.
+ *
+ * Only USART1-3 are supported, on DMA1 channels 5, 6 and 3, and
+ * not in line mode.  The channel is claimed with dma_claim(), so
+ * this fails if another driver (say I2C2 RX DMA on channel 5) has it.
+ *
+ * @param dev Serial port to switch to DMA receive.
+ * @return 0 on success, -1 if dev has no usable DMA channel.
+ */
+int usart_rx_dma_enable(usart_dev *dev) {
+    usart_reg_map *regs = dev->regs;
+    dma_tube_config cfg;
+    dma_channel ch;
+    void (*handler)(void);
+
+    if (dev == &usart1) {
+        ch = DMA_CH5;
+        cfg.tube_req_src = DMA_REQ_SRC_USART1_RX;
+        handler = usart1_rx_dma_irq;
+    } else if (dev == &usart2) {
+        ch = DMA_CH6;
+        cfg.tube_req_src = DMA_REQ_SRC_USART2_RX;
+        handler = usart2_rx_dma_irq;
+    } else if (dev == &usart3) {
+        ch = DMA_CH3;
+        cfg.tube_req_src = DMA_REQ_SRC_USART3_RX;
+        handler = usart3_rx_dma_irq;
+    } else {
+        return -1;
+    }
+    if (dev->lines.pool) {
+        return -1;
+    }
+
+    cfg.tube_src = &regs->DR;
+    cfg.tube_src_size = DMA_SIZE_8BITS;
+    cfg.tube_dst = dev->rb->buf;
+    cfg.tube_dst_size = DMA_SIZE_8BITS;
+    cfg.tube_nr_xfers = dev->rb->mask + 1;
+    cfg.tube_flags = (DMA_CFG_DST_INC | DMA_CFG_CIRC |
+                      DMA_CFG_CMPLT_IE | DMA_CFG_HALF_CMPLT_IE);
+    cfg.target_data = 0;
+
+    dma_init(DMA1);
+    if (dma_claim(DMA1, ch, dev) < 0) {
+        return -1;
+    }
+    bb_peri_set_bit(&regs->CR1, USART_CR1_RXNEIE_BIT, 0);
+    if (dma_tube_cfg(DMA1, ch, &cfg) < 0) {
+        bb_peri_set_bit(&regs->CR1, USART_CR1_RXNEIE_BIT, 1);
+        dma_release(DMA1, ch, dev);
+        return -1;
+    }
+
+    /* The DMA channel starts at the beginning of the buffer */
+    dev->rb->head = 0;
+    dev->rb->tail = 0;
+    dev->rx_dma = DMA1;
+    dev->rx_dma_ch = ch;
+
+    dma_attach_interrupt(DMA1, ch, handler);
+    dma_enable(DMA1, ch);
+    regs->CR3 |= USART_CR3_DMAR;
+    bb_peri_set_bit(&regs->CR1, USART_CR1_IDLEIE_BIT, 1);
+    return 0;
+}
+
+/**
+ * @brief Go back to receiving by interrupt.
+ * @param dev Serial port in DMA receive mode.
+ */
+void usart_rx_dma_disable(usart_dev *dev) {
+    usart_reg_map *regs = dev->regs;
+
+    if (!dev->rx_dma) {
+        return;
+    }
+    bb_peri_set_bit(&regs->CR1, USART_CR1_IDLEIE_BIT, 0);
+    regs->CR3 &= ~USART_CR3_DMAR;
+    dma_disable(dev->rx_dma, dev->rx_dma_ch);
+    dma_detach_interrupt(dev->rx_dma, dev->rx_dma_ch);
+    dma_release(dev->rx_dma, dev->rx_dma_ch, dev);
+    dev->rx_dma = NULL;
+
+    /* The interrupt path assumes the tail never laps the head */
+    rb_fifo_reset(dev->rb);
+    bb_peri_set_bit(&regs->CR1, USART_CR1_RXNEIE_BIT, 1);
+}
+
+/*
+ * DMA transmit
+ */
+
+static void usart1_tx_dma_irq(void) {
+    usart_tx_dma_done(&usart1,
+        dma_get_irq_cause(DMA1, DMA_CH4) == DMA_TRANSFER_ERROR);
+}
+
+static void usart2_tx_dma_irq(void) {
+    usart_tx_dma_done(&usart2,
+        dma_get_irq_cause(DMA1, DMA_CH7) == DMA_TRANSFER_ERROR);
+}
+
+static void usart3_tx_dma_irq(void) {
+    usart_tx_dma_done(&usart3,
+        dma_get_irq_cause(DMA1, DMA_CH2) == DMA_TRANSFER_ERROR);
+}
+
+/*
+ * Set up the TX DMA channel for usart_tx_dma().  The memory address
+ * and length are filled in per buffer by usart_tx_dma_next().
+ */
+int _usart_tx_dma_init(usart_dev *dev) {
+    dma_tube_config cfg;
+    dma_channel ch;
+    void (*handler)(void);
+
+    if (dev == &usart1) {
+        ch = DMA_CH4;
+        cfg.tube_req_src = DMA_REQ_SRC_USART1_TX;
+        handler = usart1_tx_dma_irq;
+    } else if (dev == &usart2) {
+        ch = DMA_CH7;
+        cfg.tube_req_src = DMA_REQ_SRC_USART2_TX;
+        handler = usart2_tx_dma_irq;
+    } else if (dev == &usart3) {
+        ch = DMA_CH2;
+        cfg.tube_req_src = DMA_REQ_SRC_USART3_TX;
+        handler = usart3_tx_dma_irq;
+    } else {
+        return -1;
+    }
+
+    cfg.tube_src = dev->wb->buf;
+    cfg.tube_src_size = DMA_SIZE_8BITS;
+    cfg.tube_dst = &dev->regs->DR;
+    cfg.tube_dst_size = DMA_SIZE_8BITS;
+    cfg.tube_nr_xfers = 1;
+    cfg.tube_flags = DMA_CFG_SRC_INC | DMA_CFG_CMPLT_IE | DMA_CFG_ERR_IE;
+    cfg.target_data = 0;
+
+    dma_init(DMA1);
+    if (dma_claim(DMA1, ch, dev) < 0) {
+        return -1;
+    }
+    if (dma_tube_cfg(DMA1, ch, &cfg) < 0) {
+        dma_release(DMA1, ch, dev);
+        return -1;
+    }
+    dma_attach_interrupt(DMA1, ch, handler);
+    dev->tx_dma_ch = ch;
+    dev->tx_dma = DMA1;
+    return 0;
+}
+
 /*
  * Interrupt handlers.
  */
 
 void __irq_usart1(void) {
-    usart_irq(&usart1_rb, USART1_BASE);
+    usart_irq(&usart1);
 }
 
 void __irq_usart2(void) {
-    usart_irq(&usart2_rb, USART2_BASE);
+    usart_irq(&usart2);
 }
 
 void __irq_usart3(void) {
-    usart_irq(&usart3_rb, USART3_BASE);
+    usart_irq(&usart3);
 }
 
 #ifdef STM32_HIGH_DENSITY
 void __irq_uart4(void) {
-    usart_irq(&uart4_rb, UART4_BASE);
+    usart_irq(&uart4);
 }
 
 void __irq_uart5(void) {
-    usart_irq(&uart5_rb, UART5_BASE);
+    usart_irq(&uart5);
 }
 #endif
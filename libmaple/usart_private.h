@@ -35,26 +35,120 @@
 #define _LIBMAPLE_USART_PRIVATE_H_
 
 #include <libmaple/ring_buffer.h>
+#include <libmaple/bitband.h>
 #include <libmaple/usart.h>
 
-static __always_inline void usart_irq(ring_buffer *rb, usart_reg_map *regs) {
+static __always_inline void usart_count_errors(usart_dev *dev, uint32 sr) {
+    if (sr & (USART_SR_ORE | USART_SR_FE | USART_SR_NE)) {
+        dev->stats.ore += !!(sr & USART_SR_ORE);
+        dev->stats.fe += !!(sr & USART_SR_FE);
+        dev->stats.ne += !!(sr & USART_SR_NE);
+    }
+}
+
+/*
+ * Line discipline: add one received byte to the line being built.
+ * Empty lines (as between \r and \n) are skipped.  A line that will
+ * not fit, or that finds every buffer still full, is thrown away up
+ * to its terminator and counted as an overflow.
+ */
+static __always_inline void usart_line_put(usart_lines *ln, uint8 c) {
+    const char *t;
+    char *buf;
+    uint32 tail = ln->tail;
+
+    for (t = ln->terms; *t; t++) {
+        if (c == (uint8)*t) {
+            break;
+        }
+    }
+
+    if (*t) {
+        if (ln->discard) {
+            ln->overflows++;
+        } else if (ln->len) {
+            buf = ln->pool + (tail & (ln->nbufs - 1)) * ln->max;
+            buf[ln->len] = '\0';
+            rb_fifo_barrier();
+            ln->tail = tail + 1;
+        }
+        ln->len = 0;
+        ln->discard = 0;
+        return;
+    }
+
+    if (ln->discard) {
+        return;
+    }
+    if (tail - ln->head >= ln->nbufs || ln->len >= ln->max - 1) {
+        ln->discard = 1;
+        return;
+    }
+    buf = ln->pool + (tail & (ln->nbufs - 1)) * ln->max;
+    buf[ln->len++] = c;
+}
+
+static __always_inline void usart_irq(usart_dev *dev) {
+    usart_reg_map *regs = dev->regs;
+    ring_fifo *wb = dev->wb;
+    uint32 sr = regs->SR;
+
     /* We can get RXNE and ORE interrupts here. Only RXNE signifies
      * availability of a byte in DR.
      *
      * See table 198 (sec 27.4, p809) in STM document RM0008 rev 15.
-     * We enable RXNEIE. */
-    if (regs->SR & USART_SR_RXNE) {
-#ifdef USART_SAFE_INSERT
-        /* If the buffer is full and the user defines USART_SAFE_INSERT,
-         * ignore new bytes. */
-        rb_safe_insert(rb, (uint8)regs->DR);
-#else
-        /* By default, push bytes around in the ring buffer. */
-        rb_push_insert(rb, (uint8)regs->DR);
-#endif
+     * We enable RXNEIE, except in DMA receive mode, where the DMA
+     * channel takes the bytes out of DR instead. */
+    if ((regs->CR1 & USART_CR1_RXNEIE) && (sr & USART_SR_RXNE)) {
+        ring_fifo *rb = dev->rb;
+        uint32 n;
+
+        /* ORE, FE and NE are cleared by the DR read below */
+        usart_count_errors(dev, sr);
+        dev->stats.rx_bytes++;
+
+        /* The ISR is the only producer and must never move head, so
+         * when the buffer is full the new byte is dropped. */
+        if (dev->lines.pool) {
+            usart_line_put(&dev->lines, (uint8)regs->DR);
+        } else if (!rb_fifo_put(rb, (uint8)regs->DR)) {
+            dev->stats.rx_drops++;
+        } else if ((n = rb_fifo_count(rb)) > dev->stats.rx_hwm) {
+            dev->stats.rx_hwm = n;
+        }
+    }
+
+    /* In DMA receive mode, the line going idle at the end of a
+     * burst is our cue to publish what the DMA channel wrote.
+     * Reading SR then DR clears IDLE. */
+    if ((regs->CR1 & USART_CR1_IDLEIE) && (sr & USART_SR_IDLE)) {
+        usart_count_errors(dev, sr);
+        (void)regs->DR;
+        usart_rx_dma_update(dev);
+    }
+
+    /* TXEIE is only on while the TX buffer has something for us.
+     * Once it runs dry, turn it off again; usart_tx() turns it
+     * back on after queueing more.  While a DMA transfer owns DR
+     * we stand aside, and the DMA completion hands DR back.  When
+     * the TX buffer is empty, queued DMA buffers get their turn. */
+    if ((regs->CR1 & USART_CR1_TXEIE) && (regs->SR & USART_SR_TXE)) {
+        int16 ch = -1;
+        if (!(dev->txq && dev->txq->active)) {
+            ch = rb_fifo_get(wb);
+        }
+        if (ch < 0) {
+            bb_peri_set_bit(&regs->CR1, USART_CR1_TXEIE_BIT, 0);
+            if (dev->txq) {
+                usart_tx_dma_next(dev);
+            }
+        } else {
+            regs->DR = (uint8)ch;
+        }
     }
 }
 
 uint32 _usart_clock_freq(usart_dev *dev);
+int _usart_tx_dma_init(usart_dev *dev);
 
 #endif
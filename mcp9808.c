@@ -22,6 +22,7 @@
 /* For maple-unwired */
 #include <unwired.h>
 #include <i2c.h>
+#include <regmap.h>
 
 static int bmp_temp ( struct i2c * );
 static int bmp_pressure ( struct i2c * );
@@ -45,49 +46,60 @@ static int bmp_pressure ( struct i2c * );
 #define  REG_REV		7
 #define  REG_RES		8
 
+/* The 16 bit registers, CONF through REV, MSB first.
+ * (RES is only 8 bits, we leave it out.)
+ */
+static unsigned char mcp_shadow[2 * REG_REV];
+
+static struct regmap mcp_map = {
+	.addr = MCP_ADDR,
+	.width = 2,
+	.flags = REGMAP_NOINC,
+	.base = REG_CONF,
+	.nregs = REG_REV,
+	.shadow = mcp_shadow
+};
+
 static int
-mcp_read_reg ( struct i2c *ip, int reg )
+mcp_read_reg ( int reg )
 {
-        unsigned char buf[2];
+        (void) regmap_read ( &mcp_map, reg, 1 );
 
-        buf[0] = reg;
-        i2c_send ( ip, MCP_ADDR, buf, 1 );
-        i2c_recv ( ip, MCP_ADDR, buf, 2 );
-
-        return buf[0]<<8 | buf[1];
+        return regmap_u16 ( &mcp_map, reg );
 }
 
 /* It looks to me like the ID should read as 0x54
  *  -- and indeed it does.
  * The rev reads 0x400
+ * Neither one ever changes, mcp_init caches them.
  */
 
 static int
-mcp_id ( struct i2c *ip )
+mcp_id ( void )
 {
-	return mcp_read_reg ( ip, REG_ID );
+	return mcp_read_reg ( REG_ID );
 }
 
 static int
-mcp_rev ( struct i2c *ip )
+mcp_rev ( void )
 {
-	return mcp_read_reg ( ip, REG_REV );
+	return mcp_read_reg ( REG_REV );
 }
 
 static int
-mcp_temp ( struct i2c *ip )
+mcp_temp ( void )
 {
-	return mcp_read_reg ( ip, REG_TEMP );
+	return mcp_read_reg ( REG_TEMP );
 }
 
 static int
-mcp_show_temp ( struct i2c *ip )
+mcp_show_temp ( void )
 {
 	int raw;
 	int tc;
 	int tf;
 
-	raw = mcp_temp ( ip );
+	raw = mcp_temp ();
 	printf ( "MCP Raw TEMP = %h\n", raw );
 	tc = raw & 0xfff;
 	tc *= 100;
@@ -101,15 +113,21 @@ mcp_show_temp ( struct i2c *ip )
 void
 mcp_diag ( struct i2c *ip )
 {
-	printf ( "MCP ID  = %h\n", mcp_id(ip) );
-	printf ( "MCP REV = %h\n", mcp_rev(ip) );
-	printf ( "MCP TEMP = %h\n", mcp_temp(ip) );
-	mcp_show_temp ( ip );
+	if ( regmap_bus ( &mcp_map, ip ) )
+	    (void) regmap_cache ( &mcp_map, REG_ID, 2 );
+
+	printf ( "MCP ID  = %h\n", mcp_id() );
+	printf ( "MCP REV = %h\n", mcp_rev() );
+	printf ( "MCP TEMP = %h\n", mcp_temp() );
+	mcp_show_temp ();
 }
 
+/* Everything after this talks to the chip on this bus */
 void
 mcp_init ( struct i2c *ip )
 {
+	regmap_init ( &mcp_map, ip );
+	(void) regmap_cache ( &mcp_map, REG_ID, 2 );
 	mcp_diag ( ip );
 }
 
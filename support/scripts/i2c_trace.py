@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+#
+# i2c_trace.py - make sense of the I2C event trace from i2c_trace_show()
+#
+# usage: i2c_trace.py [-b baud] capture.txt
+#        i2c_trace.py [-b baud] /dev/ttyUSB0   (then type 't' on the board)
+#        i2c_trace.py -                        (read stdin)
+#
+# The board prints the ring of I2C events (see libmaple/i2c_hw.c) as
+# text, between a "i2c trace: N of M events, HZ Hz" line and an
+# "i2c trace: end" line.  Anything else in the capture is ignored, so
+# just save the whole console session and hand it to this.
+#
+# For each event we show the time since the first one and since the
+# one before it, with the status bits spelled out.  Then:
+#
+#   ISR     - how long the interrupt handler took, entry to exit
+#   byte    - time per byte, from the last point where bytes moved on
+#             this bus (the start of the transfer for the first one)
+#   xfer    - the whole transfer, start to done
+#
+# and at the end, min/avg/max of each of those.
+
+from __future__ import print_function
+
+import os
+import re
+import sys
+
+SR1_BITS = [
+    (0x8000, 'SMBALERT'), (0x4000, 'TIMEOUT'), (0x1000, 'PECERR'),
+    (0x0800, 'OVR'), (0x0400, 'AF'), (0x0200, 'ARLO'), (0x0100, 'BERR'),
+    (0x0080, 'TXE'), (0x0040, 'RXNE'), (0x0010, 'STOPF'), (0x0008, 'ADD10'),
+    (0x0004, 'BTF'), (0x0002, 'ADDR'), (0x0001, 'SB'),
+]
+
+SR2_BITS = [
+    (0x0080, 'DUALF'), (0x0040, 'SMBHOST'), (0x0020, 'SMBDEFAULT'),
+    (0x0010, 'GENCALL'), (0x0004, 'TRA'), (0x0002, 'BUSY'), (0x0001, 'MSL'),
+]
+
+# from dma_irq_cause in dma.h
+DMA_CAUSES = ['COMPLETE', 'HALF', 'ERROR', 'DME', 'FIFO']
+
+# from i2c.h
+RC_NAMES = {0: 'ok', -1: 'PROTOCOL', -2: 'TIMEOUT'}
+
+NO_MSG = 0xffff
+
+header_re = re.compile(r'i2c trace: (\d+) of (\d+) events, (\d+) Hz')
+event_re = re.compile(r'([0-9A-Fa-f]{8}) (\d) (\S+) +([0-9a-f]{4}) ([0-9a-f]{4}) ([0-9a-f]{4})\s*$')
+
+def bits(val, names):
+    return '|'.join(n for b, n in names if val & b) or '-'
+
+class Stat(object):
+    def __init__(self, name):
+        self.name = name
+        self.vals = []
+
+    def add(self, us):
+        self.vals.append(us)
+
+    def show(self):
+        v = self.vals
+        if not v:
+            print("%-6s  none" % self.name)
+            return
+        print("%-6s  %5d   min %9.1f  avg %9.1f  max %9.1f us" %
+              (self.name, len(v), min(v), sum(v) / len(v), max(v)))
+
+class Bus(object):
+    """What we need to remember about one bus between events"""
+    def __init__(self):
+        self.entry = None       # stamp of the irq we are inside of
+        self.xfer = None        # stamp of the transfer start
+        self.moved = 0          # bytes moved in the current message
+        self.last_move = None   # stamp when they last moved
+
+def show(dump, clock):
+    us = 1e6 / clock
+    isr = Stat('ISR')
+    byte = Stat('byte')
+    xfer = Stat('xfer')
+    buses = {}
+    first = last = None
+    now = 0
+
+    for stamp, bus, event, sr1, sr2, arg in dump:
+        # the cycle counter wraps every minute or so at 72 MHz
+        if first is None:
+            first = last = stamp
+        delta = (stamp - last) & 0xffffffff
+        now += delta
+        last = stamp
+
+        b = buses.setdefault(bus, Bus())
+        what = ''
+
+        if event == 'xfer':
+            b.xfer = b.last_move = stamp
+            b.moved = 0
+            what = 'addr %02x %s' % (arg >> 1, 'read' if arg & 1 else 'write')
+        elif event == 'irq':
+            b.entry = stamp
+            what = 'SR1 %s' % bits(sr1, SR1_BITS)
+        elif event == 'exit':
+            if b.entry is not None:
+                t = ((stamp - b.entry) & 0xffffffff) * us
+                isr.add(t)
+                what = 'ISR %.1f us' % t
+                b.entry = None
+            if arg != NO_MSG:
+                if arg < b.moved:
+                    b.moved = 0     # on to the next message
+                if arg > b.moved and b.last_move is not None:
+                    t = ((stamp - b.last_move) & 0xffffffff) * us / (arg - b.moved)
+                    for i in range(arg - b.moved):
+                        byte.add(t)
+                    what += ', %d byte%s at %.1f us' % (arg - b.moved,
+                            '' if arg - b.moved == 1 else 's', t)
+                if arg != b.moved:
+                    b.moved = arg
+                    b.last_move = stamp
+            if sr2:
+                what += ', SR2 %s' % bits(sr2, SR2_BITS)
+        elif event == 'error':
+            what = 'SR1 %s SR2 %s' % (bits(sr1, SR1_BITS), bits(sr2, SR2_BITS))
+        elif event == 'dma_rx':
+            cause = DMA_CAUSES[arg] if arg < len(DMA_CAUSES) else str(arg)
+            what = cause
+        elif event == 'done':
+            rc = arg - 0x10000 if arg & 0x8000 else arg
+            what = RC_NAMES.get(rc, str(rc))
+            if sr1:
+                what += ' (%s)' % bits(sr1, SR1_BITS)
+            if b.xfer is not None:
+                t = ((stamp - b.xfer) & 0xffffffff) * us
+                xfer.add(t)
+                what += ', %.1f us' % t
+                b.xfer = None
+            b.entry = None
+
+        print("%12.1f %+10.1f  I2C%d %-6s  %s" % (now * us, delta * us, bus,
+              event, what))
+
+    print()
+    isr.show()
+    byte.show()
+    xfer.show()
+
+def dumps(lines):
+    """Pull the dumps out of a console capture."""
+    dump = None
+    clock = 72000000
+    for line in lines:
+        if isinstance(line, bytes):
+            line = line.decode('latin-1')
+        line = line.strip()
+        m = header_re.search(line)
+        if m:
+            dump = []
+            clock = int(m.group(3))
+            continue
+        if dump is None:
+            continue
+        if line.endswith('i2c trace: end'):
+            yield dump, clock
+            dump = None
+            continue
+        m = event_re.search(line)
+        if m:
+            dump.append((int(m.group(1), 16), int(m.group(2)), m.group(3),
+                         int(m.group(4), 16), int(m.group(5), 16),
+                         int(m.group(6), 16)))
+
+def open_input(path, baud):
+    if path == '-':
+        return sys.stdin
+    if path.startswith('/dev/') or path.upper().startswith('COM'):
+        import serial
+        return serial.Serial(path, baud)
+    return open(path, 'rb')
+
+def main(argv):
+    baud = 115200
+
+    args = argv[1:]
+    if len(args) == 3 and args[0] == '-b':
+        baud = int(args[1])
+        args = args[2:]
+
+    if len(args) != 1:
+        print("usage: %s [-b baud] port|file|-" % os.path.basename(argv[0]),
+              file=sys.stderr)
+        return 1
+
+    n = 0
+    for dump, clock in dumps(open_input(args[0], baud)):
+        if n:
+            print()
+        print("-- i2c trace, %d events --" % len(dump))
+        show(dump, clock)
+        sys.stdout.flush()
+        n += 1
+
+    if n == 0:
+        print("%s: no i2c trace found" % args[0], file=sys.stderr)
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,213 @@
+#!/usr/bin/env python3
+#
+# tlog.py - decode the binary trace records sent by tlog_drain()
+#
+# usage: tlog.py [-b baud] [-c clock_hz] image.elf /dev/ttyUSB1
+#        tlog.py image.elf capture.bin
+#        tlog.py image.elf -          (read stdin)
+#
+# The format strings are not on the chip, they sit in the .tlog_fmt
+# section of the ELF file (see libmaple/tlog.c), and a record carries
+# the offset of its string in there.  So give this the very same ELF
+# file that went onto the board.
+#
+# Arguments for %s are pointers on the chip; if they point into some
+# part of the ELF file that is loaded (a string constant in flash),
+# we can show the string, otherwise you just get the address.
+#
+# Each line shows the time since the first record, and since the one
+# before it, from the 72 MHz cycle counter.
+
+from __future__ import print_function
+
+import os
+import re
+import struct
+import sys
+
+TLOG_MAGIC = 0xA
+TLOG_MAX_ARGS = 4
+TLOG_ID_DROPS = 0xffffff
+
+class Elf(object):
+    """Just enough of a 32 bit little endian ELF reader to get at
+    section contents by name or by address."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        d = self.data
+        if d[:4] != b'\x7fELF' or d[4] != 1 or d[5] != 1:
+            raise ValueError("%s: not a 32 bit little endian ELF file" % path)
+        (shoff,) = struct.unpack_from('<I', d, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from('<HHH', d, 0x2e)
+
+        hdrs = []
+        for i in range(shnum):
+            hdrs.append(struct.unpack_from('<IIIIIIIIII', d, shoff + i * shentsize))
+        strtab = hdrs[shstrndx][4]
+
+        # name, flags, addr, offset, size, type
+        self.sections = []
+        for h in hdrs:
+            name = d[strtab + h[0]:d.index(b'\0', strtab + h[0])].decode()
+            self.sections.append((name, h[2], h[3], h[4], h[5], h[1]))
+
+    def section(self, name):
+        for s in self.sections:
+            if s[0] == name:
+                return self.data[s[3]:s[3] + s[4]]
+        return None
+
+    def string_at(self, addr):
+        """A string from a loaded (SHF_ALLOC) section, with file data"""
+        for name, flags, base, off, size, stype in self.sections:
+            if not (flags & 2) or stype == 8:       # SHF_ALLOC, not NOBITS
+                continue
+            if base <= addr < base + size:
+                i = off + addr - base
+                end = self.data.index(b'\0', i)
+                return self.data[i:end].decode('latin-1')
+        return None
+
+# flags, width, precision, length, conversion
+# An 'h' only counts as a length if a conversion follows it,
+# otherwise it is %h (8 hex digits), just as in fmt.c
+conv_re = re.compile(r'%([-+ 0#]*)(\*|\d+)?(?:\.(\*|\d+))?'
+                     r'(hh|ll|l|z|h(?=[diouxX]))?([diouxXcsphfF%])')
+
+def format_record(elf, fmt, args):
+    args = list(args)
+    out = []
+    pos = 0
+
+    def next_arg():
+        return args.pop(0) if args else 0
+
+    for m in conv_re.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        flags, width, prec, length, conv = m.groups()
+        if conv == '%':
+            out.append('%')
+            continue
+        if width == '*':
+            width = str(next_arg())
+        if prec == '*':
+            prec = str(next_arg())
+        spec = '%' + flags + (width or '') + ('.' + prec if prec else '')
+        val = next_arg()
+
+        if conv in 'di':
+            if val & 0x80000000:
+                val -= 1 << 32
+            out.append((spec + 'd') % val)
+        elif conv == 'u':
+            out.append((spec + 'd') % val)
+        elif conv in 'xXo':
+            out.append((spec + conv) % val)
+        elif conv == 'h':
+            out.append('%08X' % val)
+        elif conv == 'p':
+            out.append('0x%x' % val)
+        elif conv == 'c':
+            out.append((spec + 'c') % chr(val & 0xff))
+        elif conv == 's':
+            s = elf.string_at(val)
+            if s is None:
+                s = '<%08x>' % val
+            out.append((spec + 's') % s)
+        else:
+            # %f cannot be done with 32 bit raw values
+            out.append('<%s %08x>' % (conv, val))
+
+    out.append(fmt[pos:])
+    return ''.join(out)
+
+def records(stream):
+    """Pull records out of a byte stream, resyncing on junk."""
+    buf = b''
+    while True:
+        # a serial port blocks until it has all we ask for
+        if hasattr(stream, 'in_waiting'):
+            chunk = stream.read(max(1, stream.in_waiting))
+        else:
+            chunk = stream.read(4096)
+        if not chunk:
+            return
+        buf += chunk
+        while len(buf) >= 8:
+            (hdr,) = struct.unpack_from('<I', buf, 0)
+            nargs = (hdr >> 24) & 0xf
+            if (hdr >> 28) != TLOG_MAGIC or nargs > TLOG_MAX_ARGS:
+                buf = buf[1:]
+                continue
+            n = 4 * (nargs + 2)
+            if len(buf) < n:
+                break
+            words = struct.unpack_from('<%dI' % (nargs + 2), buf, 0)
+            buf = buf[n:]
+            yield hdr & 0xffffff, words[1], words[2:]
+
+def open_input(path, baud):
+    if path == '-':
+        return getattr(sys.stdin, 'buffer', sys.stdin)
+    if path.startswith('/dev/') or path.upper().startswith('COM'):
+        import serial
+        return serial.Serial(path, baud)
+    return open(path, 'rb')
+
+def main(argv):
+    baud = 115200
+    clock = 72000000
+
+    args = argv[1:]
+    while args and args[0].startswith('-') and args[0] != '-':
+        opt = args.pop(0)
+        if opt == '-b':
+            baud = int(args.pop(0))
+        elif opt == '-c':
+            clock = int(args.pop(0))
+        else:
+            args = []
+            break
+
+    if len(args) != 2:
+        print("usage: %s [-b baud] [-c clock_hz] image.elf port|file|-" %
+              os.path.basename(argv[0]), file=sys.stderr)
+        return 1
+
+    elf = Elf(args[0])
+    fmts = elf.section('.tlog_fmt')
+    if fmts is None:
+        print("%s: no .tlog_fmt section" % args[0], file=sys.stderr)
+        return 1
+
+    last = None
+    now = 0
+    for fid, stamp, vals in records(open_input(args[1], baud)):
+        # the cycle counter wraps every minute or so at 72 MHz
+        if last is None:
+            last = stamp
+        now += (stamp - last) & 0xffffffff
+        delta = (stamp - last) & 0xffffffff
+        last = stamp
+
+        if fid == TLOG_ID_DROPS:
+            text = "-- %d records dropped --\n" % (vals[0] if vals else 0)
+        elif fid >= len(fmts):
+            text = "-- bad format id %06x --\n" % fid
+        else:
+            fmt = fmts[fid:fmts.index(b'\0', fid)].decode('latin-1')
+            text = format_record(elf, fmt, vals)
+
+        sys.stdout.write("%12.3f %+10.3f  %s" % (now * 1e6 / clock,
+                         delta * 1e6 / clock, text))
+        if not text.endswith('\n'):
+            sys.stdout.write('\n')
+        sys.stdout.flush()
+
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,192 @@
+/* fmt_bench.c
+ *
+ * How fast is fmt.c?
+ *
+ * First whole conversions, fmt_snprintf against glibc snprintf,
+ *  for the kinds of thing the demos print.
+ * Then just the digits, since that is where the divides were:
+ *  fmt_digits (multiply by the reciprocal) against the loop the
+ *  old sprintn in serial.c used, and against real divide
+ *  instructions.  gcc turns a divide by a constant 10 into a
+ *  multiply on its own, so "divide" uses a divisor it can't see,
+ *  which is what the old 64 bit path (libgcc) came to on the board.
+ * This runs on the host, which has a fast divider, so the gap on
+ *  a Cortex-M3 is bigger, not smaller.
+ *
+ * We pull in fmt.c itself to get at fmt_digits.
+ *
+ * Build and run with "make bench" in this directory.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "libmaple/fmt.c"
+
+#define LOOPS	2000000
+
+static volatile uint32 ten = 10;
+static volatile uint32 sink;
+
+static double
+now ( void )
+{
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* A spread of values with every number of digits */
+static uint64 vals[64];
+
+static void
+make_vals ( void )
+{
+	uint64 v = 0x9e3779b97f4a7c15ULL;
+	int i;
+
+	for ( i = 0; i < 64; i++ ) {
+	    v = v * 6364136223846793005ULL + 1442695040888963407ULL;
+	    vals[i] = v >> i;
+	}
+}
+
+/* ---------------------------------------------------------------- */
+
+static void
+bench_conv ( char *name, char *fmt, int kind )
+{
+	char buf[64];
+	double t_fmt, t_glibc;
+	int i;
+
+	t_fmt = now ();
+	for ( i = 0; i < LOOPS; i++ ) {
+	    if ( kind == 0 )
+		fmt_snprintf ( buf, sizeof(buf), fmt, (int) vals[i & 63] );
+	    else if ( kind == 1 )
+		fmt_snprintf ( buf, sizeof(buf), fmt, (long long) vals[i & 63] );
+	    else if ( kind == 2 )
+		fmt_snprintf ( buf, sizeof(buf), fmt, (int) vals[i & 63] / 1e4 );
+	    else
+		fmt_snprintf ( buf, sizeof(buf), fmt, (int) vals[i & 63] % 100,
+		    (unsigned) vals[i & 63], "hPa" );
+	    sink += buf[0];
+	}
+	t_fmt = now () - t_fmt;
+
+	t_glibc = now ();
+	for ( i = 0; i < LOOPS; i++ ) {
+	    if ( kind == 0 )
+		snprintf ( buf, sizeof(buf), fmt, (int) vals[i & 63] );
+	    else if ( kind == 1 )
+		snprintf ( buf, sizeof(buf), fmt, (long long) vals[i & 63] );
+	    else if ( kind == 2 )
+		snprintf ( buf, sizeof(buf), fmt, (int) vals[i & 63] / 1e4 );
+	    else
+		snprintf ( buf, sizeof(buf), fmt, (int) vals[i & 63] % 100,
+		    (unsigned) vals[i & 63], "hPa" );
+	    sink += buf[0];
+	}
+	t_glibc = now () - t_glibc;
+
+	printf ( "  %-12s %7.1f ns  glibc %7.1f ns  (%.2fx)\n", name,
+	    t_fmt / LOOPS * 1e9, t_glibc / LOOPS * 1e9, t_glibc / t_fmt );
+}
+
+/* ---------------------------------------------------------------- */
+
+/* The old sprintn, minus the sign */
+static int
+old_digits ( char *dp, uint32 n )
+{
+	char *start = dp;
+
+	do {
+	    *dp++ = '0' + n % 10;
+	    n /= 10;
+	} while ( n );
+	return dp - start;
+}
+
+static int
+div_digits_32 ( char *dp, uint32 n )
+{
+	char *start = dp;
+	uint32 b = ten;
+
+	do {
+	    *dp++ = '0' + n % b;
+	    n /= b;
+	} while ( n );
+	return dp - start;
+}
+
+static int
+div_digits_64 ( char *dp, uint64 n )
+{
+	char *start = dp;
+	uint64 b = ten;
+
+	do {
+	    *dp++ = '0' + n % b;
+	    n /= b;
+	} while ( n );
+	return dp - start;
+}
+
+static void
+bench_digits ( void )
+{
+	char digits[24];
+	double t;
+	int i;
+
+	printf ( "Digits only, 32 bit values\n" );
+
+	t = now ();
+	for ( i = 0; i < LOOPS * 4; i++ )
+	    sink += fmt_digits ( digits, (uint32) vals[i & 63], 10, 0 );
+	printf ( "  %-12s %7.1f ns\n", "fmt_digits", (now () - t) / (LOOPS * 4) * 1e9 );
+
+	t = now ();
+	for ( i = 0; i < LOOPS * 4; i++ )
+	    sink += old_digits ( digits, (uint32) vals[i & 63] );
+	printf ( "  %-12s %7.1f ns\n", "old sprintn", (now () - t) / (LOOPS * 4) * 1e9 );
+
+	t = now ();
+	for ( i = 0; i < LOOPS * 4; i++ )
+	    sink += div_digits_32 ( digits, (uint32) vals[i & 63] );
+	printf ( "  %-12s %7.1f ns\n", "divide", (now () - t) / (LOOPS * 4) * 1e9 );
+
+	printf ( "Digits only, 64 bit values\n" );
+
+	t = now ();
+	for ( i = 0; i < LOOPS * 4; i++ )
+	    sink += fmt_digits ( digits, vals[i & 63], 10, 0 );
+	printf ( "  %-12s %7.1f ns\n", "fmt_digits", (now () - t) / (LOOPS * 4) * 1e9 );
+
+	t = now ();
+	for ( i = 0; i < LOOPS * 4; i++ )
+	    sink += div_digits_64 ( digits, vals[i & 63] );
+	printf ( "  %-12s %7.1f ns\n", "divide", (now () - t) / (LOOPS * 4) * 1e9 );
+}
+
+int
+main ( int argc, char **argv )
+{
+	make_vals ();
+
+	printf ( "Whole conversions, per call\n" );
+	bench_conv ( "%d", "%d", 0 );
+	bench_conv ( "%8u", "%8u", 0 );
+	bench_conv ( "%lld", "%lld", 1 );
+	bench_conv ( "%.3f", "%.3f", 2 );
+	bench_conv ( "mixed", "t=%02d p=%u %s", 3 );
+
+	bench_digits ();
+	return 0;
+}
+
+/* THE END */
@@ -0,0 +1,368 @@
+/* fmt_test.c
+ *
+ * Host test for libmaple/fmt.c, against the snprintf in glibc.
+ *
+ * Every case goes through both, and the text and the return value
+ *  have to match exactly.  There is a table of the awkward cases
+ *  (flags, widths, precisions, the limits of each size), then a few
+ *  million random values, which is what shakes out the reciprocal
+ *  divides and the fixed point %f.
+ * Then the things glibc can't tell us about: %h, truncation into a
+ *  short buffer, and fmt_vformat handing out pieces to a sink.
+ *
+ * Build and run with "make" in this directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include "libmaple/fmt.h"
+
+static int fails;
+static int cases;
+
+/* Both of them, same arguments, compare */
+#define SAME(...)	same ( __LINE__, __VA_ARGS__ )
+
+static void
+same ( int line, const char *fmt, ... )
+{
+	char want[256];
+	char got[256];
+	va_list args;
+	int wn, gn;
+
+	va_start ( args, fmt );
+	wn = vsnprintf ( want, sizeof(want), fmt, args );
+	va_end ( args );
+
+	va_start ( args, fmt );
+	gn = fmt_vsnprintf ( got, sizeof(got), fmt, args );
+	va_end ( args );
+
+	cases++;
+	if ( wn == gn && strcmp ( want, got ) == 0 )
+	    return;
+
+	if ( fails++ < 20 )
+	    printf ( "FAIL line %d: \"%s\" gives \"%s\" (%d), glibc \"%s\" (%d)\n",
+		line, fmt, got, gn, want, wn );
+}
+
+/* What glibc can't check for us */
+static void
+expect ( int line, const char *want, const char *got, int gn )
+{
+	cases++;
+	if ( strcmp ( want, got ) == 0 && gn == (int) strlen ( want ) )
+	    return;
+	if ( fails++ < 20 )
+	    printf ( "FAIL line %d: got \"%s\" (%d), want \"%s\"\n",
+		line, got, gn, want );
+}
+
+/* ---------------------------------------------------------------- */
+
+static const char *int_fmts[] = {
+	"%d", "%5d", "%-5d|", "%05d", "%+d", "% d", "%+05d", "%-+6d|",
+	"%.0d", "%.3d", "%8.3d", "%-8.3d|", "%08.3d", "%+.3d", "%*d",
+};
+
+static const char *uint_fmts[] = {
+	"%u", "%7u", "%-7u|", "%07u", "%.0u", "%.4u",
+	"%x", "%X", "%8x", "%08X", "%.6x", "%-6x|",
+	"%o", "%6o", "%06o", "%.4o",
+};
+
+static const char *llong_fmts[] = {
+	"%lld", "%22lld", "%-22lld|", "%022lld", "%+lld", "% lld",
+	"%.0lld", "%.15lld", "%25.15lld", "%-+25.15lld|",
+};
+
+static const char *ullong_fmts[] = {
+	"%llu", "%22llu", "%-22llu|", "%022llu", "%.0llu", "%.21llu",
+	"%llx", "%llX", "%018llx", "%llo", "%.25llo",
+};
+
+static int ints[] = {
+	0, 1, -1, 7, -7, 9, 10, -10, 99, 100, 12345, -12345,
+	999999999, 1000000000, INT_MAX, INT_MIN, INT_MAX - 1, INT_MIN + 1,
+};
+
+static long long llongs[] = {
+	0, 1, -1, 4294967295LL, 4294967296LL, -4294967296LL,
+	9999999999LL, 10000000000LL, 999999999999999999LL,
+	1000000000000000000LL, LLONG_MAX, LLONG_MIN, LLONG_MAX - 9,
+};
+
+static void
+test_ints ( void )
+{
+	int i, j;
+
+	for ( i = 0; i < sizeof(int_fmts) / sizeof(int_fmts[0]); i++ )
+	    for ( j = 0; j < sizeof(ints) / sizeof(ints[0]); j++ ) {
+		if ( strchr ( int_fmts[i], '*' ) ) {
+		    SAME ( int_fmts[i], 9, ints[j] );
+		    SAME ( int_fmts[i], -9, ints[j] );
+		    continue;
+		}
+		SAME ( int_fmts[i], ints[j] );
+		SAME ( int_fmts[i], (long) ints[j] );
+	    }
+
+	for ( i = 0; i < sizeof(uint_fmts) / sizeof(uint_fmts[0]); i++ )
+	    for ( j = 0; j < sizeof(ints) / sizeof(ints[0]); j++ )
+		SAME ( uint_fmts[i], (unsigned) ints[j] );
+
+	for ( i = 0; i < sizeof(llong_fmts) / sizeof(llong_fmts[0]); i++ )
+	    for ( j = 0; j < sizeof(llongs) / sizeof(llongs[0]); j++ )
+		SAME ( llong_fmts[i], llongs[j] );
+
+	for ( i = 0; i < sizeof(ullong_fmts) / sizeof(ullong_fmts[0]); i++ )
+	    for ( j = 0; j < sizeof(llongs) / sizeof(llongs[0]); j++ )
+		SAME ( ullong_fmts[i], (unsigned long long) llongs[j] );
+
+	for ( j = 0; j < sizeof(llongs) / sizeof(llongs[0]); j++ ) {
+	    SAME ( "%ld %lu %lx", (long) llongs[j], (unsigned long) llongs[j],
+		(unsigned long) llongs[j] );
+	    SAME ( "%zu", (size_t) llongs[j] );
+	}
+
+	/* h and hh are taken and ignored, which is right for
+	 *  values that fit, and those are all anybody passes.
+	 */
+	SAME ( "%hd %hu %hhd %hhu", -5, 65535, 100, 200 );
+	SAME ( "%hx", 0xabcd );
+}
+
+/* A few million random values, spread over all the sizes
+ *  of number, so every digit count gets plenty of tries.
+ */
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+rand64 ( void )
+{
+	/* xorshift64* */
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 2685821657736338717ULL;
+}
+
+static void
+test_random_ints ( void )
+{
+	uint64_t v;
+	int i;
+
+	for ( i = 0; i < 1000000; i++ ) {
+	    v = rand64 () >> (rand64 () & 63);
+	    SAME ( "%llu", (unsigned long long) v );
+	    SAME ( "%lld", (long long) v );
+	    SAME ( "%u %d", (unsigned) v, (int) v );
+	    SAME ( "%llx %o", (unsigned long long) v, (unsigned) v );
+	}
+}
+
+/* ---------------------------------------------------------------- */
+
+static double floats[] = {
+	0.0, -0.0, 1.0, -1.0, 0.5, 1.5, 2.5, -2.5, 0.125, 0.375,
+	0.05, 0.15, 0.25, 0.35, 0.45, 0.95, 9.5, 99.5, 0.999999, 0.9999995,
+	3.14159265358979, -3.14159265358979, 2.718281828459045, 1e-5,
+	1e-10, 1e-20, 123456.789, 1e15, 1e18, 9.2e18, 4294967296.5,
+	0.1, 0.2, 0.3, 1.0/3.0, 2.0/3.0, 5e-324, 2.2250738585072014e-308,
+	1.005, 1.015, 1.025, 8.345, 1234.5678, -0.0001, 0.00049, 0.0005,
+	0.0015,
+};
+
+static const char *float_fmts[] = {
+	"%f", "%.0f", "%.1f", "%.2f", "%.3f", "%.6f", "%.9f", "%.12f",
+	"%.15f", "%10.3f", "%-10.3f|", "%010.3f", "%+.2f", "% .2f",
+	"%+010.1f", "%F", "%*.*f",
+};
+
+static void
+test_floats ( void )
+{
+	int i, j;
+
+	for ( i = 0; i < sizeof(float_fmts) / sizeof(float_fmts[0]); i++ )
+	    for ( j = 0; j < sizeof(floats) / sizeof(floats[0]); j++ ) {
+		if ( strchr ( float_fmts[i], '*' ) ) {
+		    SAME ( float_fmts[i], 12, 4, floats[j] );
+		    SAME ( float_fmts[i], -12, 0, floats[j] );
+		    continue;
+		}
+		SAME ( float_fmts[i], floats[j] );
+	    }
+
+	/* These we spell differently from glibc */
+	{
+	    char buf[32];
+	    int n;
+
+	    n = fmt_snprintf ( buf, sizeof(buf), "%f", 1e300 );
+	    expect ( __LINE__, "ovf", buf, n );
+	    n = fmt_snprintf ( buf, sizeof(buf), "%f", 1.0 / 0.0 );
+	    expect ( __LINE__, "inf", buf, n );
+	}
+}
+
+/* Random doubles, from tiny to just under 2^63.
+ * fmt.c promises exact digits for 17 significant digits,
+ *  so that is as far as we hold it to glibc.
+ */
+static void
+test_random_floats ( void )
+{
+	char fmt[8];
+	union { double d; uint64_t u; } v;
+	int exp, prec, sig;
+	int i;
+
+	for ( i = 0; i < 1000000; i++ ) {
+	    exp = 1023 - 30 + (int) (rand64 () % 92);	/* 2^-30 .. 2^62 */
+	    v.u = (rand64 () & 0x800fffffffffffffULL) | ((uint64_t) exp << 52);
+
+	    /* digits before the point, then keep it to 17 in all */
+	    sig = exp >= 1023 ? (int) ((exp - 1023) * 0.30103) + 1 : 0;
+	    prec = rand64 () % 16;
+	    if ( sig + prec > 17 )
+		prec = sig < 17 ? 17 - sig : 0;
+	    snprintf ( fmt, sizeof(fmt), "%%.%df", prec );
+	    SAME ( fmt, v.d );
+	}
+}
+
+/* ---------------------------------------------------------------- */
+
+static void
+test_misc ( void )
+{
+	char buf[64];
+	int n;
+
+	SAME ( "plain text" );
+	SAME ( "" );
+	SAME ( "100%%" );
+	SAME ( "%c%c%c", 'a', 'b', 'c' );
+	SAME ( "[%5c] [%-5c]", 'x', 'y' );
+	SAME ( "%s", "hello" );
+	SAME ( "[%10s] [%-10s] [%.3s] [%8.2s]", "abc", "abc", "abcdef", "abcdef" );
+	SAME ( "[%*s] [%-*s] [%.*s]", 6, "ab", 6, "ab", 2, "abc" );
+	SAME ( "%p", (void *) 0x1234 );
+	SAME ( "%s=%d, %s=%u (%x)", "a", -1, "b", 2u, 255 );
+
+	/* My %h, 8 hex digits, no matter what */
+	n = fmt_snprintf ( buf, sizeof(buf), "%h", 0xbeef );
+	expect ( __LINE__, "0000BEEF", buf, n );
+	n = fmt_snprintf ( buf, sizeof(buf), "%h %h", 0, 0xffffffffu );
+	expect ( __LINE__, "00000000 FFFFFFFF", buf, n );
+
+	/* A bad conversion comes out as is */
+	n = fmt_snprintf ( buf, sizeof(buf), "a %y b" );
+	expect ( __LINE__, "a %y b", buf, n );
+	n = fmt_snprintf ( buf, sizeof(buf), "end %" );
+	expect ( __LINE__, "end ", buf, n );
+}
+
+/* A short buffer gets what fits and a null, and the
+ *  return is the length it would have been.
+ */
+static void
+test_truncate ( void )
+{
+	char want[64];
+	char got[64];
+	int size, wn, gn;
+
+	for ( size = 0; size < 30; size++ ) {
+	    memset ( want, 'X', sizeof(want) );
+	    memset ( got, 'X', sizeof(got) );
+	    wn = snprintf ( want, size, "%s %08d %.3f", "truncate me", -42, 2.5 );
+	    gn = fmt_snprintf ( got, size, "%s %08d %.3f", "truncate me", -42, 2.5 );
+	    cases++;
+	    if ( wn != gn || memcmp ( want, got, sizeof(want) ) != 0 ) {
+		if ( fails++ < 20 )
+		    printf ( "FAIL truncate at %d: \"%.*s\" (%d), glibc \"%.*s\" (%d)\n",
+			size, size, got, gn, size, want, wn );
+	    }
+	}
+}
+
+/* fmt_vformat in pieces, glued back together */
+static char sink_buf[4096];
+static int sink_len;
+static int sink_max;
+
+static void
+sink ( void *arg, const char *s, int n )
+{
+	if ( n > sink_max )
+	    sink_max = n;
+	memcpy ( sink_buf + sink_len, s, n );
+	sink_len += n;
+}
+
+static int
+vformat ( const char *fmt, ... )
+{
+	va_list args;
+	int n;
+
+	va_start ( args, fmt );
+	n = fmt_vformat ( sink, NULL, fmt, args );
+	va_end ( args );
+	return n;
+}
+
+static void
+test_sink ( void )
+{
+	static char want[4096];
+	static char big[1000];
+	int wn, gn;
+
+	memset ( big, 'z', sizeof(big) - 1 );
+	sink_len = 0;
+	wn = snprintf ( want, sizeof(want), "%s|%200d|%-100.3f|%llu|%s",
+	    "start", 12345, 3.25, 18446744073709551615ULL, big );
+	gn = vformat ( "%s|%200d|%-100.3f|%llu|%s",
+	    "start", 12345, 3.25, 18446744073709551615ULL, big );
+	sink_buf[sink_len] = '\0';
+
+	cases++;
+	if ( wn != gn || sink_len != gn || strcmp ( want, sink_buf ) != 0 ) {
+	    fails++;
+	    printf ( "FAIL sink: %d bytes (returned %d), glibc %d\n",
+		sink_len, gn, wn );
+	}
+}
+
+int
+main ( int argc, char **argv )
+{
+	test_ints ();
+	test_random_ints ();
+	test_floats ();
+	test_random_floats ();
+	test_misc ();
+	test_truncate ();
+	test_sink ();
+
+	if ( fails ) {
+	    printf ( "fmt: %d of %d cases failed\n", fails, cases );
+	    return 1;
+	}
+	printf ( "fmt: all %d cases OK\n", cases );
+	return 0;
+}
+
+/* THE END */
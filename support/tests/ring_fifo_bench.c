@@ -0,0 +1,135 @@
+/* ring_fifo_bench.c
+ *
+ * How much faster is the ring_fifo than the old ring_buffer?
+ *
+ * Both get the same job, the one the USART code gives them:
+ *  a line of bytes goes in, then comes out, over and over,
+ *  in a 256 byte buffer (the size of a USART ring).
+ * The old ring_buffer can only go a byte at a time, the
+ *  ring_fifo goes a byte at a time and in bulk.
+ * This runs on the host, so the MB/s mean nothing on the board,
+ *  the ratios between them are what to look at.
+ * Don't be surprised if "fifo byte" comes out behind here: the old
+ *  ring_buffer indices are not volatile, so in a loop like this the
+ *  compiler keeps them in registers, which it can't do when one side
+ *  is an interrupt handler.  The bulk calls are the point.
+ *
+ * Build and run with "make bench" in this directory.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <libmaple/ring_buffer.h>
+
+#define RB_SIZE		256
+#define TOTAL		(256 * 1024 * 1024)
+
+static uint8 rb_buf[RB_SIZE];
+static uint8 line_in[RB_SIZE];
+static uint8 line_out[RB_SIZE];
+
+static double
+now ( void )
+{
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* What usart_tx and usart_rx did before, a byte at a time */
+static uint32
+bench_old ( int len )
+{
+	ring_buffer rb;
+	uint32 sum = 0;
+	uint32 done;
+	int i;
+
+	rb_init ( &rb, RB_SIZE, rb_buf );
+	for ( done = 0; done < TOTAL; done += len ) {
+	    for ( i = 0; i < len; i++ )
+		rb_safe_insert ( &rb, line_in[i] );
+	    for ( i = 0; i < len; i++ )
+		sum += rb_safe_remove ( &rb );
+	}
+	return sum;
+}
+
+static uint32
+bench_fifo_byte ( int len )
+{
+	ring_fifo rb;
+	uint32 sum = 0;
+	uint32 done;
+	int i;
+
+	rb_fifo_init ( &rb, RB_SIZE, rb_buf );
+	for ( done = 0; done < TOTAL; done += len ) {
+	    for ( i = 0; i < len; i++ )
+		rb_fifo_put ( &rb, line_in[i] );
+	    for ( i = 0; i < len; i++ )
+		sum += rb_fifo_get ( &rb );
+	}
+	return sum;
+}
+
+static uint32
+bench_fifo_bulk ( int len )
+{
+	ring_fifo rb;
+	uint32 sum = 0;
+	uint32 done;
+
+	rb_fifo_init ( &rb, RB_SIZE, rb_buf );
+	for ( done = 0; done < TOTAL; done += len ) {
+	    rb_write_n ( &rb, line_in, len );
+	    rb_read_n ( &rb, line_out, len );
+	    sum += line_out[len-1];
+	}
+	return sum;
+}
+
+static double
+run ( uint32 (*fn) ( int ), int len, char *name )
+{
+	volatile uint32 sum;
+	double t;
+	double mbs;
+
+	t = now ();
+	sum = fn ( len );
+	t = now () - t;
+	(void) sum;
+
+	mbs = TOTAL / t / 1e6;
+	printf ( "  %-12s %8.1f MB/s\n", name, mbs );
+	return mbs;
+}
+
+int
+main ( int argc, char **argv )
+{
+	/* a short reply, a GPS sentence, and most of the ring */
+	static int lens[] = { 8, 80, 255 };
+	double old, byte, bulk;
+	int i;
+
+	for ( i = 0; i < RB_SIZE; i++ )
+	    line_in[i] = i * 7;
+
+	for ( i = 0; i < sizeof(lens) / sizeof(lens[0]); i++ ) {
+	    printf ( "%d byte lines, %d MB through a %d byte ring\n",
+		lens[i], TOTAL / (1024 * 1024), RB_SIZE );
+	    old = run ( bench_old, lens[i], "ring_buffer" );
+	    byte = run ( bench_fifo_byte, lens[i], "fifo byte" );
+	    bulk = run ( bench_fifo_bulk, lens[i], "fifo bulk" );
+	    printf ( "  byte %.2fx, bulk %.2fx the old one\n",
+		byte / old, bulk / old );
+	}
+	return 0;
+}
+
+/* THE END */
@@ -0,0 +1,267 @@
+/* ring_fifo_test.c
+ *
+ * Host test for the ring_fifo in libmaple/ring_buffer.h
+ *
+ * First the single calls and the bulk calls, against a plain
+ *  array that says what ought to be in there, at every place
+ *  the indices can be when a copy has to wrap.
+ * Then a producer and a consumer thread hammer one fifo with no
+ *  locking at all, which is the contract the USART code relies on
+ *  (ISR producer, main loop consumer).  The consumer checks that
+ *  every byte arrives, once, in order.
+ *
+ * Build and run with "make" in this directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <libmaple/ring_buffer.h>
+
+#define SIZE	16
+
+static int fails;
+
+#define CHECK(x)	check ( (x), #x, __LINE__ )
+
+static void
+check ( int ok, char *what, int line )
+{
+	if ( ok )
+	    return;
+	printf ( "FAIL line %d: %s\n", line, what );
+	fails++;
+}
+
+static void
+test_single ( void )
+{
+	uint8 buf[SIZE];
+	ring_fifo rb;
+	int i;
+
+	rb_fifo_init ( &rb, SIZE, buf );
+	CHECK ( rb_fifo_count ( &rb ) == 0 );
+	CHECK ( rb_fifo_space ( &rb ) == SIZE );
+	CHECK ( rb_fifo_get ( &rb ) == -1 );
+
+	/* All SIZE slots are usable, there is no wasted one */
+	for ( i = 0; i < SIZE; i++ )
+	    CHECK ( rb_fifo_put ( &rb, i ) == 1 );
+	CHECK ( rb_fifo_put ( &rb, 99 ) == 0 );
+	CHECK ( rb_fifo_count ( &rb ) == SIZE );
+	CHECK ( rb_fifo_space ( &rb ) == 0 );
+
+	for ( i = 0; i < SIZE; i++ )
+	    CHECK ( rb_fifo_get ( &rb ) == i );
+	CHECK ( rb_fifo_get ( &rb ) == -1 );
+
+	/* 0xff has to come back as 255, not as -1 */
+	rb_fifo_put ( &rb, 0xff );
+	CHECK ( rb_fifo_get ( &rb ) == 0xff );
+
+	rb_fifo_put ( &rb, 1 );
+	rb_fifo_put ( &rb, 2 );
+	rb_fifo_reset ( &rb );
+	CHECK ( rb_fifo_count ( &rb ) == 0 );
+	CHECK ( rb_fifo_get ( &rb ) == -1 );
+}
+
+/* The indices run free and only get masked when used,
+ *  so start them just short of where a uint32 wraps.
+ */
+static void
+test_index_wrap ( void )
+{
+	uint8 buf[SIZE];
+	ring_fifo rb;
+	uint8 out[SIZE];
+	uint8 in[SIZE];
+	int i;
+
+	rb_fifo_init ( &rb, SIZE, buf );
+	rb.head = rb.tail = 0xfffffffa;
+
+	for ( i = 0; i < SIZE; i++ )
+	    in[i] = 100 + i;
+	CHECK ( rb_write_n ( &rb, in, SIZE ) == SIZE );
+	CHECK ( rb_fifo_count ( &rb ) == SIZE );
+	CHECK ( rb_fifo_space ( &rb ) == 0 );
+	CHECK ( rb_fifo_put ( &rb, 1 ) == 0 );
+
+	CHECK ( rb_read_n ( &rb, out, SIZE ) == SIZE );
+	for ( i = 0; i < SIZE; i++ )
+	    CHECK ( out[i] == in[i] );
+	CHECK ( rb_fifo_count ( &rb ) == 0 );
+}
+
+/* For every starting offset, and every fill, write and read
+ *  every length (more than fits too), and compare with what
+ *  a model of the fifo says should be there.
+ */
+static void
+test_bulk ( void )
+{
+	uint8 buf[SIZE];
+	uint8 model[SIZE];
+	uint8 in[2*SIZE];
+	uint8 out[2*SIZE];
+	ring_fifo rb;
+	int start, fill, len;
+	int have, n, want, i;
+	uint8 next;
+
+	for ( start = 0; start < SIZE; start++ )
+	for ( fill = 0; fill <= SIZE; fill++ )
+	for ( len = 0; len <= 2*SIZE; len++ ) {
+	    rb_fifo_init ( &rb, SIZE, buf );
+	    rb.head = rb.tail = start;
+	    next = start * 37;
+
+	    for ( have = 0; have < fill; have++ ) {
+		model[have] = next;
+		rb_fifo_put ( &rb, next++ );
+	    }
+
+	    for ( i = 0; i < len; i++ )
+		in[i] = next + i;
+	    want = len < SIZE - have ? len : SIZE - have;
+	    n = rb_write_n ( &rb, in, len );
+	    CHECK ( n == want );
+	    for ( i = 0; i < n; i++ )
+		model[have + i] = in[i];
+	    have += n;
+
+	    /* peek leaves it all there */
+	    want = len < have ? len : have;
+	    n = rb_peek_n ( &rb, out, len );
+	    CHECK ( n == want );
+	    CHECK ( rb_fifo_count ( &rb ) == have );
+	    for ( i = 0; i < n; i++ )
+		CHECK ( out[i] == model[i] );
+
+	    n = rb_read_n ( &rb, out, len );
+	    CHECK ( n == want );
+	    for ( i = 0; i < n; i++ )
+		CHECK ( out[i] == model[i] );
+	    CHECK ( rb_fifo_count ( &rb ) == have - n );
+
+	    /* and the single calls see the rest */
+	    for ( i = n; i < have; i++ )
+		CHECK ( rb_fifo_get ( &rb ) == model[i] );
+	    CHECK ( rb_fifo_get ( &rb ) == -1 );
+
+	    if ( fails > 10 )
+		return;
+	}
+}
+
+/* ---------------------------------------------------------------- */
+
+#define SPSC_BYTES	(20 * 1000 * 1000)
+#define SPSC_SIZE	256
+
+static uint8 spsc_buf[SPSC_SIZE];
+static ring_fifo spsc;
+
+/* The producer mixes single puts and bulk writes of odd
+ *  sizes, so the copies split at all sorts of places.
+ * Either side gives up the CPU when it can't get anywhere,
+ *  or on a one CPU machine this takes all day.
+ */
+static void *
+producer ( void *arg )
+{
+	uint8 chunk[61];
+	uint32 sent = 0;
+	uint32 n, i;
+
+	while ( sent < SPSC_BYTES ) {
+	    if ( sent & 1 ) {
+		if ( rb_fifo_put ( &spsc, sent & 0xff ) )
+		    sent++;
+		else
+		    sched_yield ();
+		continue;
+	    }
+	    n = 1 + sent % sizeof(chunk);
+	    if ( n > SPSC_BYTES - sent )
+		n = SPSC_BYTES - sent;
+	    for ( i = 0; i < n; i++ )
+		chunk[i] = sent + i;
+	    n = rb_write_n ( &spsc, chunk, n );
+	    if ( ! n )
+		sched_yield ();
+	    sent += n;
+	}
+	return arg;
+}
+
+static int
+test_spsc ( void )
+{
+	pthread_t tid;
+	uint8 chunk[47];
+	uint32 got = 0;
+	uint32 n, i;
+	int c;
+
+	rb_fifo_init ( &spsc, SPSC_SIZE, spsc_buf );
+	pthread_create ( &tid, NULL, producer, NULL );
+
+	while ( got < SPSC_BYTES ) {
+	    if ( got & 2 ) {
+		c = rb_fifo_get ( &spsc );
+		if ( c < 0 ) {
+		    sched_yield ();
+		    continue;
+		}
+		if ( c != (got & 0xff) ) {
+		    printf ( "FAIL spsc: byte %u is %d, not %u\n", got, c, got & 0xff );
+		    fails++;
+		    break;
+		}
+		got++;
+		continue;
+	    }
+	    n = rb_read_n ( &spsc, chunk, sizeof(chunk) );
+	    if ( ! n )
+		sched_yield ();
+	    for ( i = 0; i < n; i++ )
+		if ( chunk[i] != ((got + i) & 0xff) ) {
+		    printf ( "FAIL spsc: byte %u is %d, not %u\n",
+			got + i, chunk[i], (got + i) & 0xff );
+		    fails++;
+		    break;
+		}
+	    if ( i < n )
+		break;
+	    got += n;
+	}
+
+	/* The producer may be stuck on a full fifo if we quit early */
+	if ( got == SPSC_BYTES )
+	    pthread_join ( tid, NULL );
+	CHECK ( rb_fifo_count ( &spsc ) == 0 || fails );
+	return got;
+}
+
+int
+main ( int argc, char **argv )
+{
+	test_single ();
+	test_index_wrap ();
+	test_bulk ();
+	test_spsc ();
+
+	if ( fails ) {
+	    printf ( "ring_fifo: %d failures\n", fails );
+	    return 1;
+	}
+	printf ( "ring_fifo: all OK\n" );
+	return 0;
+}
+
+/* THE END */
@@ -0,0 +1,216 @@
+/* serial_bench.c
+ *
+ * The serial stack on the host, with serial_mem.c standing in
+ *  for the USART, to see what the ops table and the whole-line
+ *  writes buy us.
+ *
+ * Output: the same line goes out
+ *	- a character at a time through serial_putc, which is
+ *	  what puts and printf used to do (a backend call per byte)
+ *	- through serial_puts, a backend call per run of text
+ *	- through printf, formatted on the way
+ * Input: the far end sends a block and we read it
+ *	- a character at a time with serial_getc
+ *	- in one go with serial_read_buf
+ *
+ * Before any timing we check that each way gives the right bytes
+ *  (newlines come out as "\n\r"), and quit if one does not.
+ * This is the host, so look at the ratios, not the MB/s.
+ *
+ * serial.c has its own printf, puts, putc, getc and sprintf, which
+ *  would fight with the C library here, so the Makefile renames
+ *  them (ser_printf and so on) for this build only.
+ *
+ * Build and run with "make bench" in this directory.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "libmaple/serial.h"
+#include "libmaple/fmt.h"
+
+#define LOOPS	1000000
+
+#define TX_SIZE	1024
+#define RX_SIZE	1024
+
+static char rx_buf[RX_SIZE];
+static char tx_buf[TX_SIZE];
+static char got[TX_SIZE];
+
+static char line[] = "GPS 3725.1234,N,12158.5678,W fix 1 sats 9 alt 35.2\n";
+static char line_out[] = "GPS 3725.1234,N,12158.5678,W fix 1 sats 9 alt 35.2\n\r";
+
+static int fd;
+
+static double
+now ( void )
+{
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* We keep stdio out of it, see above */
+static void
+say ( char *fmt, ... )
+{
+	char buf[200];
+	va_list args;
+	int n;
+
+	va_start ( args, fmt );
+	n = fmt_vsnprintf ( buf, sizeof(buf), fmt, args );
+	va_end ( args );
+	write ( 1, buf, n );
+}
+
+/* ---------------------------------------------------------------- */
+
+static void
+tx_putc ( void )
+{
+	char *p;
+
+	for ( p = line; *p; p++ )
+	    serial_putc ( fd, *p );
+}
+
+static void
+tx_puts ( void )
+{
+	serial_puts ( fd, line );
+}
+
+static void
+tx_printf ( void )
+{
+	ser_printf ( "GPS %d.%04d,%c,%d.%04d,%c fix %d sats %d alt %d.%d\n",
+	    3725, 1234, 'N', 12158, 5678, 'W', 1, 9, 35, 2 );
+}
+
+/* Does one go of fn give the line we expect */
+static int
+tx_check ( char *name, void (*fn) ( void ) )
+{
+	int n;
+
+	fn ();
+	n = serial_mem_collect ( got, sizeof(got) );
+	if ( n == sizeof(line_out) - 1 && memcmp ( got, line_out, n ) == 0 )
+	    return 0;
+	say ( "FAIL %s: got %d bytes \"%.*s\"\n", name, n, n, got );
+	return 1;
+}
+
+static double
+tx_bench ( char *name, void (*fn) ( void ) )
+{
+	double t;
+	int i;
+
+	t = now ();
+	for ( i = 0; i < LOOPS; i++ ) {
+	    fn ();
+	    (void) serial_mem_collect ( got, sizeof(got) );
+	}
+	t = now () - t;
+
+	say ( "  %-12s %7.1f ns a line  %7.1f MB/s\n", name,
+	    t / LOOPS * 1e9, LOOPS * (sizeof(line_out) - 1) / t / 1e6 );
+	return t;
+}
+
+/* ---------------------------------------------------------------- */
+
+#define RX_BLOCK	512
+
+static char block[RX_BLOCK];
+
+static int
+rx_getc ( char *buf, int len )
+{
+	int i;
+
+	for ( i = 0; i < len; i++ )
+	    buf[i] = serial_getc ( fd );
+	return len;
+}
+
+static int
+rx_read_buf ( char *buf, int len )
+{
+	return serial_read_buf ( fd, buf, len );
+}
+
+static int
+rx_check ( char *name, int (*fn) ( char *, int ) )
+{
+	serial_mem_inject ( block, RX_BLOCK );
+	if ( fn ( got, RX_BLOCK ) == RX_BLOCK && memcmp ( got, block, RX_BLOCK ) == 0 )
+	    return 0;
+	say ( "FAIL %s: wrong data\n", name );
+	return 1;
+}
+
+static double
+rx_bench ( char *name, int (*fn) ( char *, int ) )
+{
+	double t;
+	int i;
+
+	t = now ();
+	for ( i = 0; i < LOOPS / 10; i++ ) {
+	    serial_mem_inject ( block, RX_BLOCK );
+	    (void) fn ( got, RX_BLOCK );
+	}
+	t = now () - t;
+
+	say ( "  %-12s %7.1f ns a block %7.1f MB/s\n", name,
+	    t / (LOOPS / 10) * 1e9, (LOOPS / 10) * (double) RX_BLOCK / t / 1e6 );
+	return t;
+}
+
+int
+main ( int argc, char **argv )
+{
+	double t_putc, t_puts, t_getc, t_buf;
+	int bad = 0;
+	int i;
+
+	fd = serial_mem_begin ( rx_buf, RX_SIZE, tx_buf, TX_SIZE );
+	if ( fd < 0 ) {
+	    say ( "serial_mem_begin failed\n" );
+	    return 1;
+	}
+	set_std_serial ( fd );
+
+	/* No carriage returns, serial_getc turns them into newlines */
+	for ( i = 0; i < RX_BLOCK; i++ )
+	    block[i] = 'A' + i % 26;
+
+	bad |= tx_check ( "putc", tx_putc );
+	bad |= tx_check ( "puts", tx_puts );
+	bad |= tx_check ( "printf", tx_printf );
+	bad |= rx_check ( "getc", rx_getc );
+	bad |= rx_check ( "read_buf", rx_read_buf );
+	if ( bad )
+	    return 1;
+
+	say ( "Output, a %d byte line\n", (int) sizeof(line_out) - 1 );
+	t_putc = tx_bench ( "serial_putc", tx_putc );
+	t_puts = tx_bench ( "serial_puts", tx_puts );
+	(void) tx_bench ( "printf", tx_printf );
+	say ( "  puts is %.1fx putc\n", t_putc / t_puts );
+
+	say ( "Input, a %d byte block\n", RX_BLOCK );
+	t_getc = rx_bench ( "serial_getc", rx_getc );
+	t_buf = rx_bench ( "read_buf", rx_read_buf );
+	say ( "  read_buf is %.1fx getc\n", t_getc / t_buf );
+	return 0;
+}
+
+/* THE END */
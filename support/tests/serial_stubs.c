@@ -0,0 +1,58 @@
+/* serial_stubs.c
+ *
+ * serial.c knows about the USARTs and USB as well as the memory
+ *  backend, so to link it on the host we need something for each
+ *  hardware routine it calls.  None of them should ever run, the
+ *  host benchmark only opens SERIAL_MEM, so they all complain
+ *  loudly and quit if one does.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "boards.h"
+#include <libmaple/usart.h>
+#include <libmaple/timer.h>
+#include <libmaple/util.h>
+
+stm32_pin_info PIN_MAP[1];
+
+struct usart_dev *USART1;
+struct usart_dev *USART2;
+struct usart_dev *USART3;
+
+static void
+no_hw ( void )
+{
+	static const char msg[] = "serial host test: touched the hardware\n";
+
+	write ( 2, msg, sizeof(msg) - 1 );
+	abort ();
+}
+
+void _fail ( const char *file, int line, const char *exp ) { no_hw (); }
+
+void timer_set_mode ( timer_dev *dev, uint8 channel, timer_mode mode ) { no_hw (); }
+
+void usart_config_gpios_async ( usart_dev *udev, struct gpio_dev *rx_dev, uint8 rx,
+	struct gpio_dev *tx_dev, uint8 tx, unsigned flags ) { no_hw (); }
+void usart_init ( usart_dev *dev ) { no_hw (); }
+void usart_enable ( usart_dev *dev ) { no_hw (); }
+void usart_set_baud_rate ( usart_dev *dev, uint32 clock_speed, uint32 baud ) { no_hw (); }
+int usart_set_buffers ( usart_dev *dev, uint8 *rx_buf, uint32 rx_size,
+	uint8 *tx_buf, uint32 tx_size ) { no_hw (); return -1; }
+uint32 usart_write ( usart_dev *dev, const uint8 *buf, uint32 len ) { no_hw (); return 0; }
+uint32 usart_rx ( usart_dev *dev, uint8 *buf, uint32 len ) { no_hw (); return 0; }
+void usart_tx_drain ( usart_dev *dev ) { no_hw (); }
+int usart_rx_dma_enable ( usart_dev *dev ) { no_hw (); return -1; }
+int usart_set_lines ( usart_dev *dev, char *pool, uint32 nbufs,
+	uint32 max, const char *terms ) { no_hw (); return -1; }
+int usart_readline ( usart_dev *dev, char **line ) { no_hw (); return -1; }
+void usart_get_stats ( usart_dev *dev, usart_stats *stats ) { no_hw (); }
+
+void usb_serial_wait ( void ) { no_hw (); }
+void usb_serial_write ( const char *buf, int len ) { no_hw (); }
+int usb_serial_read ( char *buf, int len ) { no_hw (); return 0; }
+int usb_serial_available ( void ) { no_hw (); return 0; }
+
+/* THE END */